@@ -0,0 +1,608 @@
+// Decoder throughput benchmark.
+//
+// Encodes a corpus of sine sweeps and white noise with the libav encoders
+// (MP3, AAC, Opus, FLAC, WAV, plus MP4 and MKV with a dummy video stream)
+// into `corpus_dir` if it is not there yet, then decodes every file with
+// decoder_slurp_memory and with a decoder_decode loop. Prints one JSON
+// object per line: a "meta" record, then one "result" per file and API,
+// with the best of `runs` runs.
+//
+//   ./bench [corpus_dir] [runs]
+//
+// linux
+//   gcc  : -O2 bench.c -o bench -lavformat -lavcodec -lavutil -lswresample -lpthread -lm
+//
+// Allocation counts are only available with glibc, they are -1 elsewhere.
+// Peak RSS is reset per measurement through /proc/self/clear_refs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define THREAD_IMPLEMENTATION
+#define DECODER_IMPLEMENTATION
+#include "decoder.h"
+
+#ifndef _WIN32
+#  include <sys/resource.h>
+#endif //_WIN32
+
+#define BENCH_PI 3.14159265358979323846
+
+#define BENCH_SAMPLE_RATE 48000
+#define BENCH_SECONDS 20
+#define BENCH_RUNS 5
+#define BENCH_DECODE_SAMPLES 4096
+#define BENCH_VIDEO_FPS 5
+
+#define return_defer(n) do{ result = (n); goto defer; }while(0)
+
+typedef struct{
+  const char *ext;
+  const char *codec;    // label in the output
+  const char *encoders; // comma separated, first available wins
+  int bit_rate;
+  bool video;
+}Bench_Format;
+
+static const Bench_Format bench_formats[] = {
+  { "mp3",  "mp3",    "libmp3lame",   192000, false },
+  { "m4a",  "aac",    "aac",          192000, false },
+  { "opus", "opus",   "libopus,opus", 128000, false },
+  { "flac", "flac",   "flac",         0,      false },
+  { "wav",  "pcm",    "pcm_s16le",    0,      false },
+  { "mp4",  "aac",    "aac",          192000, true  },
+  { "mkv",  "flac",   "flac",         0,      true  },
+};
+
+static const char *bench_signals[] = { "sweep", "noise" };
+
+typedef struct{
+  bool ok;
+  uint64_t ns;
+  uint64_t samples;
+  int sample_rate;
+  int64_t allocs;
+  int64_t alloc_bytes;
+  long peak_rss_kb;
+}Bench_Run;
+
+////////////////////////////////////////////////////////////////////////
+// Allocation counting: glibc lets the executable interpose malloc, libav
+// allocates through it as well
+
+#ifdef __GLIBC__
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static uint64_t bench_allocs = 0;
+static uint64_t bench_alloc_bytes = 0;
+
+static void bench_count(size_t size) {
+  __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&bench_alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+  bench_count(size);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  bench_count(count * size);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  bench_count(size);
+  return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  bench_count(size);
+  return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  bench_count(size);
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  if(alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  bench_count(size);
+  void *p = __libc_memalign(alignment, size);
+  if(!p) {
+    return ENOMEM;
+  }
+  *ptr = p;
+  return 0;
+}
+
+static void bench_allocs_read(int64_t *allocs, int64_t *bytes) {
+  *allocs = (int64_t) __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+  *bytes = (int64_t) __atomic_load_n(&bench_alloc_bytes, __ATOMIC_RELAXED);
+}
+
+#else
+
+static void bench_allocs_read(int64_t *allocs, int64_t *bytes) {
+  *allocs = -1;
+  *bytes = -1;
+}
+
+#endif //__GLIBC__
+
+////////////////////////////////////////////////////////////////////////
+// Peak RSS
+
+static void bench_rss_reset(void) {
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if(f) {
+    fputs("5", f);
+    fclose(f);
+  }
+}
+
+static long bench_rss_peak_kb(void) {
+  FILE *f = fopen("/proc/self/status", "r");
+  if(f) {
+    char line[256];
+    long kb = -1;
+    while(fgets(line, sizeof(line), f)) {
+      if(sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    if(kb >= 0) {
+      return kb;
+    }
+  }
+
+#ifndef _WIN32
+  // Peak of the whole process, cannot be reset
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage) == 0) {
+    return usage.ru_maxrss;
+  }
+#endif //_WIN32
+  return -1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Corpus
+
+// Exponential sweep 20 Hz - 20 kHz, or white noise, at -6 dBFS
+static void bench_signal(float *out, int samples, int64_t pos, int signal, double *phase, uint32_t *seed) {
+  double duration = (double) BENCH_SECONDS * BENCH_SAMPLE_RATE;
+  for(int i=0;i<samples;i++) {
+    float x;
+    if(signal == 0) {
+      double f = 20.0 * pow(1000.0, (double) (pos + i) / duration);
+      *phase += 2.0 * BENCH_PI * f / BENCH_SAMPLE_RATE;
+      if(*phase > 2.0 * BENCH_PI) *phase -= 2.0 * BENCH_PI;
+      x = 0.5f * (float) sin(*phase);
+    } else {
+      *seed ^= *seed << 13;
+      *seed ^= *seed >> 17;
+      *seed ^= *seed << 5;
+      x = 0.5f * ((float) *seed / 4294967295.f * 2.f - 1.f);
+    }
+    out[2 * i + 0] = x;
+    out[2 * i + 1] = signal == 0 ? x : -x;
+  }
+}
+
+static const AVCodec *bench_find_encoder(const char *encoders) {
+  char name[64];
+  while(*encoders) {
+    size_t len = strcspn(encoders, ",");
+    if(len < sizeof(name)) {
+      memcpy(name, encoders, len);
+      name[len] = 0;
+      const AVCodec *codec = avcodec_find_encoder_by_name(name);
+      if(codec) {
+	return codec;
+      }
+    }
+    encoders += len;
+    if(*encoders == ',') encoders++;
+  }
+  return NULL;
+}
+
+// First sample format the encoder takes, AVCodec.sample_fmts is deprecated
+// since libavcodec 61.13
+static enum AVSampleFormat bench_sample_fmt(const AVCodecContext *c, const AVCodec *codec) {
+  const enum AVSampleFormat *fmts = NULL;
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 13, 100)
+  int fmts_count = 0;
+  if(avcodec_get_supported_config(c, codec, AV_CODEC_CONFIG_SAMPLE_FORMAT, 0,
+				  (const void **) &fmts, &fmts_count) < 0 || fmts_count <= 0) {
+    fmts = NULL;
+  }
+#else
+  (void) c;
+  fmts = codec->sample_fmts;
+#endif //LIBAVCODEC_VERSION_INT
+  return fmts ? fmts[0] : AV_SAMPLE_FMT_S16;
+}
+
+// Sends frame (NULL flushes) and writes whatever the encoder returns
+static bool bench_write(AVFormatContext *oc, AVCodecContext *c, AVStream *st, AVFrame *frame) {
+  if(avcodec_send_frame(c, frame) < 0) {
+    return false;
+  }
+
+  AVPacket *packet = av_packet_alloc();
+  if(!packet) {
+    return false;
+  }
+
+  bool ok = true;
+  while(ok) {
+    int ret = avcodec_receive_packet(c, packet);
+    if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+      break;
+    }
+    if(ret < 0) {
+      ok = false;
+      break;
+    }
+    av_packet_rescale_ts(packet, c->time_base, st->time_base);
+    packet->stream_index = st->index;
+    ok = av_interleaved_write_frame(oc, packet) >= 0;
+  }
+
+  av_packet_free(&packet);
+  return ok;
+}
+
+static bool bench_encode(const char *path, const Bench_Format *format, int signal) {
+  bool result = true;
+
+  AVFormatContext *oc = NULL;
+  AVCodecContext *ac = NULL;
+  AVCodecContext *vc = NULL;
+  SwrContext *swr = NULL;
+  AVFrame *frame = NULL;
+  AVFrame *picture = NULL;
+  float *pcm = NULL;
+  bool header = false;
+
+  const AVCodec *audio_codec = bench_find_encoder(format->encoders);
+  const AVCodec *video_codec = format->video ? avcodec_find_encoder(AV_CODEC_ID_MPEG4) : NULL;
+  if(!audio_codec || (format->video && !video_codec)) {
+    fprintf(stderr, "bench: no encoder for %s, skipping\n", path);
+    return_defer(false);
+  }
+
+  if(avformat_alloc_output_context2(&oc, NULL, NULL, path) < 0) {
+    return_defer(false);
+  }
+
+  AVStream *ast = avformat_new_stream(oc, NULL);
+  ac = avcodec_alloc_context3(audio_codec);
+  if(!ast || !ac) {
+    return_defer(false);
+  }
+  AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
+  av_channel_layout_copy(&ac->ch_layout, &stereo);
+  ac->sample_rate = BENCH_SAMPLE_RATE;
+  ac->sample_fmt = bench_sample_fmt(ac, audio_codec);
+  ac->bit_rate = format->bit_rate;
+  ac->time_base = (AVRational) {1, BENCH_SAMPLE_RATE};
+  ac->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+  if(oc->oformat->flags & AVFMT_GLOBALHEADER) ac->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  if(avcodec_open2(ac, audio_codec, NULL) < 0 ||
+     avcodec_parameters_from_context(ast->codecpar, ac) < 0) {
+    return_defer(false);
+  }
+  ast->time_base = ac->time_base;
+
+  AVStream *vst = NULL;
+  if(format->video) {
+    vst = avformat_new_stream(oc, NULL);
+    vc = avcodec_alloc_context3(video_codec);
+    if(!vst || !vc) {
+      return_defer(false);
+    }
+    vc->width = 64;
+    vc->height = 64;
+    vc->pix_fmt = AV_PIX_FMT_YUV420P;
+    vc->time_base = (AVRational) {1, BENCH_VIDEO_FPS};
+    vc->framerate = (AVRational) {BENCH_VIDEO_FPS, 1};
+    vc->gop_size = BENCH_VIDEO_FPS;
+    vc->bit_rate = 50000;
+    if(oc->oformat->flags & AVFMT_GLOBALHEADER) vc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if(avcodec_open2(vc, video_codec, NULL) < 0 ||
+       avcodec_parameters_from_context(vst->codecpar, vc) < 0) {
+      return_defer(false);
+    }
+    vst->time_base = vc->time_base;
+
+    picture = av_frame_alloc();
+    if(!picture) {
+      return_defer(false);
+    }
+    picture->format = vc->pix_fmt;
+    picture->width = vc->width;
+    picture->height = vc->height;
+    if(av_frame_get_buffer(picture, 0) < 0) {
+      return_defer(false);
+    }
+  }
+
+  if(!(oc->oformat->flags & AVFMT_NOFILE) &&
+     avio_open(&oc->pb, path, AVIO_FLAG_WRITE) < 0) {
+    return_defer(false);
+  }
+  if(avformat_write_header(oc, NULL) < 0) {
+    return_defer(false);
+  }
+  header = true;
+
+  if(swr_alloc_set_opts2(&swr,
+			 &stereo, ac->sample_fmt, BENCH_SAMPLE_RATE,
+			 &stereo, AV_SAMPLE_FMT_FLT, BENCH_SAMPLE_RATE,
+			 0, NULL) < 0 ||
+     swr_init(swr) < 0) {
+    return_defer(false);
+  }
+
+  int frame_size = ac->frame_size > 0 ? ac->frame_size : 1024;
+  pcm = malloc((size_t) frame_size * 2 * sizeof(*pcm));
+  if(!pcm) {
+    return_defer(false);
+  }
+
+  int64_t total = (int64_t) BENCH_SECONDS * BENCH_SAMPLE_RATE;
+  int64_t video_pts = 0;
+  double phase = 0.0;
+  uint32_t seed = 0x9e3779b9;
+  for(int64_t pos=0;pos<total;) {
+    // Keep the video roughly interleaved with the audio
+    while(picture && video_pts * BENCH_SAMPLE_RATE <= pos * BENCH_VIDEO_FPS) {
+      if(av_frame_make_writable(picture) < 0) {
+	return_defer(false);
+      }
+      for(int p=0;p<3;p++) {
+	int height = p ? picture->height / 2 : picture->height;
+	memset(picture->data[p], p ? 128 : (int) (video_pts * 8 % 256), (size_t) picture->linesize[p] * height);
+      }
+      picture->pts = video_pts++;
+      if(!bench_write(oc, vc, vst, picture)) {
+	return_defer(false);
+      }
+    }
+
+    int n = total - pos < frame_size ? (int) (total - pos) : frame_size;
+    bench_signal(pcm, n, pos, signal, &phase, &seed);
+
+    frame = av_frame_alloc();
+    if(!frame) {
+      return_defer(false);
+    }
+    frame->nb_samples = n;
+    frame->format = ac->sample_fmt;
+    frame->sample_rate = BENCH_SAMPLE_RATE;
+    av_channel_layout_copy(&frame->ch_layout, &stereo);
+    if(av_frame_get_buffer(frame, 0) < 0) {
+      return_defer(false);
+    }
+    const unsigned char *in = (const unsigned char *) pcm;
+    if(swr_convert(swr, frame->data, n, &in, n) != n) {
+      return_defer(false);
+    }
+    frame->pts = pos;
+    if(!bench_write(oc, ac, ast, frame)) {
+      return_defer(false);
+    }
+    av_frame_free(&frame);
+    pos += n;
+  }
+
+  if(!bench_write(oc, ac, ast, NULL) ||
+     (vc && !bench_write(oc, vc, vst, NULL))) {
+    return_defer(false);
+  }
+
+ defer:
+  if(header && av_write_trailer(oc) < 0) result = false;
+  if(oc && !(oc->oformat->flags & AVFMT_NOFILE)) avio_closep(&oc->pb);
+  if(oc) avformat_free_context(oc);
+  if(ac) avcodec_free_context(&ac);
+  if(vc) avcodec_free_context(&vc);
+  if(swr) swr_free(&swr);
+  if(frame) av_frame_free(&frame);
+  if(picture) av_frame_free(&picture);
+  free(pcm);
+  if(!result) remove(path);
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Runs
+
+static bool bench_read_file(const char *path, char **data, size_t *size) {
+  FILE *f = fopen(path, "rb");
+  if(!f) {
+    return false;
+  }
+
+  bool ok = fseek(f, 0, SEEK_END) == 0;
+  long len = ok ? ftell(f) : -1;
+  ok = len > 0 && fseek(f, 0, SEEK_SET) == 0;
+  *data = ok ? malloc((size_t) len) : NULL;
+  ok = *data && fread(*data, (size_t) len, 1, f) == 1;
+  fclose(f);
+
+  if(!ok) {
+    free(*data);
+    return false;
+  }
+  *size = (size_t) len;
+  return true;
+}
+
+static void bench_slurp(const char *data, size_t size, Bench_Run *run) {
+  int channels;
+  unsigned char *samples;
+  unsigned int samples_count;
+  run->ok = decoder_slurp_memory(data, size, DECODER_FMT_FLT, 1.f,
+				 &channels, &run->sample_rate, &samples, &samples_count);
+  if(run->ok) {
+    run->samples = samples_count;
+    free(samples);
+  }
+}
+
+static void bench_decode(const char *data, size_t size, Bench_Run *run) {
+  Decoder_Memory memory = {
+    .data = (const unsigned char *) data,
+    .size = size,
+    .pos = 0,
+  };
+
+  Decoder decoder;
+  int channels;
+  if(!decoder_init(&decoder, decoder_memory_read, decoder_memory_seek, &memory,
+		   DECODER_FMT_FLT, 1.f, BENCH_DECODE_SAMPLES, &channels, &run->sample_rate)) {
+    run->ok = false;
+    return;
+  }
+
+  unsigned char *buffer = malloc((size_t) BENCH_DECODE_SAMPLES * decoder.sample_size);
+  run->ok = buffer != NULL;
+  int n;
+  while(run->ok && decoder_decode(&decoder, &n, buffer)) {
+    run->samples += (uint64_t) n;
+  }
+
+  free(buffer);
+  decoder_free(&decoder);
+}
+
+// Best wall time of `runs`, allocations and peak RSS of the last one
+static Bench_Run bench_measure(void (*fn)(const char *, size_t, Bench_Run *),
+			       const char *data, size_t size, int runs) {
+  Bench_Run best = {0};
+
+  Bench_Run warmup = {0};
+  fn(data, size, &warmup);
+  if(!warmup.ok) {
+    return best;
+  }
+
+  for(int i=0;i<runs;i++) {
+    Bench_Run run = {0};
+    bench_rss_reset();
+    int64_t allocs_before, bytes_before;
+    bench_allocs_read(&allocs_before, &bytes_before);
+
+    uint64_t start = decoder_now_ns();
+    fn(data, size, &run);
+    run.ns = decoder_now_ns() - start;
+
+    int64_t allocs_after, bytes_after;
+    bench_allocs_read(&allocs_after, &bytes_after);
+    run.allocs = allocs_before < 0 ? -1 : allocs_after - allocs_before;
+    run.alloc_bytes = bytes_before < 0 ? -1 : bytes_after - bytes_before;
+    run.peak_rss_kb = bench_rss_peak_kb();
+
+    if(!run.ok) {
+      return (Bench_Run) {0};
+    }
+    uint64_t best_ns = i == 0 || run.ns < best.ns ? run.ns : best.ns;
+    best = run;
+    best.ns = best_ns;
+  }
+
+  return best;
+}
+
+static void bench_print(const char *file, const Bench_Format *format, const char *signal,
+			const char *api, size_t bytes, int runs, const Bench_Run *run) {
+  double seconds = run->sample_rate > 0 ? (double) run->samples / run->sample_rate : 0.0;
+  double wall = (double) run->ns / 1e9;
+  printf("{\"type\":\"result\",\"file\":\"%s\",\"codec\":\"%s\",\"container\":\"%s\","
+	 "\"signal\":\"%s\",\"video\":%s,\"api\":\"%s\",\"ok\":%s,\"runs\":%d,\"bytes\":%zu,"
+	 "\"samples\":%llu,\"audio_seconds\":%.3f,\"wall_ns\":%llu,\"x_realtime\":%.2f,"
+	 "\"ns_per_sample\":%.3f,\"allocs\":%lld,\"alloc_bytes\":%lld,\"peak_rss_kb\":%ld}\n",
+	 file, format->codec, format->ext, signal, format->video ? "true" : "false", api,
+	 run->ok ? "true" : "false", runs, bytes,
+	 (unsigned long long) run->samples, seconds, (unsigned long long) run->ns,
+	 wall > 0.0 ? seconds / wall : 0.0,
+	 run->samples ? (double) run->ns / (double) run->samples : 0.0,
+	 (long long) run->allocs, (long long) run->alloc_bytes, run->peak_rss_kb);
+  fflush(stdout);
+}
+
+int main(int argc, const char **argv) {
+  const char *dir = argc > 1 ? argv[1] : "bench_corpus";
+  int runs = argc > 2 ? atoi(argv[2]) : BENCH_RUNS;
+  if(runs < 1) runs = 1;
+
+#ifdef _WIN32
+  CreateDirectoryA(dir, NULL);
+#else
+  mkdir(dir, 0755);
+#endif //_WIN32
+
+  printf("{\"type\":\"meta\",\"libavcodec\":\"%u.%u.%u\",\"libavformat\":\"%u.%u.%u\","
+	 "\"sample_rate\":%d,\"seconds\":%d,\"runs\":%d,\"decode_samples\":%d,\"counts_allocs\":%s}\n",
+	 avcodec_version() >> 16, (avcodec_version() >> 8) & 0xff, avcodec_version() & 0xff,
+	 avformat_version() >> 16, (avformat_version() >> 8) & 0xff, avformat_version() & 0xff,
+	 BENCH_SAMPLE_RATE, BENCH_SECONDS, runs, BENCH_DECODE_SAMPLES,
+#ifdef __GLIBC__
+	 "true"
+#else
+	 "false"
+#endif //__GLIBC__
+	 );
+
+  av_log_set_level(AV_LOG_ERROR);
+
+  for(size_t s=0;s<sizeof(bench_signals)/sizeof(*bench_signals);s++) {
+    for(size_t f=0;f<sizeof(bench_formats)/sizeof(*bench_formats);f++) {
+      const Bench_Format *format = &bench_formats[f];
+
+      char name[128];
+      char path[1024];
+      snprintf(name, sizeof(name), "%s_%s%s.%s", bench_signals[s], format->codec,
+	       format->video ? "_video" : "", format->ext);
+      snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+      FILE *exists = fopen(path, "rb");
+      if(exists) {
+	fclose(exists);
+      } else {
+	fprintf(stderr, "bench: encoding %s\n", path);
+	if(!bench_encode(path, format, (int) s)) {
+	  continue;
+	}
+      }
+
+      char *data;
+      size_t size;
+      if(!bench_read_file(path, &data, &size)) {
+	fprintf(stderr, "bench: could not read %s\n", path);
+	continue;
+      }
+
+      Bench_Run slurp = bench_measure(bench_slurp, data, size, runs);
+      bench_print(name, format, bench_signals[s], "decoder_slurp", size, runs, &slurp);
+      Bench_Run decode = bench_measure(bench_decode, data, size, runs);
+      bench_print(name, format, bench_signals[s], "decoder_decode", size, runs, &decode);
+
+      free(data);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,120 @@
+// Checks that decoder_slurp_memory_parallel is bit-exact with
+// decoder_slurp_memory.
+//
+// Decodes every file both ways and compares the sample counts and bytes.
+// Segments are at least DECODER_PARALLEL_MIN_SEGMENT_SECONDS long, so use
+// files of a few minutes, shorter ones just take the sequential path. So do
+// codecs outside decoder_parallel_codec.
+// Exits with 1 if any file differs.
+//
+//   ./check_parallel [-j threads] [-f s16|s32|flt] file...
+//
+// linux
+//   gcc  : -O2 check_parallel.c -o check_parallel -lavformat -lavcodec -lavutil -lswresample -lpthread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREAD_IMPLEMENTATION
+#define DECODER_IMPLEMENTATION
+#include "decoder.h"
+
+#define CHECK_THREADS 4
+
+static bool check_file(const char *path, Decoder_Fmt fmt, int threads) {
+  Decoder_Mmap m;
+  if(!decoder_mmap_open(&m, path)) {
+    printf("FAIL %s: can not open file\n", path);
+    return false;
+  }
+  const char *memory = (const char *) m.memory.data;
+  size_t memory_len = (size_t) m.memory.size;
+
+  bool result = false;
+  unsigned char *seq = NULL;
+  unsigned char *par = NULL;
+
+  int channels, sample_rate;
+  unsigned int seq_count;
+  if(!decoder_slurp_memory(memory, memory_len, fmt, 1.f,
+			   &channels, &sample_rate, &seq, &seq_count)) {
+    printf("FAIL %s: sequential decode failed\n", path);
+    goto defer;
+  }
+
+  int par_channels, par_sample_rate;
+  unsigned int par_count;
+  if(!decoder_slurp_memory_parallel(memory, memory_len, fmt, 1.f, threads,
+				    &par_channels, &par_sample_rate, &par, &par_count)) {
+    printf("FAIL %s: parallel decode failed\n", path);
+    goto defer;
+  }
+
+  if(par_channels != channels || par_sample_rate != sample_rate) {
+    printf("FAIL %s: %d ch %d Hz, parallel %d ch %d Hz\n",
+	   path, channels, sample_rate, par_channels, par_sample_rate);
+    goto defer;
+  }
+  if(par_count != seq_count) {
+    printf("FAIL %s: %u samples, parallel %u\n", path, seq_count, par_count);
+    goto defer;
+  }
+
+  int bits;
+  decoder_fmt_to_bits_per_sample(&bits, fmt);
+  size_t sample_size = (size_t) channels * (size_t) bits / 8;
+  for(unsigned int i=0;i<seq_count;i++) {
+    if(memcmp(seq + i * sample_size, par + i * sample_size, sample_size) != 0) {
+      printf("FAIL %s: first difference at sample %u (%.3fs)\n",
+	     path, i, (double) i / sample_rate);
+      goto defer;
+    }
+  }
+
+  printf("ok   %s: %u samples, %d ch %d Hz\n", path, seq_count, channels, sample_rate);
+  result = true;
+
+ defer:
+  free(seq);
+  free(par);
+  decoder_mmap_close(&m);
+  return result;
+}
+
+int main(int argc, const char **argv) {
+  int threads = CHECK_THREADS;
+  Decoder_Fmt fmt = DECODER_FMT_S16;
+
+  int i = 1;
+  for(;i<argc;i++) {
+    if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      const char *f = argv[++i];
+      if(strcmp(f, "s16") == 0) fmt = DECODER_FMT_S16;
+      else if(strcmp(f, "s32") == 0) fmt = DECODER_FMT_S32;
+      else if(strcmp(f, "flt") == 0) fmt = DECODER_FMT_FLT;
+      else {
+	fprintf(stderr, "ERROR: unknown format '%s'\n", f);
+	return 1;
+      }
+    } else {
+      break;
+    }
+  }
+  if(i >= argc) {
+    fprintf(stderr, "Usage: %s [-j threads] [-f s16|s32|flt] file...\n", argv[0]);
+    return 1;
+  }
+
+  int failed = 0;
+  for(;i<argc;i++) {
+    if(!check_file(argv[i], fmt, threads)) failed++;
+  }
+  if(failed > 0) {
+    printf("%d file(s) differ\n", failed);
+    return 1;
+  }
+  return 0;
+}
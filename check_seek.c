@@ -0,0 +1,247 @@
+// Checks decoder_seek against decoding from the start, and the seek index
+// sidecar.
+//
+// Decodes every file once with decoder_slurp_memory, then seeks a second
+// Decoder to a fixed set of positions and compares what it decodes from
+// there with the same range of the slurped samples. The positions are
+// checked without an index, with the index built by that first pass, and
+// with the index saved and loaded again. The sidecar is also loaded with
+// a wrong key and with an oversized entry count, both must fail.
+// Exits with 1 on any mismatch.
+//
+// Use aac in mp4 rather than raw adts: after seeking back to the first
+// adts frame it decodes a few LSB off, avcodec_flush_buffers keeps the
+// window shape of the frame decoded last. Ogg can land after the target,
+// which decoder.seek_late reports.
+//
+//   ./check_seek file...
+//
+// linux
+//   gcc  : -O2 check_seek.c -o check_seek -lavformat -lavcodec -lavutil -lswresample -lpthread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREAD_IMPLEMENTATION
+#define DECODER_IMPLEMENTATION
+#include "decoder.h"
+
+#define CHECK_SEEKS 24
+#define CHECK_SAMPLES 8192
+
+typedef struct{
+  const char *path;
+  Decoder_Memory memory;
+  unsigned char *samples;
+  unsigned int samples_count;
+  int sample_size;
+  int sample_rate;
+}Check;
+
+// Positions: the start, a few near it, pseudo-random ones and the end
+static int64_t check_pos(const Check *c, int i) {
+  int64_t count = (int64_t) c->samples_count;
+  switch(i) {
+  case 0: return 0;
+  case 1: return 1;
+  case 2: return 1151;
+  case 3: return count > CHECK_SAMPLES ? count - CHECK_SAMPLES : 0;
+  case 4: return count > 1 ? count - 1 : 0;
+  default: {
+    uint64_t x = (uint64_t) i * 0x9E3779B97F4A7C15ull;
+    x ^= x >> 29;
+    return (int64_t) (x % (uint64_t) count);
+  } break;
+  }
+}
+
+static bool check_seeks(Check *c, Decoder_Index *index, const char *what) {
+  Decoder_Memory mem = c->memory;
+  Decoder decoder;
+  int channels, sample_rate;
+  if(!decoder_init(&decoder, decoder_memory_read, decoder_memory_seek, &mem,
+		   DECODER_FMT_S16, 1.f, DECODER_SLURP_SAMPLES, &channels, &sample_rate)) {
+    printf("FAIL %s: decoder_init\n", c->path);
+    return false;
+  }
+  decoder.index = index;
+
+  bool result = false;
+  unsigned char *buf = malloc((size_t) (CHECK_SAMPLES + DECODER_SLURP_SAMPLES) * c->sample_size);
+  if(!buf) {
+    goto defer;
+  }
+
+  // Backwards and forwards, so that both directions are covered
+  for(int k=0;k<CHECK_SEEKS;k++) {
+    int i = k % 2 ? CHECK_SEEKS - k : k;
+    int64_t pos = check_pos(c, i);
+    if(!decoder_seek(&decoder, pos)) {
+      printf("FAIL %s: %s: seek to %lld failed\n", c->path, what, (long long) pos);
+      goto defer;
+    }
+
+    int64_t want = (int64_t) c->samples_count - pos;
+    if(want > CHECK_SAMPLES) want = CHECK_SAMPLES;
+    int64_t got = 0;
+    int n;
+    while(got < want && decoder_decode(&decoder, &n, buf + got * c->sample_size)) {
+      got += n;
+    }
+    if(got < want) {
+      printf("FAIL %s: %s: %lld samples after %lld, expected %lld\n",
+	     c->path, what, (long long) got, (long long) pos, (long long) want);
+      goto defer;
+    }
+    for(int64_t j=0;j<want;j++) {
+      if(memcmp(buf + j * c->sample_size,
+		c->samples + (pos + j) * c->sample_size, (size_t) c->sample_size) != 0) {
+	printf("FAIL %s: %s: seek to %lld (%.3fs) differs at +%lld\n",
+	       c->path, what, (long long) pos, (double) pos / c->sample_rate, (long long) j);
+	goto defer;
+      }
+    }
+  }
+
+  printf("ok   %s: %s: %d seeks\n", c->path, what, CHECK_SEEKS);
+  result = true;
+
+ defer:
+  free(buf);
+  decoder.index = NULL;
+  decoder_free(&decoder);
+  return result;
+}
+
+// Decodes the whole file with the index attached, which completes it
+static bool check_index_build(Check *c, Decoder_Index *index) {
+  Decoder_Memory mem = c->memory;
+  Decoder decoder;
+  int channels, sample_rate;
+  if(!decoder_init(&decoder, decoder_memory_read, decoder_memory_seek, &mem,
+		   DECODER_FMT_S16, 1.f, DECODER_SLURP_SAMPLES, &channels, &sample_rate)) {
+    return false;
+  }
+  decoder.index = index;
+
+  unsigned char *buf = malloc((size_t) DECODER_SLURP_SAMPLES * c->sample_size);
+  int n;
+  while(buf && decoder_decode(&decoder, &n, buf)) ;
+  free(buf);
+
+  decoder.index = NULL;
+  decoder_free(&decoder);
+  return index->complete && index->len > 0;
+}
+
+static bool check_sidecar(Check *c, Decoder_Index *index, const char *sidecar) {
+  uint64_t key;
+  if(!decoder_probe_identity(c->path, &key)) {
+    printf("FAIL %s: decoder_probe_identity\n", c->path);
+    return false;
+  }
+  if(!decoder_index_save(index, sidecar, key)) {
+    printf("FAIL %s: decoder_index_save\n", c->path);
+    return false;
+  }
+
+  Decoder_Index loaded;
+  if(decoder_index_load(&loaded, sidecar, key + 1)) {
+    printf("FAIL %s: sidecar loaded with a wrong key\n", c->path);
+    decoder_index_free(&loaded);
+    return false;
+  }
+  if(!decoder_index_load(&loaded, sidecar, key)) {
+    printf("FAIL %s: decoder_index_load\n", c->path);
+    return false;
+  }
+  bool same = loaded.len == index->len &&
+    loaded.stream_index == index->stream_index &&
+    av_cmp_q(loaded.time_base, index->time_base) == 0 &&
+    memcmp(loaded.items, index->items, index->len * sizeof(*index->items)) == 0;
+  if(!same) {
+    printf("FAIL %s: loaded index differs\n", c->path);
+    decoder_index_free(&loaded);
+    return false;
+  }
+  bool result = check_seeks(c, &loaded, "loaded index");
+  decoder_index_free(&loaded);
+  if(!result) {
+    return false;
+  }
+
+  // The count sits after u32 magic, 3 * i32 and u64 key
+  FILE *f = fopen(sidecar, "r+b");
+  uint64_t len = (uint64_t) DECODER_INDEX_MAX_ENTRIES + 1;
+  bool written = f &&
+    fseek(f, 4 + 3 * 4 + 8, SEEK_SET) == 0 &&
+    fwrite(&len, sizeof(len), 1, f) == 1;
+  if(f) fclose(f);
+  if(!written) {
+    printf("FAIL %s: could not rewrite the sidecar\n", c->path);
+    return false;
+  }
+  if(decoder_index_load(&loaded, sidecar, key)) {
+    printf("FAIL %s: sidecar loaded with %llu entries\n", c->path, (unsigned long long) len);
+    decoder_index_free(&loaded);
+    return false;
+  }
+
+  printf("ok   %s: sidecar, %zu entries\n", c->path, index->len);
+  return true;
+}
+
+static bool check_file(const char *path, const char *sidecar) {
+  Decoder_Mmap m;
+  if(!decoder_mmap_open(&m, path)) {
+    printf("FAIL %s: can not open file\n", path);
+    return false;
+  }
+
+  Check c = { .path = path, .memory = m.memory };
+  int channels;
+  if(!decoder_slurp_memory((const char *) m.memory.data, (size_t) m.memory.size,
+			   DECODER_FMT_S16, 1.f, &channels, &c.sample_rate,
+			   &c.samples, &c.samples_count) || c.samples_count == 0) {
+    printf("FAIL %s: decode failed\n", path);
+    decoder_mmap_close(&m);
+    return false;
+  }
+  c.sample_size = channels * 2;
+
+  Decoder_Index index = {0};
+  bool result = check_seeks(&c, NULL, "no index");
+  if(result && !check_index_build(&c, &index)) {
+    printf("FAIL %s: index not completed\n", path);
+    result = false;
+  }
+  if(result) result = check_seeks(&c, &index, "index");
+  if(result) result = check_sidecar(&c, &index, sidecar);
+
+  remove(sidecar);
+  decoder_index_free(&index);
+  free(c.samples);
+  decoder_mmap_close(&m);
+  return result;
+}
+
+int main(int argc, const char **argv) {
+  if(argc < 2) {
+    fprintf(stderr, "Usage: %s file...\n", argv[0]);
+    return 1;
+  }
+
+  char sidecar[256];
+  snprintf(sidecar, sizeof(sidecar), "/tmp/check_seek.%d.idx", (int) getpid());
+
+  int failed = 0;
+  for(int i=1;i<argc;i++) {
+    if(!check_file(argv[i], sidecar)) failed++;
+  }
+  if(failed > 0) {
+    printf("%d file(s) failed\n", failed);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,210 @@
+// Checks Decoder_Stream against a local FIFO writer (POSIX only).
+//
+// A child process writes a known byte pattern into a FIFO in uneven
+// chunks. The parent reads it through decoder_stream_read and compares,
+// and checks that the FIFO is reported as not seekable. Given a media
+// file, it also feeds the file through the FIFO and checks that
+// decoder_slurp_file over the FIFO matches decoding the file directly.
+// Exits with 1 on any mismatch.
+//
+//   ./check_stream [file...]
+//
+// linux
+//   gcc  : -O2 check_stream.c -o check_stream -lavformat -lavcodec -lavutil -lswresample -lpthread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREAD_IMPLEMENTATION
+#define DECODER_IMPLEMENTATION
+#include "decoder.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#define CHECK_PATTERN_BYTES (3 * 1024 * 1024 + 17)
+
+static unsigned char check_pattern_byte(size_t i) {
+  uint32_t x = (uint32_t) i * 2654435761u;
+  return (unsigned char) (x >> 24);
+}
+
+// Child: writes the pattern, or the file at `path`, into the FIFO
+static void check_writer(const char *fifo, const char *path) {
+  FILE *out = fopen(fifo, "wb");
+  if(!out) {
+    _exit(1);
+  }
+
+  unsigned char buf[4099];
+  if(path) {
+    FILE *in = fopen(path, "rb");
+    if(!in) {
+      _exit(1);
+    }
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+      if(fwrite(buf, 1, n, out) != n) _exit(1);
+      fflush(out);
+    }
+    fclose(in);
+  } else {
+    // Uneven chunks, so reads see short counts
+    size_t i = 0;
+    size_t chunk = 1;
+    while(i < CHECK_PATTERN_BYTES) {
+      size_t n = chunk;
+      if(n > CHECK_PATTERN_BYTES - i) n = CHECK_PATTERN_BYTES - i;
+      for(size_t j=0;j<n;j++) buf[j] = check_pattern_byte(i + j);
+      if(fwrite(buf, 1, n, out) != n) _exit(1);
+      fflush(out);
+      i += n;
+      chunk = chunk * 7 % sizeof(buf) + 1;
+    }
+  }
+
+  fclose(out);
+  _exit(0);
+}
+
+static bool check_spawn(pid_t *pid, const char *fifo, const char *path) {
+  *pid = fork();
+  if(*pid < 0) {
+    return false;
+  }
+  if(*pid == 0) {
+    check_writer(fifo, path);
+  }
+  return true;
+}
+
+static bool check_wait(pid_t pid) {
+  int status;
+  return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool check_pattern(const char *fifo) {
+  pid_t pid;
+  if(!check_spawn(&pid, fifo, NULL)) {
+    printf("FAIL pattern: fork\n");
+    return false;
+  }
+
+  bool result = false;
+  Decoder_Stream s;
+  if(!decoder_stream_open(&s, fifo)) {
+    printf("FAIL pattern: decoder_stream_open\n");
+    kill(pid, SIGKILL);
+    check_wait(pid);
+    return false;
+  }
+
+  if(s.seekable || decoder_stream_seek(&s, 0, AVSEEK_SIZE) >= 0) {
+    printf("FAIL pattern: FIFO reported as seekable\n");
+    goto defer;
+  }
+
+  size_t pos = 0;
+  int size = 1;
+  unsigned char buf[65536];
+  int n;
+  while((n = decoder_stream_read(&s, buf, size)) > 0) {
+    for(int j=0;j<n;j++) {
+      if(buf[j] != check_pattern_byte(pos + j)) {
+	printf("FAIL pattern: byte %zu differs\n", pos + j);
+	goto defer;
+      }
+    }
+    pos += (size_t) n;
+    size = size * 5 % (int) sizeof(buf) + 1;
+  }
+  if(n != AVERROR_EOF) {
+    printf("FAIL pattern: read returned %d\n", n);
+    goto defer;
+  }
+  if(pos != CHECK_PATTERN_BYTES) {
+    printf("FAIL pattern: %zu bytes, expected %d\n", pos, CHECK_PATTERN_BYTES);
+    goto defer;
+  }
+
+  printf("ok   pattern: %zu bytes\n", pos);
+  result = true;
+
+ defer:
+  decoder_stream_close(&s);
+  if(!result) kill(pid, SIGKILL);
+  if(!check_wait(pid) && result) {
+    printf("FAIL pattern: writer failed\n");
+    result = false;
+  }
+  return result;
+}
+
+static bool check_decode(const char *fifo, const char *path) {
+  int channels, sample_rate;
+  unsigned char *expect;
+  unsigned int expect_count;
+  if(!decoder_slurp_file(path, DECODER_FMT_S16, 1.f,
+			 &channels, &sample_rate, &expect, &expect_count)) {
+    printf("FAIL %s: direct decode failed\n", path);
+    return false;
+  }
+
+  pid_t pid;
+  if(!check_spawn(&pid, fifo, path)) {
+    printf("FAIL %s: fork\n", path);
+    free(expect);
+    return false;
+  }
+
+  bool result = false;
+  int fifo_channels, fifo_sample_rate;
+  unsigned char *samples = NULL;
+  unsigned int samples_count;
+  if(!decoder_slurp_file(fifo, DECODER_FMT_S16, 1.f,
+			 &fifo_channels, &fifo_sample_rate, &samples, &samples_count)) {
+    printf("FAIL %s: decode over the FIFO failed\n", path);
+    goto defer;
+  }
+  if(fifo_channels != channels || fifo_sample_rate != sample_rate ||
+     samples_count != expect_count ||
+     memcmp(samples, expect, (size_t) samples_count * channels * 2) != 0) {
+    printf("FAIL %s: %u samples, over the FIFO %u\n", path, expect_count, samples_count);
+    goto defer;
+  }
+
+  printf("ok   %s: %u samples over the FIFO\n", path, samples_count);
+  result = true;
+
+ defer:
+  // The demuxer may stop before the writer is done, e.g. at a trailer
+  kill(pid, SIGKILL);
+  check_wait(pid);
+  free(samples);
+  free(expect);
+  return result;
+}
+
+int main(int argc, const char **argv) {
+  char fifo[256];
+  snprintf(fifo, sizeof(fifo), "/tmp/check_stream.%d.fifo", (int) getpid());
+  if(mkfifo(fifo, 0600) < 0) {
+    fprintf(stderr, "ERROR: could not create %s\n", fifo);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  int failed = 0;
+  if(!check_pattern(fifo)) failed++;
+  for(int i=1;i<argc;i++) {
+    if(!check_decode(fifo, argv[i])) failed++;
+  }
+
+  unlink(fifo);
+  if(failed > 0) {
+    printf("%d check(s) failed\n", failed);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,358 @@
+// Checks Decoder_Url against a local HTTP/1.1 server (POSIX only).
+//
+// A child process serves a known byte pattern on 127.0.0.1, a path per
+// behaviour:
+//   /range    206 for every Range, kept alive
+//   /close    206, but Connection: close after every response
+//   /ignore   200 with the whole body, Range is ignored
+//   /unknown  206 with an unknown total (bytes a-b/*), 416 past the end
+// The parent reads each one straight through and with a random sequence of
+// seeks and reads, compares every byte with the pattern, and checks how
+// many connections and requests Decoder_Url needed.
+// Exits with 1 on any mismatch.
+//
+//   ./check_url
+//
+// linux
+//   gcc  : -O2 check_url.c -o check_url -lavformat -lavcodec -lavutil -lswresample -lpthread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREAD_IMPLEMENTATION
+#define DECODER_IMPLEMENTATION
+#include "decoder.h"
+
+#include <signal.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+
+// Larger than DECODER_URL_WINDOW_MAX, so the window grows to the limit
+#define CHECK_BYTES (5 * 1024 * 1024 + 17)
+#define CHECK_OPS 300
+#define CHECK_READ_MAX 200000
+
+typedef enum{
+  CHECK_RANGE = 0,
+  CHECK_CLOSE,
+  CHECK_IGNORE,
+  CHECK_UNKNOWN,
+  CHECK_MODES,
+}Check_Mode;
+
+static const char *check_paths[CHECK_MODES] = { "/range", "/close", "/ignore", "/unknown" };
+
+static unsigned char check_pattern_byte(size_t i) {
+  uint32_t x = (uint32_t) i * 2654435761u;
+  return (unsigned char) (x >> 24);
+}
+
+static bool check_send(int fd, const void *data, size_t len) {
+  const char *p = data;
+  while(len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if(n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= (size_t) n;
+  }
+  return true;
+}
+
+static bool check_send_body(int fd, long long first, long long last) {
+  unsigned char buf[16384];
+  long long pos = first;
+  while(pos <= last) {
+    size_t n = sizeof(buf);
+    if((long long) n > last - pos + 1) n = (size_t) (last - pos + 1);
+    for(size_t j=0;j<n;j++) buf[j] = check_pattern_byte((size_t) pos + j);
+    if(!check_send(fd, buf, n)) {
+      return false;
+    }
+    pos += (long long) n;
+  }
+  return true;
+}
+
+// Answers one request, false once the connection is done
+static bool check_respond(int fd, const char *request) {
+  char path[256];
+  if(sscanf(request, "GET %255s HTTP/1.1", path) != 1) {
+    return false;
+  }
+  int mode = 0;
+  while(mode < CHECK_MODES && strcmp(path, check_paths[mode]) != 0) mode++;
+  if(mode == CHECK_MODES) {
+    const char *missing = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    return check_send(fd, missing, strlen(missing));
+  }
+
+  long long first = 0, last = CHECK_BYTES - 1;
+  const char *range = strstr(request, "\r\nRange: bytes=");
+  bool ranged = range && sscanf(range + 15, "%lld-%lld", &first, &last) == 2;
+  const char *connection = mode == CHECK_CLOSE ? "Connection: close\r\n" : "";
+
+  char head[512];
+  if(mode == CHECK_IGNORE || !ranged) {
+    snprintf(head, sizeof(head),
+	     "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", CHECK_BYTES);
+    return check_send(fd, head, strlen(head)) && check_send_body(fd, 0, CHECK_BYTES - 1);
+  }
+
+  if(first >= CHECK_BYTES) {
+    snprintf(head, sizeof(head),
+	     "HTTP/1.1 416 Range Not Satisfiable\r\n"
+	     "Content-Range: bytes */%d\r\n"
+	     "Content-Length: 0\r\n%s\r\n", CHECK_BYTES, connection);
+    return check_send(fd, head, strlen(head)) && mode != CHECK_CLOSE;
+  }
+
+  if(last >= CHECK_BYTES) last = CHECK_BYTES - 1;
+  char total[32];
+  if(mode == CHECK_UNKNOWN) snprintf(total, sizeof(total), "*");
+  else snprintf(total, sizeof(total), "%d", CHECK_BYTES);
+  snprintf(head, sizeof(head),
+	   "HTTP/1.1 206 Partial Content\r\n"
+	   "Content-Range: bytes %lld-%lld/%s\r\n"
+	   "Content-Length: %lld\r\n%s\r\n",
+	   first, last, total, last - first + 1, connection);
+  return check_send(fd, head, strlen(head)) &&
+    check_send_body(fd, first, last) &&
+    mode != CHECK_CLOSE;
+}
+
+static void check_connection(int fd) {
+  char buf[8192];
+  size_t len = 0;
+  while(true) {
+    char *end;
+    buf[len] = 0;
+    while(!(end = strstr(buf, "\r\n\r\n"))) {
+      if(len == sizeof(buf) - 1) {
+	return;
+      }
+      ssize_t n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+      if(n <= 0) {
+	return;
+      }
+      len += (size_t) n;
+      buf[len] = 0;
+    }
+
+    size_t used = (size_t) (end + 4 - buf);
+    end[2] = 0;
+    if(!check_respond(fd, buf)) {
+      return;
+    }
+    memmove(buf, buf + used, len - used);
+    len -= used;
+  }
+}
+
+// Child: serves one connection at a time, Decoder_Url never holds two
+static void check_server(int listen_fd) {
+  while(true) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if(fd < 0) {
+      continue;
+    }
+    check_connection(fd);
+    close(fd);
+  }
+}
+
+static bool check_listen(int *listen_fd, int *port) {
+  *listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(*listen_fd < 0) {
+    return false;
+  }
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  if(bind(*listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+     listen(*listen_fd, 4) < 0 ||
+     getsockname(*listen_fd, (struct sockaddr *) &addr, &addr_len) < 0) {
+    close(*listen_fd);
+    return false;
+  }
+  *port = ntohs(addr.sin_port);
+  return true;
+}
+
+static bool check_compare(Check_Mode mode, const unsigned char *buf, size_t pos, size_t len) {
+  for(size_t j=0;j<len;j++) {
+    if(buf[j] != check_pattern_byte(pos + j)) {
+      printf("FAIL %s: byte %zu differs\n", check_paths[mode], pos + j);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reads `len` bytes at the current position, or up to the end
+static bool check_read(Check_Mode mode, Decoder_Url *u, unsigned char *buf, size_t len) {
+  size_t pos = (size_t) u->pos;
+  size_t expect = pos >= CHECK_BYTES ? 0 : CHECK_BYTES - pos;
+  if(expect > len) expect = len;
+
+  size_t got = 0;
+  int n = 0;
+  while(got < len && (n = decoder_url_read(u, buf + got, (int) (len - got))) > 0) {
+    got += (size_t) n;
+  }
+  if(got != expect || (got < len && n != AVERROR_EOF)) {
+    printf("FAIL %s: %zu bytes at %zu, expected %zu, last read %d\n",
+	   check_paths[mode], got, pos, expect, n);
+    return false;
+  }
+  return check_compare(mode, buf, pos, got);
+}
+
+static bool check_open(Check_Mode mode, int port, Decoder_Url *u) {
+  char url[256];
+  snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", port, check_paths[mode]);
+  if(!decoder_url_open(u, url)) {
+    printf("FAIL %s: decoder_url_open\n", check_paths[mode]);
+    return false;
+  }
+  if(u->seekable != (mode != CHECK_IGNORE)) {
+    printf("FAIL %s: seekable is %d\n", check_paths[mode], (int) u->seekable);
+    decoder_url_close(u);
+    return false;
+  }
+  return true;
+}
+
+static bool check_through(Check_Mode mode, int port) {
+  Decoder_Url u;
+  if(!check_open(mode, port, &u)) {
+    return false;
+  }
+
+  bool result = false;
+  unsigned char *buf = malloc(CHECK_BYTES + 1);
+  if(!buf || !check_read(mode, &u, buf, CHECK_BYTES + 1)) {
+    goto defer;
+  }
+  if(u.size != CHECK_BYTES) {
+    printf("FAIL %s: size %lld, expected %d\n", check_paths[mode], (long long) u.size, CHECK_BYTES);
+    goto defer;
+  }
+
+  bool counts;
+  switch(mode) {
+  case CHECK_RANGE: counts = u.connects == 1 && u.requests > 1; break;
+  case CHECK_CLOSE: counts = u.connects == u.requests && u.requests > 1; break;
+  case CHECK_IGNORE: counts = u.connects == 1 && u.requests == 1; break;
+  // The last request is the one answered with 416
+  case CHECK_UNKNOWN: counts = u.connects == 1 && u.requests > 1; break;
+  default: counts = false; break;
+  }
+  if(!counts) {
+    printf("FAIL %s: %d connections for %d requests\n", check_paths[mode], u.connects, u.requests);
+    goto defer;
+  }
+
+  printf("ok   %s: through, %d requests on %d connections\n", check_paths[mode], u.requests, u.connects);
+  result = true;
+
+ defer:
+  free(buf);
+  decoder_url_close(&u);
+  return result;
+}
+
+// Sequential, short forward skips, and jumps anywhere including past the
+// end. Without Range only forward.
+static bool check_random(Check_Mode mode, int port) {
+  Decoder_Url u;
+  if(!check_open(mode, port, &u)) {
+    return false;
+  }
+
+  bool result = false;
+  unsigned char *buf = malloc(CHECK_READ_MAX);
+  if(!buf) {
+    goto defer;
+  }
+
+  uint32_t seed = 12345u + (uint32_t) mode;
+  for(int i=0;i<CHECK_OPS;i++) {
+    seed = seed * 1103515245u + 12345u;
+    uint32_t r = seed >> 8;
+    int64_t pos = u.pos;
+    switch(r % 3) {
+    case 0: break;
+    case 1: pos += (int64_t) (r % DECODER_URL_WINDOW_MIN); break;
+    default: pos = (int64_t) (r % (CHECK_BYTES + 1024)); break;
+    }
+    if(mode == CHECK_IGNORE && pos < u.pos) {
+      pos = u.pos;
+    }
+    // The whole file was read, start over on a new connection
+    if(mode == CHECK_IGNORE && pos >= CHECK_BYTES) {
+      decoder_url_close(&u);
+      if(!check_open(mode, port, &u)) {
+	goto defer;
+      }
+      pos = 0;
+    }
+
+    if(decoder_url_seek(&u, pos, SEEK_SET) != pos) {
+      printf("FAIL %s: seek to %lld\n", check_paths[mode], (long long) pos);
+      goto defer;
+    }
+    seed = seed * 1103515245u + 12345u;
+    size_t len = 1 + (seed >> 8) % CHECK_READ_MAX;
+    if(!check_read(mode, &u, buf, len)) {
+      goto defer;
+    }
+  }
+
+  printf("ok   %s: %d seeks and reads, %d requests on %d connections\n",
+	 check_paths[mode], CHECK_OPS, u.requests, u.connects);
+  result = true;
+
+ defer:
+  free(buf);
+  decoder_url_close(&u);
+  return result;
+}
+
+int main(void) {
+  int listen_fd, port;
+  if(!check_listen(&listen_fd, &port)) {
+    fprintf(stderr, "ERROR: could not listen on 127.0.0.1\n");
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  pid_t pid = fork();
+  if(pid < 0) {
+    fprintf(stderr, "ERROR: fork\n");
+    return 1;
+  }
+  if(pid == 0) {
+    check_server(listen_fd);
+    _exit(0);
+  }
+  close(listen_fd);
+
+  int failed = 0;
+  for(int mode=0;mode<CHECK_MODES;mode++) {
+    if(!check_through((Check_Mode) mode, port)) failed++;
+    if(!check_random((Check_Mode) mode, port)) failed++;
+  }
+
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  if(failed > 0) {
+    printf("%d check(s) failed\n", failed);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,134 @@
+// Checks that spectrum_welch_snapshot on another thread never sees a torn
+// push.
+//
+// The main thread pushes the same spectrum over and over, so every
+// consistent snapshot, of each kind, equals the power of that one frame.
+// A reader thread takes snapshots while the pushes run and compares each
+// of them. A snapshot that mixed the sums of one push with the frame count
+// of another would be off by at least 1/frames.
+// Exits with 1 on any mismatch. Build it with -fsanitize=thread as well,
+// which must not report anything.
+//
+//   ./check_welch
+//
+// linux
+//   gcc  : -O2 check_welch.c -o check_welch -lpthread -lm
+//   tsan : -O1 -g -fsanitize=thread check_welch.c -o check_welch -lpthread -lm
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREAD_IMPLEMENTATION
+#include "thread.h"
+
+#define SPECTRUM_IMPLEMENTATION
+#include "spectrum.h"
+
+#define CHECK_N 1024
+#define CHECK_BINS (CHECK_N/2 + 1)
+#define CHECK_PUSHES 4000
+#define CHECK_BUCKET_FRAMES 50
+#define CHECK_TOLERANCE 1e-5f
+
+typedef struct{
+  Spectrum_Welch welch;
+  float expect[CHECK_BINS];
+
+  Mutex mutex;
+  bool done;
+
+  // Written by the reader
+  uint64_t snapshots;
+  uint64_t failures;
+}Check;
+
+static bool check_done(Check *c) {
+  mutex_lock(&c->mutex);
+  bool done = c->done;
+  mutex_release(&c->mutex);
+  return done;
+}
+
+static bool check_snapshot(Check *c, Spectrum_Welch_Kind kind, float *out) {
+  uint64_t frames = spectrum_welch_snapshot(&c->welch, kind, out);
+  if(frames == 0) {
+    return true;
+  }
+  for(size_t k=0;k<CHECK_BINS;k++) {
+    if(fabsf(out[k] - c->expect[k]) > CHECK_TOLERANCE * c->expect[k]) {
+      printf("FAIL kind %d: bin %zu is %g over %llu frames, expected %g\n",
+	     (int) kind, k, out[k], (unsigned long long) frames, c->expect[k]);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void *check_reader(void *arg) {
+  Check *c = arg;
+  static float out[CHECK_BINS];
+  while(!check_done(c)) {
+    for(int kind=SPECTRUM_WELCH_TOTAL;kind<=SPECTRUM_WELCH_WINDOW;kind++) {
+      if(!check_snapshot(c, (Spectrum_Welch_Kind) kind, out)) {
+	c->failures++;
+      }
+      c->snapshots++;
+    }
+  }
+  return NULL;
+}
+
+int main(void) {
+  static Check c;
+  static Spectrum_Complex frame[CHECK_N];
+  for(size_t k=0;k<CHECK_N;k++) {
+    frame[k] = (Spectrum_Complex) { .real = 1.0f + (float) (k % 7), .imag = (float) (k % 3) };
+  }
+
+  // What a single push gives, every later snapshot must match it
+  Spectrum_Welch one;
+  if(!spectrum_welch_init(&one, CHECK_N, 0.01f, CHECK_BUCKET_FRAMES) ||
+     !spectrum_welch_init(&c.welch, CHECK_N, 0.01f, CHECK_BUCKET_FRAMES)) {
+    fprintf(stderr, "ERROR: spectrum_welch_init\n");
+    return 1;
+  }
+  spectrum_welch_push(&one, frame);
+  spectrum_welch_snapshot(&one, SPECTRUM_WELCH_TOTAL, c.expect);
+  spectrum_welch_free(&one);
+
+  if(!mutex_create(&c.mutex)) {
+    fprintf(stderr, "ERROR: mutex_create\n");
+    return 1;
+  }
+  Thread id;
+  if(!thread_create(&id, check_reader, &c)) {
+    fprintf(stderr, "ERROR: thread_create\n");
+    return 1;
+  }
+
+  for(int i=0;i<CHECK_PUSHES;i++) {
+    spectrum_welch_push(&c.welch, frame);
+  }
+
+  mutex_lock(&c.mutex);
+  c.done = true;
+  mutex_release(&c.mutex);
+  thread_join(id);
+
+  // And once more after the last push, from this thread
+  static float out[CHECK_BINS];
+  for(int kind=SPECTRUM_WELCH_TOTAL;kind<=SPECTRUM_WELCH_WINDOW;kind++) {
+    if(!check_snapshot(&c, (Spectrum_Welch_Kind) kind, out)) c.failures++;
+  }
+
+  spectrum_welch_free(&c.welch);
+  mutex_free(&c.mutex);
+
+  if(c.failures > 0) {
+    printf("%llu snapshot(s) failed\n", (unsigned long long) c.failures);
+    return 1;
+  }
+  printf("ok   welch: %d pushes, %llu snapshots\n", CHECK_PUSHES, (unsigned long long) c.snapshots);
+  return 0;
+}
@@ -1,21 +1,47 @@
 #ifndef DECODER_H
 #define DECODER_H
 
-// TODO: implement seeking / seeking-api
-// TODO: Maybe add decoder_url_read / decoder_url_seek
-
 // win32
-//   mingw: -lavformat -lavcodec -lavutil -lswresample
-//   msvc : avformat.lib avcodec.lib avutil.lib swresample.lib
+//   mingw: -lavformat -lavcodec -lavutil -lswresample -lws2_32
+//   msvc : avformat.lib avcodec.lib avutil.lib swresample.lib ws2_32.lib
 
 // linux
-//   gcc  : -lavformat -lavcodec -lavutil -lswresample
+//   gcc  : -lavformat -lavcodec -lavutil -lswresample -lpthread
+//   32-bit builds need -D_FILE_OFFSET_BITS=64 for files above 2GB
+
+// Decoder_Prefetch and Decoder_Pipeline use thread.h, which decoder.h
+// includes itself. Define THREAD_IMPLEMENTATION once before the first
+// include of decoder.h. On win32 include decoder.h before windows.h,
+// winsock2.h has to come first
 
 #include <stdbool.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#  include <winsock2.h>
+#  include <ws2tcpip.h>
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <dirent.h>
+#  include <utime.h>
+#  include <errno.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <sys/socket.h>
+#  include <sys/un.h>
+#  include <sys/time.h>
+#  include <netdb.h>
+#  include <strings.h>
+#endif //_WIN32
+
+#include "thread.h"
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/channel_layout.h>
+#include <libavutil/mathematics.h>
 #include <libavutil/opt.h>
 #include <libswresample/swresample.h>
 
@@ -23,6 +49,12 @@
 #  define DECODER_DEF static inline
 #endif //DECODER_DEF
 
+#define DECODER_AVIO_BUFFER_SIZE (64 * 1024)
+#define DECODER_MMAP_WINDOW (4 * 1024 * 1024)
+#define DECODER_PREFETCH_CHUNK (1024 * 1024)
+#define DECODER_PREFETCH_CHUNKS 8
+#define DECODER_MAX_CHANNELS 64
+
 typedef enum {
   DECODER_FMT_NONE = 0,
   DECODER_FMT_U8,
@@ -38,6 +70,92 @@ typedef enum {
 }Decoder_Fmt;
 
 typedef struct Decoder Decoder;
+typedef struct Decoder_Pool Decoder_Pool;
+
+// Output channel mix. MONO and MID_SIDE downmix any input layout inside
+// swresample, MID_SIDE delivers (L+R)/2 and (L-R)/2 as two channels.
+typedef enum {
+  DECODER_MIX_NATIVE = 0,
+  DECODER_MIX_MONO,
+  DECODER_MIX_MID_SIDE,
+}Decoder_Mix;
+
+// Optional settings for decoder_init_options, zero means default
+typedef struct{
+  Decoder_Mix mix;
+  int sample_rate; // Output rate, e.g. 16000 for analysis. 0 keeps the source rate
+  int channels;    // Output channels for DECODER_MIX_NATIVE. 0 keeps the source layout
+
+  // Fast open: limits for avformat_find_stream_info, 0 keeps the libav defaults
+  int64_t probesize;       // bytes
+  int64_t analyzeduration; // microseconds
+
+  // Probe cache: the stream info of the source identified by probe_key
+  // (see decoder_probe_identity) is kept in probe_cache_dir, so reopening
+  // it skips avformat_find_stream_info. A probe_key of 0 disables the cache
+  const char *probe_cache_dir;
+  uint64_t probe_key;
+
+  // For sources that already hold the bytes (Decoder_Memory, Decoder_Mmap):
+  // the demuxer reads straight into its packets, skipping the copy into the
+  // AVIO buffer. Costs a call per read, so leave it off for stdio or sockets.
+  bool direct;
+
+  // Take contexts, packets and frames from the pool and give them back on
+  // decoder_free. Shareable between threads.
+  Decoder_Pool *pool;
+}Decoder_Options;
+
+#define DECODER_PROBE_MAGIC 0x42525044 // "DPRB"
+#define DECODER_PROBE_VERSION 1
+
+// What avformat_find_stream_info found out about the audio stream
+typedef struct{
+  uint32_t magic;
+  uint32_t version;
+  char format[32]; // first name of the demuxer, for av_find_input_format
+  int32_t stream_index;
+  int32_t codec_id;
+  int32_t sample_fmt;
+  int32_t sample_rate;
+  int32_t channels;
+  int32_t channel_order;
+  uint64_t channel_mask;
+  int64_t bit_rate;
+  int32_t block_align;
+  int32_t frame_size;
+  int32_t bits_per_coded_sample;
+  int32_t bits_per_raw_sample;
+  int32_t initial_padding;
+  int32_t trailing_padding;
+  int32_t seek_preroll;
+  int32_t profile;
+  int32_t time_base_num;
+  int32_t time_base_den;
+  int64_t start_time;
+  int64_t duration;
+  int64_t format_duration;
+  int32_t extradata_size;
+  int32_t reserved;
+}Decoder_Probe;
+
+#define DECODER_MAX_PLANES 8
+
+// Planar output (DECODER_FMT_S16P, DECODER_FMT_FLTP) goes through
+// decoder_decode_planar into one buffer per channel, each aligned to
+// DECODER_PLANE_ALIGN so consumers can run vector loops without a
+// deinterleave. decoder_planes_alloc sets such buffers up.
+#define DECODER_PLANE_ALIGN 64
+
+// A decoded frame lent out by decoder_frame_borrow. Points straight into
+// libav's AVFrame when no conversion is needed, otherwise into a buffer
+// owned by the decoder. Valid until decoder_frame_release.
+typedef struct{
+  const unsigned char *data[DECODER_MAX_PLANES];
+  int planes;  // 1 when interleaved, channels when planar
+  int samples;
+  Decoder_Fmt fmt;
+}Decoder_Frame;
 
 typedef int (*Decoder_Read)(void *opaque, uint8_t* buffer, int buffer_size);
 typedef int64_t (*Decoder_Seek)(void *opaque, int64_t offset, int whence);
@@ -48,6 +166,403 @@ typedef struct{
   uint64_t pos;
 }Decoder_Memory;
 
+// Read-only file mapping, served through the Decoder_Memory callbacks
+typedef struct{
+  Decoder_Memory memory;
+  uint64_t advised;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#else
+  int fd;
+#endif //_WIN32
+}Decoder_Mmap;
+
+// Sequential source: stdin ("-"), FIFOs, Unix domain sockets
+// ("unix:/path", POSIX only) and plain files. Pass decoder_stream_seek
+// only when `seekable`. Without a seek callback decoder_init never seeks
+// and bounds probing by DECODER_STREAM_PROBESIZE/ANALYZEDURATION.
+#define DECODER_STREAM_PROBESIZE (64 * 1024)
+#define DECODER_STREAM_ANALYZEDURATION (500 * 1000) // microseconds
+
+typedef struct{
+#ifdef _WIN32
+  HANDLE handle;
+#else
+  int fd;
+#endif //_WIN32
+  bool owned; // false for stdin
+  bool seekable;
+}Decoder_Stream;
+
+// HTTP source ("http://host[:port]/path", no TLS). Reads go through a
+// window filled by one Range request each, over a kept-alive connection.
+// The window doubles on sequential reads up to DECODER_URL_WINDOW_MAX and
+// drops back to DECODER_URL_WINDOW_MIN after a seek. Servers that ignore
+// Range are read front to back, `seekable` is false then.
+#define DECODER_URL_WINDOW_MIN (64 * 1024)
+#define DECODER_URL_WINDOW_MAX (4 * 1024 * 1024)
+#define DECODER_URL_TIMEOUT_MS 10000
+#define DECODER_URL_HEAD_SIZE (8 * 1024)
+
+typedef struct{
+  char host[256];
+  char port[8];
+  char path[2048];
+
+#ifdef _WIN32
+  SOCKET fd;
+#else
+  int fd;
+#endif //_WIN32
+  bool connected;
+  bool keep_alive;
+  bool seekable;
+  
+  int64_t size; // -1 until known
+  int64_t pos;
+
+  // Response on the connection: offset of its next body byte, and how many
+  // are left (-1 reads until the server closes)
+  int64_t body_pos;
+  int64_t body_left;
+
+  unsigned char *window;
+  int64_t window_pos;
+  size_t window_len;
+  size_t readahead;
+
+  // Received but not yet consumed bytes
+  char head[DECODER_URL_HEAD_SIZE];
+  size_t head_pos;
+  size_t head_len;
+
+  int requests;
+  int connects;
+}Decoder_Url;
+
+// Read-ahead source: an I/O thread keeps a bounded ring of chunks filled
+// ahead of the read position, so slow storage does not stall decoding.
+// Reads either a file with positional reads (pread / overlapped ReadFile)
+// or wraps any other Decoder_Read/Decoder_Seek source.
+typedef struct{
+  unsigned char *data;
+  int64_t offset;
+  int size;
+}Decoder_Prefetch_Chunk;
+
+typedef struct{
+#ifdef _WIN32
+  HANDLE file;
+#else
+  int fd;
+#endif //_WIN32
+  Decoder_Read read;
+  Decoder_Seek seek;
+  void *opaque;
+  int64_t opaque_pos;
+  int64_t size;
+
+  Thread thread;
+  Mutex mutex;
+  Cond cond;
+  bool quit;
+
+  Decoder_Prefetch_Chunk chunks[DECODER_PREFETCH_CHUNKS];
+  size_t head;
+  size_t count;
+  int64_t fetch_pos;
+  int64_t pos;
+  uint64_t generation; // bumped by a seek, cancels the fetch in flight
+  bool eof;
+  int error;
+
+  // Stats, read under mutex
+  uint64_t stalls;
+  uint64_t stall_ns;
+  uint64_t bytes_fetched;
+}Decoder_Prefetch;
+
+// Arena for decoder_slurp_chunks: fixed-size blocks with 64-byte aligned
+// data, each holding whole samples. Walk first->next, no concatenation, so
+// the peak stays at the decoded size plus one block.
+#define DECODER_CHUNK_SIZE (1 << 20)
+#define DECODER_SLURP_SAMPLES 4096
+
+// decoder_slurp_*_parallel: segments are at least this long, and each one
+// starts decoding this many samples early so it matches sequential output
+#define DECODER_PARALLEL_MIN_SEGMENT_SECONDS 30
+#define DECODER_PARALLEL_PREROLL 8192
+
+// FF_PROFILE_* became AV_PROFILE_* in libavcodec 60.31
+#ifdef AV_PROFILE_AAC_LOW
+#define DECODER_PROFILE_AAC_LOW AV_PROFILE_AAC_LOW
+#else
+#define DECODER_PROFILE_AAC_LOW FF_PROFILE_AAC_LOW
+#endif
+
+typedef struct Decoder_Chunk Decoder_Chunk;
+
+struct Decoder_Chunk{
+  Decoder_Chunk *next;
+  unsigned char *data;
+  unsigned int samples_count;
+};
+
+typedef struct{
+  Decoder_Chunk *first;
+  Decoder_Chunk *last;
+  int sample_size;
+  uint64_t samples_count;
+}Decoder_Chunks;
+
+typedef struct{
+  Decoder_Memory memory;
+  Decoder_Fmt fmt;
+  float volume;
+
+  int64_t start;
+  int64_t end;  // -1 for the last segment: until EOF
+  unsigned char *out;
+  int64_t capacity;
+  int64_t written;
+  bool overflow;
+  bool ok;
+}Decoder_Segment;
+
+// Content-addressed cache of decoded PCM. Entries are named after a hash of
+// the compressed bytes, the output format and the volume, and hold a
+// Decoder_Cache_Header followed by raw interleaved samples, so a hit is a
+// mapped view with no libav involved. Least recently used entries (by
+// mtime, refreshed on every hit) are evicted above max_bytes.
+#define DECODER_CACHE_MAGIC 0x4d435044 // "DPCM"
+#define DECODER_CACHE_VERSION 1
+
+typedef struct{
+  const char *dir;
+  uint64_t max_bytes;
+}Decoder_Cache;
+
+typedef struct{
+  uint32_t magic;
+  uint32_t version;
+  int32_t fmt;
+  int32_t channels;
+  int32_t sample_rate;
+  int32_t sample_size;
+  uint64_t samples_count;
+  uint64_t key;
+  unsigned char reserved[24]; // samples start 64-byte aligned
+}Decoder_Cache_Header;
+
+typedef struct{
+  Decoder_Mmap map;
+  const unsigned char *samples;
+  uint64_t samples_count;
+  int channels;
+  int sample_rate;
+  Decoder_Fmt fmt;
+}Decoder_Cache_View;
+
+typedef struct{
+  char path[1024];
+  uint64_t size;
+  int64_t mtime;
+}Decoder_Cache_Entry;
+
+// Recycles what decoder_init allocates for short files (jingles, ads,
+// samples): AVIO buffers, packets, frames, and codec and swresample
+// contexts. Codec contexts are keyed by the codec parameters and skip
+// avcodec_open2, swresample contexts by both formats. The oldest slot is
+// freed when the pool is full.
+#define DECODER_POOL_SLOTS 32
+
+typedef enum{
+  DECODER_POOL_BUFFER = 0,
+  DECODER_POOL_PACKET,
+  DECODER_POOL_FRAME,
+  DECODER_POOL_CODEC,
+  DECODER_POOL_SWR,
+  DECODER_POOL_KINDS,
+}Decoder_Pool_Kind;
+
+typedef struct{
+  Decoder_Pool_Kind kind;
+  uint64_t key;
+  void *object;
+}Decoder_Pool_Slot;
+
+struct Decoder_Pool{
+  Mutex mutex;
+  Decoder_Pool_Slot slots[DECODER_POOL_SLOTS]; // oldest first
+  size_t slots_count;
+
+  // Per kind, read under mutex
+  uint64_t hits[DECODER_POOL_KINDS];
+  uint64_t misses[DECODER_POOL_KINDS];
+};
+
+// Batch decoding of many files on a fixed pool of worker threads. The
+// callback runs on the calling thread, in the order of `paths`. `samples`
+// is only valid during the callback, the buffer is reused for later files.
+typedef struct{
+  uint64_t bytes;
+  uint64_t samples;
+  uint64_t ns;
+  double realtime; // seconds of audio per second of wall time
+}Decoder_Batch_Stats;
+
+typedef struct{
+  const char *path;
+  bool ok;
+  int channels;
+  int sample_rate;
+  const unsigned char *samples;
+  size_t samples_count;
+  Decoder_Batch_Stats stats;
+}Decoder_Batch_Result;
+
+typedef void (*Decoder_Batch_Callback)(void *userdata, size_t index, const Decoder_Batch_Result *result);
+
+typedef struct{
+  Decoder_Batch_Result result;
+  unsigned char *samples;
+  size_t samples_size; // bytes, files in a batch differ in sample_size
+  bool done;
+}Decoder_Batch_Slot;
+
+typedef struct{
+  const char **paths;
+  size_t paths_count;
+  Decoder_Fmt fmt;
+  float volume;
+
+  Mutex mutex;
+  Cond cond;
+  bool quit;
+  size_t next_claim;
+  size_t next_deliver;
+
+  Decoder_Batch_Slot *slots;
+  size_t window;
+
+  Decoder_Pool pool; // shared by the workers
+}Decoder_Batch;
+
+// Decodes every audio stream of one container (language tracks,
+// commentary, clean feed): demuxes once and hands each packet to its
+// stream's codec context. A stream delivers blocks of at most `samples`
+// interleaved samples in its own layout and rate to its sink, e.g. a
+// loudness meter. Streams without a sink are discarded by the demuxer.
+// With `threaded` every stream decodes on its own thread behind a bounded
+// packet queue, and its sink runs there.
+#define DECODER_MULTI_MAX_STREAMS 16
+#define DECODER_MULTI_PACKETS 32
+
+typedef void (*Decoder_Multi_Sink)(void *userdata, int stream, const unsigned char *samples, int samples_count);
+
+typedef struct Decoder_Multi Decoder_Multi;
+
+typedef struct{
+  Decoder_Multi *multi;
+  int index;        // in multi->streams
+  int stream_index; // in the container
+  AVCodecContext *av_codec_context;
+  SwrContext *swr_context;
+  AVPacket *packet;
+  AVFrame *frame;
+  unsigned char *buffer;
+  int channels;
+  int sample_rate;
+  bool ok;
+
+  Decoder_Multi_Sink sink;
+  void *userdata;
+
+  // Threaded only
+  bool running;
+  Thread thread;
+  Mutex mutex;
+  Cond cond;
+  AVPacket *packets[DECODER_MULTI_PACKETS];
+  size_t head;
+  size_t count;
+  bool eof;
+}Decoder_Multi_Stream;
+
+struct Decoder_Multi{
+  AVIOContext *av_io_context;
+  AVFormatContext *av_format_context;
+  AVPacket *packet;
+
+  Decoder_Fmt fmt;
+  int samples;
+
+  Decoder_Multi_Stream streams[DECODER_MULTI_MAX_STREAMS];
+  int streams_count;
+};
+
+// Seek index, built while decoding the first pass and persisted as a
+// sidecar file. Entries are keyframe packets in stream time_base, at most
+// one per DECODER_INDEX_INTERVAL_MS. The sidecar stores a key of the
+// indexed source (see decoder_probe_identity), a stale one is rejected.
+#define DECODER_INDEX_INTERVAL_MS 250
+#define DECODER_INDEX_MAGIC 0x32444944 // "DID2"
+#define DECODER_INDEX_MAX_ENTRIES (1 << 24) // ~48 days at 250ms
+
+// mp3 frames take up to 511 bytes of bit reservoir from the frames before
+// them, several frames at low bitrates. decoder_seek decodes this many mp3
+// frames before the target, one for other codecs
+#define DECODER_SEEK_MP3_FRAMES 8
+
+typedef struct{
+  int64_t pos;
+  int64_t ts;
+}Decoder_Index_Entry;
+
+typedef struct{
+  Decoder_Index_Entry *items;
+  size_t len;
+  size_t cap;
+
+  int stream_index;
+  AVRational time_base;
+  bool complete;
+}Decoder_Index;
+
+// Pipelined decoding: a demux thread reads the audio packets into a
+// bounded queue, decoder_decode and decoder_frame_borrow drain it
+#define DECODER_PIPELINE_PACKETS 64
+
+typedef struct{
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t wait_ns; // blocked on a full (demux) or empty (decode) queue
+}Decoder_Stage_Stats;
+
+typedef struct{
+  Decoder_Stage_Stats demux;
+  Decoder_Stage_Stats decode;
+  uint64_t read_ns; // spent in av_read_frame
+  size_t queued;
+}Decoder_Pipeline_Stats;
+
+typedef struct{
+  Decoder *decoder;
+  Thread thread;
+  Mutex mutex;
+  Cond cond;
+  bool quit;
+
+  AVPacket *packet;
+  AVPacket *packets[DECODER_PIPELINE_PACKETS];
+  size_t head;
+  size_t count;
+  int error; // what ended the demuxer, AVERROR_EOF at the end
+
+  Decoder_Pipeline_Stats stats; // read under mutex
+}Decoder_Pipeline;
+
 struct Decoder{
   AVIOContext *av_io_context;    
   AVFormatContext *av_format_context;
@@ -59,11 +574,53 @@ struct Decoder{
   AVFrame *frame;
   int64_t pts;
 
+  Decoder_Pipeline *pipeline; // NULL unless decoder_pipeline_start
+  // What the demux thread had queued when it was stopped. Read before the
+  // demuxer, and handed to the next demux thread on resume
+  AVPacket *held[DECODER_PIPELINE_PACKETS];
+  size_t held_head;
+  size_t held_count;
+
+  // Where decoder_free returns things, keys are 0 until the context is set up
+  Decoder_Pool *pool;
+  uint64_t codec_key;
+  uint64_t swr_key;
+
+  int sample_rate; // Output rate, may differ from the codec rate
+  Decoder_Mix mix;
+
+  // Optional, set after decoder_init to build and use a seek index
+  Decoder_Index *index;
+  int64_t index_interval;
+  bool index_sequential;
+
+  // Pending sample-accurate seek: samples still to discard
+  bool seek_pending;
+  int64_t seek_target;
+  int64_t seek_ts;
+  int64_t discard;
+  int64_t seek_late; // samples the first frame started after seek_target
+  // A byte seek leaves libavformat's timestamps off by a constant, taken
+  // from the first packet after it (the one at the index entry)
+  bool pts_sync;
+  int64_t pts_offset;
+
+  // Gain stage after swresample. Set target_volume or channel_gains at any
+  // time, the next block ramps linearly from the gains applied last
   float volume;
   float target_volume;
+  float channel_gains[DECODER_MAX_CHANNELS];
+  float gains[DECODER_MAX_CHANNELS];
 
   int samples;
   int sample_size;
+  int channels;
+  Decoder_Fmt fmt;
+
+  // Fallback for decoder_frame_borrow when swresample is needed
+  unsigned char *convert_buffer;
+  int convert_capacity;
+  bool draining;
 
   bool continue_receive;
   bool continue_convert;
@@ -80,6 +637,67 @@ DECODER_DEF bool decoder_slurp(Decoder_Read read,
 			       unsigned char **samples,
 			       unsigned int *samples_count);
 
+DECODER_DEF bool decoder_slurp_options(Decoder_Read read,
+				       Decoder_Seek seek,
+				       void *opaque,
+				       Decoder_Fmt fmt,
+				       float volume,
+				       const Decoder_Options *options,
+				       int *channels,
+				       int *sample_rate,
+				       unsigned char **out_samples,
+				       unsigned int *out_samples_count);
+DECODER_DEF bool decoder_slurp_memory_parallel(const char *memory,
+					       size_t memory_len,
+					       Decoder_Fmt fmt,
+					       float volume,
+					       int threads,
+					       int *channels,
+					       int *sample_rate,
+					       unsigned char **samples,
+					       unsigned int *samples_count);
+
+DECODER_DEF bool decoder_slurp_file_parallel(const char *filepath,
+					     Decoder_Fmt fmt,
+					     float volume,
+					     int threads,
+					     int *channels,
+					     int *sample_rate,
+					     unsigned char **samples,
+					     unsigned int *samples_count);
+
+DECODER_DEF bool decoder_slurp_chunks(Decoder_Read read,
+				      Decoder_Seek seek,
+				      void *opaque,
+				      Decoder_Fmt fmt,
+				      float volume,
+				      int *channels,
+				      int *sample_rate,
+				      Decoder_Chunks *chunks);
+
+DECODER_DEF bool decoder_batch(const char **paths,
+			       size_t paths_count,
+			       Decoder_Fmt fmt,
+			       float volume,
+			       int threads,
+			       Decoder_Batch_Callback callback,
+			       void *userdata);
+
+DECODER_DEF bool decoder_cache_slurp_file(Decoder_Cache *cache,
+					  const char *filepath,
+					  Decoder_Fmt fmt,
+					  float volume,
+					  Decoder_Cache_View *view);
+DECODER_DEF bool decoder_cache_slurp_memory(Decoder_Cache *cache,
+					    const char *memory,
+					    size_t memory_len,
+					    Decoder_Fmt fmt,
+					    float volume,
+					    Decoder_Cache_View *view);
+DECODER_DEF void decoder_cache_view_close(Decoder_Cache_View *view);
+DECODER_DEF bool decoder_cache_evict(Decoder_Cache *cache);
+DECODER_DEF void decoder_chunks_free(Decoder_Chunks *chunks);
+
 DECODER_DEF bool decoder_slurp_file(const char *filepath,
 				    Decoder_Fmt fmt,
 				    float volume,
@@ -106,18 +724,129 @@ DECODER_DEF bool decoder_init(Decoder *decoder,
 			      int samples,
 			      int *channels,
 			      int *sample_rate);
+DECODER_DEF bool decoder_init_options(Decoder *decoder,
+				      Decoder_Read read,
+				      Decoder_Seek seek,
+				      void *opaque,
+				      Decoder_Fmt fmt,
+				      float volume,
+				      int samples,
+				      const Decoder_Options *options,
+				      int *channels,
+				      int *sample_rate);
 DECODER_DEF bool decoder_decode(Decoder *decoder, int *out_samples, unsigned char *out_buf);
+DECODER_DEF bool decoder_decode_planar(Decoder *decoder, int *out_samples, unsigned char **planes);
+DECODER_DEF unsigned char *decoder_planes_alloc(unsigned char **planes, int channels, int samples, Decoder_Fmt fmt);
+DECODER_DEF void decoder_planes_free(unsigned char *block);
+DECODER_DEF bool decoder_seek(Decoder *decoder, int64_t sample_pos);
+DECODER_DEF bool decoder_pipeline_start(Decoder *decoder);
+DECODER_DEF void decoder_pipeline_stop(Decoder *decoder);
+DECODER_DEF bool decoder_pipeline_stats(Decoder *decoder, Decoder_Pipeline_Stats *stats);
+DECODER_DEF void decoder_set_volume(Decoder *decoder, float volume);
+DECODER_DEF bool decoder_set_channel_gain(Decoder *decoder, int channel, float gain);
+DECODER_DEF bool decoder_seek_preroll(Decoder *decoder, int64_t sample_pos, int64_t preroll);
+DECODER_DEF bool decoder_frame_borrow(Decoder *decoder, Decoder_Frame *frame);
+DECODER_DEF void decoder_frame_release(Decoder *decoder, Decoder_Frame *frame);
 DECODER_DEF void decoder_free(Decoder *decoder);
+DECODER_DEF bool decoder_pool_init(Decoder_Pool *pool);
+DECODER_DEF void decoder_pool_free(Decoder_Pool *pool);
+DECODER_DEF bool decoder_multi_init(Decoder_Multi *multi, Decoder_Read read, Decoder_Seek seek, void *opaque, Decoder_Fmt fmt, int samples);
+DECODER_DEF bool decoder_multi_sink(Decoder_Multi *multi, int stream, Decoder_Multi_Sink sink, void *userdata);
+DECODER_DEF bool decoder_multi_run(Decoder_Multi *multi, bool threaded);
+DECODER_DEF void decoder_multi_free(Decoder_Multi *multi);
+
+DECODER_DEF bool decoder_index_load(Decoder_Index *index, const char *filepath, uint64_t key);
+DECODER_DEF bool decoder_index_save(const Decoder_Index *index, const char *filepath, uint64_t key);
+DECODER_DEF void decoder_index_free(Decoder_Index *index);
+DECODER_DEF bool decoder_probe_identity(const char *filepath, uint64_t *key);
 DECODER_DEF bool decoder_fmt_to_bits_per_sample(int *bits, Decoder_Fmt fmt);
+DECODER_DEF bool decoder_fmt_is_planar(Decoder_Fmt fmt);
 DECODER_DEF bool decoder_fmt_to_libav_fmt(enum AVSampleFormat *av_fmt, Decoder_Fmt fmt);
+DECODER_DEF bool decoder_libav_fmt_to_fmt(Decoder_Fmt *fmt, enum AVSampleFormat av_fmt);
 
 // Protected
+DECODER_DEF int64_t decoder_estimate_samples(Decoder *decoder);
+DECODER_DEF bool decoder_mid_side_matrix(SwrContext *swr, const AVChannelLayout *in_layout);
+DECODER_DEF bool decoder_probe_path(char *path, size_t path_size, const Decoder_Options *options);
+DECODER_DEF bool decoder_probe_load(const Decoder_Options *options, Decoder_Probe *probe, unsigned char **extradata);
+DECODER_DEF bool decoder_probe_store(const Decoder_Options *options, AVFormatContext *ctx, int stream_index);
+DECODER_DEF bool decoder_probe_apply(AVFormatContext *ctx, const Decoder_Probe *probe, const unsigned char *extradata);
+DECODER_DEF void decoder_gain(Decoder *decoder, unsigned char **buffers, int samples);
+DECODER_DEF bool decoder_gain_unity(Decoder *decoder);
+DECODER_DEF bool decoder_chunks_fill(Decoder *decoder, Decoder_Chunks *chunks);
+DECODER_DEF void *decoder_segment_thread(void *arg);
+DECODER_DEF bool decoder_parallel_codec(const AVCodecParameters *par);
+DECODER_DEF bool decoder_decode_all(Decoder *decoder, unsigned char **samples, size_t *samples_size, size_t *samples_count);
+DECODER_DEF void *decoder_batch_thread(void *arg);
+DECODER_DEF void decoder_batch_decode(Decoder_Batch *batch, Decoder_Batch_Slot *slot, const char *path);
+DECODER_DEF uint64_t decoder_hash(const void *data, size_t len, uint64_t seed);
+DECODER_DEF bool decoder_cache_open(Decoder_Cache_View *view, const char *path, uint64_t key);
+DECODER_DEF bool decoder_cache_store(Decoder_Cache *cache, const char *path, uint64_t key, Decoder_Fmt fmt, int channels, int sample_rate, int sample_size, const unsigned char *samples, uint64_t samples_count);
+DECODER_DEF void decoder_cache_touch(const char *path);
+DECODER_DEF bool decoder_cache_evict_keep(Decoder_Cache *cache, const char *keep);
+DECODER_DEF bool decoder_index_append(Decoder *decoder, const AVPacket *packet);
+DECODER_DEF const Decoder_Index_Entry *decoder_index_find(const Decoder_Index *index, int64_t ts);
+DECODER_DEF void decoder_discard(Decoder *decoder, int *out_samples, unsigned char **buffers);
+DECODER_DEF bool decoder_decode_buffers(Decoder *decoder, int *out_samples, unsigned char **buffers);
+DECODER_DEF unsigned char *decoder_aligned_alloc(size_t size);
+DECODER_DEF void decoder_aligned_free(unsigned char *block);
+DECODER_DEF void decoder_seek_resolve(Decoder *decoder);
+DECODER_DEF void decoder_pts_sync(Decoder *decoder, const AVPacket *packet);
+DECODER_DEF int decoder_receive(Decoder *decoder);
+DECODER_DEF int decoder_read_packet(Decoder *decoder);
+DECODER_DEF bool decoder_pipeline_pause(Decoder *decoder, Decoder_Pipeline_Stats *stats);
+DECODER_DEF bool decoder_pipeline_resume(Decoder *decoder, const Decoder_Pipeline_Stats *stats);
+DECODER_DEF void *decoder_pipeline_thread(void *arg);
+DECODER_DEF void decoder_pipeline_drop(Decoder *decoder);
+DECODER_DEF void *decoder_pool_take(Decoder_Pool *pool, Decoder_Pool_Kind kind, uint64_t key);
+DECODER_DEF void decoder_pool_put(Decoder_Pool *pool, Decoder_Pool_Kind kind, uint64_t key, void *object);
+DECODER_DEF void decoder_pool_destroy(Decoder_Pool_Kind kind, void *object);
+DECODER_DEF uint64_t decoder_pool_layout_hash(const AVChannelLayout *layout, uint64_t seed);
+DECODER_DEF uint64_t decoder_pool_codec_key(const AVCodecParameters *par);
+DECODER_DEF uint64_t decoder_pool_swr_key(const AVChannelLayout *in_layout, enum AVSampleFormat in_fmt, int in_rate, const AVChannelLayout *out_layout, enum AVSampleFormat out_fmt, int out_rate, Decoder_Mix mix);
+DECODER_DEF bool decoder_multi_stream_open(Decoder_Multi *multi, Decoder_Multi_Stream *s, int stream_index);
+DECODER_DEF void decoder_multi_stream_close(Decoder_Multi_Stream *s);
+DECODER_DEF bool decoder_multi_stream_decode(Decoder_Multi_Stream *s, const AVPacket *packet);
+DECODER_DEF bool decoder_multi_stream_start(Decoder_Multi_Stream *s);
+DECODER_DEF void *decoder_multi_thread(void *arg);
+
 DECODER_DEF int64_t decoder_file_seek(void *opaque, int64_t offset, int whence);
 DECODER_DEF int decoder_file_read(void *opaque, uint8_t *buf, int _buf_size);
   
 DECODER_DEF int64_t decoder_memory_seek(void *opaque, int64_t offset, int whence);
 DECODER_DEF int decoder_memory_read(void *opaque, uint8_t *buf, int _buf_size);
 
+DECODER_DEF bool decoder_prefetch_open(Decoder_Prefetch *p, const char *filepath);
+DECODER_DEF bool decoder_prefetch_wrap(Decoder_Prefetch *p, Decoder_Read read, Decoder_Seek seek, void *opaque);
+DECODER_DEF void decoder_prefetch_close(Decoder_Prefetch *p);
+DECODER_DEF int64_t decoder_prefetch_seek(void *opaque, int64_t offset, int whence);
+DECODER_DEF int decoder_prefetch_read(void *opaque, uint8_t *buf, int _buf_size);
+DECODER_DEF bool decoder_prefetch_start(Decoder_Prefetch *p);
+DECODER_DEF void *decoder_prefetch_thread(void *arg);
+DECODER_DEF int decoder_prefetch_fetch(Decoder_Prefetch *p, int64_t offset, unsigned char *buf, int size);
+DECODER_DEF uint64_t decoder_now_ns(void);
+
+DECODER_DEF bool decoder_stream_open(Decoder_Stream *s, const char *path);
+DECODER_DEF void decoder_stream_close(Decoder_Stream *s);
+DECODER_DEF int64_t decoder_stream_seek(void *opaque, int64_t offset, int whence);
+DECODER_DEF int decoder_stream_read(void *opaque, uint8_t *buf, int _buf_size);
+
+DECODER_DEF bool decoder_url_open(Decoder_Url *u, const char *url);
+DECODER_DEF void decoder_url_close(Decoder_Url *u);
+DECODER_DEF int64_t decoder_url_seek(void *opaque, int64_t offset, int whence);
+DECODER_DEF int decoder_url_read(void *opaque, uint8_t *buf, int _buf_size);
+DECODER_DEF bool decoder_url_connect(Decoder_Url *u);
+DECODER_DEF void decoder_url_disconnect(Decoder_Url *u);
+DECODER_DEF int decoder_url_recv(Decoder_Url *u, unsigned char *buf, size_t size);
+DECODER_DEF bool decoder_url_skip(Decoder_Url *u, int64_t n);
+DECODER_DEF int decoder_url_request(Decoder_Url *u);
+DECODER_DEF int decoder_url_fill(Decoder_Url *u);
+
+DECODER_DEF bool decoder_mmap_open(Decoder_Mmap *m, const char *filepath);
+DECODER_DEF void decoder_mmap_close(Decoder_Mmap *m);
+DECODER_DEF int64_t decoder_mmap_seek(void *opaque, int64_t offset, int whence);
+DECODER_DEF int decoder_mmap_read(void *opaque, uint8_t *buf, int _buf_size);
+
 #ifdef DECODER_IMPLEMENTATION
 
 DECODER_DEF bool decoder_slurp_memory(const char *memory,
@@ -134,15 +863,17 @@ DECODER_DEF bool decoder_slurp_memory(const char *memory,
     .size = memory_len,
   };
 
-  return decoder_slurp(decoder_memory_read,
-		       decoder_memory_seek,
-		       &mem,
-		       fmt,
-		       volume,
-		       channels,
-		       sample_rate,
-		       out_samples,
-		       out_samples_count);
+  Decoder_Options options = { .direct = true };
+  return decoder_slurp_options(decoder_memory_read,
+			       decoder_memory_seek,
+			       &mem,
+			       fmt,
+			       volume,
+			       &options,
+			       channels,
+			       sample_rate,
+			       out_samples,
+			       out_samples_count);
 
 }
 
@@ -153,26 +884,59 @@ DECODER_DEF bool decoder_slurp_file(const char *filepath,
 				    int *sample_rate,
 				    unsigned char **out_samples,
 				    unsigned int *out_samples_count) {
-  FILE *f = fopen(filepath, "rb");
-  if(!f) {
-    return false;
+  Decoder_Mmap m;
+  if(decoder_mmap_open(&m, filepath)) {
+    Decoder_Options options = { .direct = true };
+    bool ok = decoder_slurp_options(decoder_mmap_read,
+				    decoder_mmap_seek,
+				    &m,
+				    fmt,
+				    volume,
+				    &options,
+				    channels,
+				    sample_rate,
+				    out_samples,
+				    out_samples_count);
+    decoder_mmap_close(&m);
+    return ok;
   }
-  
-  if(!decoder_slurp(decoder_file_read,
-		    decoder_file_seek,
-		    f,
-		    fmt,
-		    volume,
-		    channels,
-		    sample_rate,
-		    out_samples,
-		    out_samples_count)) {
-    fclose(f);
+
+  if(strncmp(filepath, "http://", 7) == 0) {
+    Decoder_Url u;
+    if(!decoder_url_open(&u, filepath)) {
+      return false;
+    }
+
+    bool ok = decoder_slurp(decoder_url_read,
+			    u.seekable ? decoder_url_seek : NULL,
+			    &u,
+			    fmt,
+			    volume,
+			    channels,
+			    sample_rate,
+			    out_samples,
+			    out_samples_count);
+    decoder_url_close(&u);
+    return ok;
+  }
+
+  // Not mappable: stdin, a FIFO or a socket
+  Decoder_Stream s;
+  if(!decoder_stream_open(&s, filepath)) {
     return false;
   }
 
-  fclose(f);
-  return true;
+  bool ok = decoder_slurp(decoder_stream_read,
+			  s.seekable ? decoder_stream_seek : NULL,
+			  &s,
+			  fmt,
+			  volume,
+			  channels,
+			  sample_rate,
+			  out_samples,
+			  out_samples_count);
+  decoder_stream_close(&s);
+  return ok;
 }
 
 DECODER_DEF bool decoder_slurp(Decoder_Read read,
@@ -184,422 +948,3936 @@ DECODER_DEF bool decoder_slurp(Decoder_Read read,
 			       int *sample_rate,
 			       unsigned char **out_samples,
 			       unsigned int *out_samples_count) {
+  return decoder_slurp_options(read, seek, opaque, fmt, volume, NULL,
+			       channels, sample_rate, out_samples, out_samples_count);
+}
+
+DECODER_DEF bool decoder_slurp_options(Decoder_Read read,
+				       Decoder_Seek seek,
+				       void *opaque,
+				       Decoder_Fmt fmt,
+				       float volume,
+				       const Decoder_Options *options,
+				       int *channels,
+				       int *sample_rate,
+				       unsigned char **out_samples,
+				       unsigned int *out_samples_count) {
   Decoder decoder;
-  if(!decoder_init(&decoder, read, seek, opaque,
-		   fmt, 1152, volume, channels, sample_rate)) {
+  if(!decoder_init_options(&decoder, read, seek, opaque,
+			   fmt, volume, DECODER_SLURP_SAMPLES, options, channels, sample_rate)) {
     return false;
   }
+  size_t sample_size = (size_t) decoder.sample_size;
 
-  unsigned int samples_count = 0;
-  unsigned int samples_cap = 5 * (*sample_rate) * (*channels);
-  unsigned char *samples = malloc(samples_cap * decoder.sample_size);
-  if(!samples) {
+  int64_t estimate = decoder_estimate_samples(&decoder);
+  if(estimate < 0) {
+    // No duration, decode into the arena and copy out once. The result is
+    // allocated while every block is still alive, so the peak is about twice
+    // the decoded size. Callers that can walk blocks use decoder_slurp_chunks.
+    Decoder_Chunks chunks;
+    bool ok = decoder_chunks_fill(&decoder, &chunks);
     decoder_free(&decoder);
+    if(!ok) {
+      return false;
+    }
+
+    unsigned char *samples = malloc(chunks.samples_count ? chunks.samples_count * sample_size : 1);
+    if(!samples) {
+      decoder_chunks_free(&chunks);
+      return false;
+    }
+
+    size_t offset = 0;
+    Decoder_Chunk *chunk = chunks.first;
+    while(chunk) {
+      Decoder_Chunk *next = chunk->next;
+      memcpy(samples + offset, chunk->data, chunk->samples_count * sample_size);
+      offset += chunk->samples_count * sample_size;
+      free(chunk);
+      chunk = next;
+    }
+
+    *out_samples = samples;
+    *out_samples_count = (unsigned int) chunks.samples_count;
+    return true;
+  }
+
+  unsigned char *samples = NULL;
+  size_t samples_size = 0;
+  size_t samples_count = 0;
+  bool ok = decoder_decode_all(&decoder, &samples, &samples_size, &samples_count);
+  decoder_free(&decoder);
+  if(!ok) {
+    free(samples);
     return false;
   }
 
-  unsigned char decoded_samples[1152 * 4];
-  int decoded_samples_count;
-  while(decoder_decode(&decoder, &decoded_samples_count, decoded_samples)) {
+  if(samples_count * sample_size < samples_size && samples_count > 0) {
+    unsigned char *new_samples = realloc(samples, samples_count * sample_size);
+    if(new_samples) samples = new_samples;
+  }
+
+  *out_samples = samples;
+  *out_samples_count = (unsigned int) samples_count;
+  return true;
+}
+
+// Decodes the rest of the stream into *samples, which is reused and only
+// grown: reserved from the duration estimate, then by 1.5x. *samples_size
+// is in bytes, so a buffer can be reused for another sample_size.
+// Interleaved formats only.
+DECODER_DEF bool decoder_decode_all(Decoder *decoder,
+				    unsigned char **samples,
+				    size_t *samples_size,
+				    size_t *samples_count) {
+  if(decoder_fmt_is_planar(decoder->fmt)) {
+    return false;
+  }
+  size_t sample_size = (size_t) decoder->sample_size;
+  *samples_count = 0;
 
-    unsigned int new_samples_cap = samples_cap;
-    while(samples_count + decoded_samples_count > new_samples_cap) {
-      new_samples_cap *= 2;
+  // The estimate is usually exact, keep some slack for VBR guesses
+  int64_t estimate = decoder_estimate_samples(decoder);
+  size_t want = estimate >= 0
+    ? (size_t) estimate + (size_t) estimate / 32 + 2 * DECODER_SLURP_SAMPLES
+    : (size_t) decoder->sample_rate * 5;
+  size_t samples_cap = *samples_size / sample_size;
+  if(samples_cap < want) {
+    unsigned char *new_samples = realloc(*samples, want * sample_size);
+    if(!new_samples) {
+      return false;
     }
-    if(new_samples_cap != samples_cap) {
-      samples_cap = new_samples_cap;
-      samples = realloc(samples, samples_cap * decoder.sample_size);
-      if(!samples) {
-	decoder_free(&decoder);
+    *samples = new_samples;
+    *samples_size = want * sample_size;
+    samples_cap = want;
+  }
+
+  // Decode straight into the result, no scratch buffer
+  while(true) {
+    if(samples_cap - *samples_count < DECODER_SLURP_SAMPLES) {
+      size_t new_samples_cap = samples_cap + samples_cap / 2;
+      unsigned char *new_samples = realloc(*samples, new_samples_cap * sample_size);
+      if(!new_samples) {
 	return false;
       }
+      *samples = new_samples;
+      *samples_size = new_samples_cap * sample_size;
+      samples_cap = new_samples_cap;
     }
-    
-    memcpy(samples + samples_count * decoder.sample_size,
-	   decoded_samples,
-	   decoded_samples_count * decoder.sample_size);
 
-    samples_count += (unsigned int) decoded_samples_count;
+    int decoded_samples_count;
+    if(!decoder_decode(decoder, &decoded_samples_count, *samples + *samples_count * sample_size)) {
+      break;
+    }
+    *samples_count += (size_t) decoded_samples_count;
   }
 
-  *out_samples = samples;
-  *out_samples_count = samples_count;
-
-  decoder_free(&decoder);  
   return true;
 }
 
-DECODER_DEF bool decoder_init(Decoder *decoder,
-			      Decoder_Read read,
-			      Decoder_Seek seek,
-			      void *opaque,
-			      Decoder_Fmt fmt,
-			      float volume,
-			      int samples,
-			      int *channels,
-			      int *sample_rate) {
-
-  decoder->av_io_context = NULL;
-  decoder->av_format_context = NULL;
-  decoder->av_codec_context = NULL;
-  decoder->swr_context = NULL;
-  decoder->packet = NULL;
-  decoder->frame = NULL;
-  decoder->target_volume = -1.f;
-  decoder->volume = volume;
+DECODER_DEF bool decoder_batch(const char **paths,
+			       size_t paths_count,
+			       Decoder_Fmt fmt,
+			       float volume,
+			       int threads,
+			       Decoder_Batch_Callback callback,
+			       void *userdata) {
+  if(threads < 1) threads = 1;
 
-  decoder->samples = samples;
-  enum AVSampleFormat av_sample_format;
-  if(!decoder_fmt_to_libav_fmt(&av_sample_format, fmt)) {
-      return false;
+  Decoder_Batch batch = {0};
+  batch.paths = paths;
+  batch.paths_count = paths_count;
+  batch.fmt = fmt;
+  batch.volume = volume;
+  batch.window = (size_t) threads * 2;
+  batch.slots = calloc(batch.window, sizeof(*batch.slots));
+  if(!batch.slots) {
+    return false;
   }
-
-  decoder->av_io_context = avio_alloc_context(NULL, 0, 0, opaque, read, NULL, seek);
-  if(!decoder->av_io_context) {
-    decoder_free(decoder);
+  if(!mutex_create(&batch.mutex)) {
+    free(batch.slots);
     return false;
   }
-
-  decoder->av_format_context = avformat_alloc_context();
-  if(!decoder->av_format_context) {
-    decoder_free(decoder);
+  if(!cond_create(&batch.cond)) {
+    mutex_free(&batch.mutex);
+    free(batch.slots);
     return false;
   }
-
-  decoder->av_format_context->pb = decoder->av_io_context;
-  decoder->av_format_context->flags = AVFMT_FLAG_CUSTOM_IO;
-  if (avformat_open_input(&decoder->av_format_context, "", NULL, NULL) != 0) {
-    decoder_free(decoder);
+  if(!decoder_pool_init(&batch.pool)) {
+    cond_free(&batch.cond);
+    mutex_free(&batch.mutex);
+    free(batch.slots);
     return false;
   }
 
-  if(avformat_find_stream_info(decoder->av_format_context, NULL) < 0) {
-    decoder_free(decoder);
-    return false;
+  Thread ids[64];
+  if(threads > 64) threads = 64;
+  int started = 0;
+  for(int i=0;i<threads;i++) {
+    if(!thread_create(&ids[i], decoder_batch_thread, &batch)) break;
+    started++;
   }
 
-  decoder->stream_index = -1;
+  // Deliver on the calling thread, in input order
+  for(size_t i=0;started > 0 && i<paths_count;i++) {
+    Decoder_Batch_Slot *slot = &batch.slots[i % batch.window];
 
-  const AVCodec *av_codec = NULL;
-  AVCodecParameters *av_codec_parameters = NULL;
-  for(size_t i=0;i<decoder->av_format_context->nb_streams;i++) {
-    av_codec_parameters = decoder->av_format_context->streams[i]->codecpar;
-    if(av_codec_parameters->codec_type == AVMEDIA_TYPE_AUDIO) {
-      decoder->stream_index = (int) i;
-      av_codec = avcodec_find_decoder(av_codec_parameters->codec_id);
-      if(!av_codec) {
-	decoder_free(decoder);
-	return false;
-      }
-      break;
-    }
+    mutex_lock(&batch.mutex);
+    while(!slot->done) cond_wait(&batch.cond, &batch.mutex);
+    mutex_release(&batch.mutex);
+
+    callback(userdata, i, &slot->result);
+
+    mutex_lock(&batch.mutex);
+    slot->done = false;
+    batch.next_deliver++;
+    cond_broadcast(&batch.cond);
+    mutex_release(&batch.mutex);
   }
-  if(av_codec == NULL) {
-    decoder_free(decoder);
-    return false;
+
+  mutex_lock(&batch.mutex);
+  batch.quit = true;
+  cond_broadcast(&batch.cond);
+  mutex_release(&batch.mutex);
+  for(int i=0;i<started;i++) {
+    thread_join(ids[i]);
   }
-  
-  decoder->av_codec_context = avcodec_alloc_context3(av_codec);
-  if(!decoder) {
-    decoder_free(decoder);
-    return false;
+
+  for(size_t i=0;i<batch.window;i++) {
+    free(batch.slots[i].samples);
   }
+  free(batch.slots);
+  decoder_pool_free(&batch.pool);
+  cond_free(&batch.cond);
+  mutex_free(&batch.mutex);
 
-  if(avcodec_parameters_to_context(decoder->av_codec_context, av_codec_parameters) < 0) {
-    decoder_free(decoder);
+  return started > 0;
+}
+
+DECODER_DEF void *decoder_batch_thread(void *arg) {
+  Decoder_Batch *batch = arg;
+
+  mutex_lock(&batch->mutex);
+  while(true) {
+    // Stay at most `window` files ahead of delivery, the slot being reused
+    // has then been delivered
+    while(!batch->quit &&
+	  batch->next_claim < batch->paths_count &&
+	  batch->next_claim >= batch->next_deliver + batch->window) {
+      cond_wait(&batch->cond, &batch->mutex);
+    }
+    if(batch->quit || batch->next_claim >= batch->paths_count) {
+      break;
+    }
+    size_t i = batch->next_claim++;
+    Decoder_Batch_Slot *slot = &batch->slots[i % batch->window];
+    mutex_release(&batch->mutex);
+
+    decoder_batch_decode(batch, slot, batch->paths[i]);
+
+    mutex_lock(&batch->mutex);
+    slot->done = true;
+    cond_broadcast(&batch->cond);
+  }
+  mutex_release(&batch->mutex);
+
+  return NULL;
+}
+
+DECODER_DEF void decoder_batch_decode(Decoder_Batch *batch, Decoder_Batch_Slot *slot, const char *path) {
+  Decoder_Batch_Result *result = &slot->result;
+  memset(result, 0, sizeof(*result));
+  result->path = path;
+
+  uint64_t start = decoder_now_ns();
+
+  Decoder_Mmap m;
+  if(!decoder_mmap_open(&m, path)) {
+    return;
+  }
+
+  Decoder decoder;
+  Decoder_Options options = { .direct = true, .pool = &batch->pool };
+  if(!decoder_init_options(&decoder, decoder_mmap_read, decoder_mmap_seek, &m,
+			   batch->fmt, batch->volume, DECODER_SLURP_SAMPLES, &options,
+			   &result->channels, &result->sample_rate)) {
+    decoder_mmap_close(&m);
+    return;
+  }
+
+  size_t samples_count;
+  result->ok = decoder_decode_all(&decoder, &slot->samples, &slot->samples_size, &samples_count);
+  result->stats.bytes = m.memory.size;
+  decoder_free(&decoder);
+  decoder_mmap_close(&m);
+
+  result->samples = slot->samples;
+  result->samples_count = samples_count;
+  result->stats.samples = samples_count;
+  result->stats.ns = decoder_now_ns() - start;
+  if(result->stats.ns > 0 && result->sample_rate > 0) {
+    result->stats.realtime = ((double) samples_count / result->sample_rate) /
+      ((double) result->stats.ns / 1e9);
+  }
+}
+
+DECODER_DEF bool decoder_cache_slurp_file(Decoder_Cache *cache,
+					  const char *filepath,
+					  Decoder_Fmt fmt,
+					  float volume,
+					  Decoder_Cache_View *view) {
+  Decoder_Mmap m;
+  if(!decoder_mmap_open(&m, filepath)) {
+    return false;
+  }
+
+  bool ok = decoder_cache_slurp_memory(cache,
+				       (const char *) m.memory.data,
+				       (size_t) m.memory.size,
+				       fmt,
+				       volume,
+				       view);
+  decoder_mmap_close(&m);
+  return ok;
+}
+
+DECODER_DEF bool decoder_cache_slurp_memory(Decoder_Cache *cache,
+					    const char *memory,
+					    size_t memory_len,
+					    Decoder_Fmt fmt,
+					    float volume,
+					    Decoder_Cache_View *view) {
+  memset(view, 0, sizeof(*view));
+
+  // The struct has tail padding, zero it so the key is stable
+  struct{
+    uint64_t content;
+    int32_t fmt;
+    float volume;
+    uint32_t version;
+  } id;
+  memset(&id, 0, sizeof(id));
+  id.content = decoder_hash(memory, memory_len, 0);
+  id.fmt = (int32_t) fmt;
+  id.volume = volume;
+  id.version = DECODER_CACHE_VERSION;
+  uint64_t key = decoder_hash(&id, sizeof(id), 0);
+
+  char path[1024];
+  if(snprintf(path, sizeof(path), "%s/%016llx.pcm", cache->dir, (unsigned long long) key) >= (int) sizeof(path)) {
+    return false;
+  }
+
+  if(decoder_cache_open(view, path, key)) {
+    decoder_cache_touch(path);
+    return true;
+  }
+
+  // Miss: decode, publish, then serve the mapped entry like a hit
+  int channels, sample_rate;
+  unsigned char *samples;
+  unsigned int samples_count;
+  if(!decoder_slurp_memory(memory, memory_len, fmt, volume,
+			   &channels, &sample_rate, &samples, &samples_count)) {
+    return false;
+  }
+  int bits;
+  if(!decoder_fmt_to_bits_per_sample(&bits, fmt)) {
+    free(samples);
+    return false;
+  }
+
+  bool ok = decoder_cache_store(cache, path, key, fmt, channels, sample_rate, channels * bits / 8,
+				samples, samples_count);
+  free(samples);
+  if(!ok) {
+    return false;
+  }
+
+  // Map the entry before evicting, so that it can not be the one deleted
+  if(!decoder_cache_open(view, path, key)) {
+    return false;
+  }
+  decoder_cache_evict_keep(cache, path);
+  return true;
+}
+
+DECODER_DEF void decoder_cache_view_close(Decoder_Cache_View *view) {
+  decoder_mmap_close(&view->map);
+  memset(view, 0, sizeof(*view));
+}
+
+DECODER_DEF bool decoder_cache_open(Decoder_Cache_View *view, const char *path, uint64_t key) {
+  if(!decoder_mmap_open(&view->map, path)) {
+    return false;
+  }
+
+  Decoder_Cache_Header header;
+  const Decoder_Memory *mem = &view->map.memory;
+  if(mem->size < sizeof(header)) {
+    decoder_mmap_close(&view->map);
+    return false;
+  }
+  memcpy(&header, mem->data, sizeof(header));
+
+  if(header.magic != DECODER_CACHE_MAGIC ||
+     header.version != DECODER_CACHE_VERSION ||
+     header.key != key ||
+     header.sample_size <= 0 ||
+     mem->size != sizeof(header) + header.samples_count * (uint64_t) header.sample_size) {
+    decoder_mmap_close(&view->map);
+    return false;
+  }
+
+  view->samples = mem->data + sizeof(header);
+  view->samples_count = header.samples_count;
+  view->channels = header.channels;
+  view->sample_rate = header.sample_rate;
+  view->fmt = (Decoder_Fmt) header.fmt;
+  return true;
+}
+
+// Writes a temporary file and renames it into place, so readers never map
+// a partial entry
+DECODER_DEF bool decoder_cache_store(Decoder_Cache *cache,
+				     const char *path,
+				     uint64_t key,
+				     Decoder_Fmt fmt,
+				     int channels,
+				     int sample_rate,
+				     int sample_size,
+				     const unsigned char *samples,
+				     uint64_t samples_count) {
+  char tmp[1024];
+#ifdef _WIN32
+  unsigned long id = (unsigned long) GetCurrentThreadId();
+#else
+  unsigned long id = (unsigned long) getpid() ^ ((unsigned long) (uintptr_t) &tmp >> 4);
+#endif //_WIN32
+  if(snprintf(tmp, sizeof(tmp), "%s/%016llx.%lx.tmp", cache->dir, (unsigned long long) key, id) >= (int) sizeof(tmp)) {
+    return false;
+  }
+
+  FILE *f = fopen(tmp, "wb");
+  if(!f) {
+    return false;
+  }
+
+  Decoder_Cache_Header header = {
+    .magic = DECODER_CACHE_MAGIC,
+    .version = DECODER_CACHE_VERSION,
+    .fmt = (int32_t) fmt,
+    .channels = channels,
+    .sample_rate = sample_rate,
+    .sample_size = sample_size,
+    .samples_count = samples_count,
+    .key = key,
+  };
+  size_t bytes = (size_t) samples_count * (size_t) sample_size;
+  bool ok =
+    fwrite(&header, sizeof(header), 1, f) == 1 &&
+    (bytes == 0 || fwrite(samples, 1, bytes, f) == bytes);
+  if(fclose(f) != 0) ok = false;
+
+#ifdef _WIN32
+  if(ok) ok = MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  if(ok) ok = rename(tmp, path) == 0;
+#endif //_WIN32
+  if(!ok) remove(tmp);
+
+  return ok;
+}
+
+DECODER_DEF void decoder_cache_touch(const char *path) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			    NULL, OPEN_EXISTING, 0, NULL);
+  if(file == INVALID_HANDLE_VALUE) return;
+  FILETIME now;
+  GetSystemTimeAsFileTime(&now);
+  SetFileTime(file, NULL, NULL, &now);
+  CloseHandle(file);
+#else
+  utime(path, NULL);
+#endif //_WIN32
+}
+
+DECODER_DEF int decoder_cache_entry_compare(const void *a, const void *b) {
+  int64_t ta = ((const Decoder_Cache_Entry *) a)->mtime;
+  int64_t tb = ((const Decoder_Cache_Entry *) b)->mtime;
+  return (ta > tb) - (ta < tb);
+}
+
+// Deletes least recently used entries until the cache fits max_bytes
+DECODER_DEF bool decoder_cache_evict(Decoder_Cache *cache) {
+  return decoder_cache_evict_keep(cache, NULL);
+}
+
+// Same, but never deletes the entry at `keep`
+DECODER_DEF bool decoder_cache_evict_keep(Decoder_Cache *cache, const char *keep) {
+  Decoder_Cache_Entry *entries = NULL;
+  size_t len = 0, cap = 0;
+  uint64_t total = 0;
+
+#ifdef _WIN32
+  char pattern[1024];
+  snprintf(pattern, sizeof(pattern), "%s/*.pcm", cache->dir);
+  WIN32_FIND_DATAA data;
+  HANDLE find = FindFirstFileA(pattern, &data);
+  if(find == INVALID_HANDLE_VALUE) {
+    return true;
+  }
+  do {
+    if(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+    Decoder_Cache_Entry entry;
+    snprintf(entry.path, sizeof(entry.path), "%s/%s", cache->dir, data.cFileName);
+    entry.size = ((uint64_t) data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    entry.mtime = (int64_t) (((uint64_t) data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime);
+#else
+  DIR *dir = opendir(cache->dir);
+  if(!dir) {
+    return false;
+  }
+  struct dirent *ent;
+  while((ent = readdir(dir)) != NULL) {
+    size_t name_len = strlen(ent->d_name);
+    if(name_len < 4 || strcmp(ent->d_name + name_len - 4, ".pcm") != 0) continue;
+    Decoder_Cache_Entry entry;
+    snprintf(entry.path, sizeof(entry.path), "%s/%s", cache->dir, ent->d_name);
+    struct stat st;
+    if(stat(entry.path, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+    entry.size = (uint64_t) st.st_size;
+    entry.mtime = (int64_t) st.st_mtime;
+#endif //_WIN32
+
+    if(len >= cap) {
+      size_t new_cap = cap ? cap * 2 : 64;
+      Decoder_Cache_Entry *new_entries = realloc(entries, new_cap * sizeof(*entries));
+      if(!new_entries) break;
+      entries = new_entries;
+      cap = new_cap;
+    }
+    entries[len++] = entry;
+    total += entry.size;
+
+#ifdef _WIN32
+  } while(FindNextFileA(find, &data));
+  FindClose(find);
+#else
+  }
+  closedir(dir);
+#endif //_WIN32
+
+  if(total > cache->max_bytes) {
+    qsort(entries, len, sizeof(*entries), decoder_cache_entry_compare);
+    for(size_t i=0;i<len && total > cache->max_bytes;i++) {
+      if(keep && strcmp(entries[i].path, keep) == 0) continue;
+      // Mapped views keep working after the unlink on POSIX
+      if(remove(entries[i].path) == 0) total -= entries[i].size;
+    }
+  }
+
+  free(entries);
+  return total <= cache->max_bytes;
+}
+
+// XXH64 - https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+#define DECODER_XXH_P1 11400714785074694791ull
+#define DECODER_XXH_P2 14029467366897019727ull
+#define DECODER_XXH_P3 1609587929392839161ull
+#define DECODER_XXH_P4 9650029242287828579ull
+#define DECODER_XXH_P5 2870177450012600261ull
+#define DECODER_XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+DECODER_DEF uint64_t decoder_hash_round(uint64_t acc, uint64_t input) {
+  acc += input * DECODER_XXH_P2;
+  acc = DECODER_XXH_ROTL(acc, 31);
+  return acc * DECODER_XXH_P1;
+}
+
+DECODER_DEF uint64_t decoder_hash_merge(uint64_t acc, uint64_t val) {
+  acc ^= decoder_hash_round(0, val);
+  return acc * DECODER_XXH_P1 + DECODER_XXH_P4;
+}
+
+DECODER_DEF uint64_t decoder_hash(const void *data, size_t len, uint64_t seed) {
+  const unsigned char *p = data;
+  const unsigned char *end = p + len;
+  uint64_t h;
+
+  if(len >= 32) {
+    uint64_t v1 = seed + DECODER_XXH_P1 + DECODER_XXH_P2;
+    uint64_t v2 = seed + DECODER_XXH_P2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - DECODER_XXH_P1;
+    do {
+      uint64_t k[4];
+      memcpy(k, p, sizeof(k));
+      v1 = decoder_hash_round(v1, k[0]);
+      v2 = decoder_hash_round(v2, k[1]);
+      v3 = decoder_hash_round(v3, k[2]);
+      v4 = decoder_hash_round(v4, k[3]);
+      p += 32;
+    } while(end - p >= 32);
+
+    h = DECODER_XXH_ROTL(v1, 1) + DECODER_XXH_ROTL(v2, 7) + DECODER_XXH_ROTL(v3, 12) + DECODER_XXH_ROTL(v4, 18);
+    h = decoder_hash_merge(h, v1);
+    h = decoder_hash_merge(h, v2);
+    h = decoder_hash_merge(h, v3);
+    h = decoder_hash_merge(h, v4);
+  } else {
+    h = seed + DECODER_XXH_P5;
+  }
+  h += (uint64_t) len;
+
+  while(end - p >= 8) {
+    uint64_t k;
+    memcpy(&k, p, sizeof(k));
+    h ^= decoder_hash_round(0, k);
+    h = DECODER_XXH_ROTL(h, 27) * DECODER_XXH_P1 + DECODER_XXH_P4;
+    p += 8;
+  }
+  if(end - p >= 4) {
+    uint32_t k;
+    memcpy(&k, p, sizeof(k));
+    h ^= (uint64_t) k * DECODER_XXH_P1;
+    h = DECODER_XXH_ROTL(h, 23) * DECODER_XXH_P2 + DECODER_XXH_P3;
+    p += 4;
+  }
+  while(p < end) {
+    h ^= (uint64_t) *p * DECODER_XXH_P5;
+    h = DECODER_XXH_ROTL(h, 11) * DECODER_XXH_P1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= DECODER_XXH_P2;
+  h ^= h >> 29;
+  h *= DECODER_XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+DECODER_DEF bool decoder_slurp_file_parallel(const char *filepath,
+					     Decoder_Fmt fmt,
+					     float volume,
+					     int threads,
+					     int *channels,
+					     int *sample_rate,
+					     unsigned char **out_samples,
+					     unsigned int *out_samples_count) {
+  Decoder_Mmap m;
+  if(!decoder_mmap_open(&m, filepath)) {
+    return decoder_slurp_file(filepath, fmt, volume, channels, sample_rate,
+			      out_samples, out_samples_count);
+  }
+
+  bool ok = decoder_slurp_memory_parallel((const char *) m.memory.data,
+					  (size_t) m.memory.size,
+					  fmt,
+					  volume,
+					  threads,
+					  channels,
+					  sample_rate,
+					  out_samples,
+					  out_samples_count);
+  decoder_mmap_close(&m);
+  return ok;
+}
+
+// Splits the stream into `threads` segments by the duration estimate. Every
+// segment is decoded by its own Decoder over its own cursor into the shared
+// data, straight into its slice of the result. Falls back to decoder_slurp
+// for codecs not in decoder_parallel_codec, for short or unsized streams,
+// and when the estimate turns out too small.
+DECODER_DEF bool decoder_slurp_memory_parallel(const char *memory,
+					       size_t memory_len,
+					       Decoder_Fmt fmt,
+					       float volume,
+					       int threads,
+					       int *channels,
+					       int *sample_rate,
+					       unsigned char **out_samples,
+					       unsigned int *out_samples_count) {
+  if(decoder_fmt_is_planar(fmt)) {
+    return false;
+  }
+
+  Decoder_Memory mem = {
+    .data = (const unsigned char *) memory,
+    .pos = 0,
+    .size = memory_len,
+  };
+
+  // Every decoder reads through its own copy, segments start from pos 0
+  Decoder_Memory cursor = mem;
+  Decoder decoder;
+  Decoder_Options options = { .direct = true };
+  if(!decoder_init_options(&decoder, decoder_memory_read, decoder_memory_seek, &cursor,
+			   fmt, volume, DECODER_SLURP_SAMPLES, &options, channels, sample_rate)) {
+    return false;
+  }
+  int64_t estimate = decoder_estimate_samples(&decoder);
+  size_t sample_size = (size_t) decoder.sample_size;
+  bool parallel = decoder_parallel_codec(decoder.av_format_context->streams[decoder.stream_index]->codecpar);
+  decoder_free(&decoder);
+
+  int64_t min_segment = (int64_t) DECODER_PARALLEL_MIN_SEGMENT_SECONDS * (*sample_rate);
+  if(threads > 64) threads = 64;
+  if(estimate > 0 && estimate / min_segment < threads) threads = (int) (estimate / min_segment);
+  if(!parallel || estimate < 0 || threads < 2) {
+    return decoder_slurp_memory(memory, memory_len, fmt, volume, channels, sample_rate,
+				out_samples, out_samples_count);
+  }
+
+  int64_t capacity = estimate + estimate / 32 + 2 * DECODER_SLURP_SAMPLES;
+  unsigned char *samples = malloc((size_t) capacity * sample_size);
+  if(!samples) {
+    return false;
+  }
+
+  Decoder_Segment segments[64];
+  Thread ids[64];
+  int started = 0;
+  for(int i=0;i<threads;i++) {
+    Decoder_Segment *s = &segments[i];
+    s->memory = mem;
+    s->fmt = fmt;
+    s->volume = volume;
+    s->start = estimate * i / threads;
+    s->end = i + 1 < threads ? estimate * (i + 1) / threads : -1;
+    s->out = samples + s->start * sample_size;
+    s->capacity = (s->end < 0 ? capacity : s->end) - s->start;
+    s->written = 0;
+    s->overflow = false;
+    s->ok = false;
+    if(!thread_create(&ids[i], decoder_segment_thread, s)) {
+      break;
+    }
+    started++;
+  }
+
+  bool ok = started == threads;
+  for(int i=0;i<started;i++) {
+    thread_join(ids[i]);
+  }
+  for(int i=0;ok && i<threads;i++) {
+    Decoder_Segment *s = &segments[i];
+    // A short inner segment leaves a hole, a long last one does not fit
+    if(!s->ok || s->overflow || (s->end >= 0 && s->written != s->end - s->start)) {
+      ok = false;
+    }
+  }
+  if(!ok) {
+    free(samples);
+    return decoder_slurp_memory(memory, memory_len, fmt, volume, channels, sample_rate,
+				out_samples, out_samples_count);
+  }
+
+  int64_t samples_count = segments[threads - 1].start + segments[threads - 1].written;
+  unsigned char *new_samples = realloc(samples, (size_t) samples_count * sample_size);
+  if(new_samples) samples = new_samples;
+
+  *out_samples = samples;
+  *out_samples_count = (unsigned int) samples_count;
+  return true;
+}
+
+// Codecs whose segments check_parallel.c found bit-exact with decoder_slurp
+DECODER_DEF bool decoder_parallel_codec(const AVCodecParameters *par) {
+  // Every PCM variant, ADPCM starts after them
+  if(par->codec_id >= AV_CODEC_ID_PCM_S16LE && par->codec_id < AV_CODEC_ID_ADPCM_IMA_QT) {
+    return true;
+  }
+
+  switch(par->codec_id) {
+  case AV_CODEC_ID_FLAC:
+  case AV_CODEC_ID_MP3:
+  case AV_CODEC_ID_VORBIS:
+    return true;
+  case AV_CODEC_ID_AAC:
+    // HE-AAC's SBR and PS carry state across frames
+    return par->profile == DECODER_PROFILE_AAC_LOW;
+  default:
+    return false;
+  }
+}
+
+DECODER_DEF void *decoder_segment_thread(void *arg) {
+  Decoder_Segment *s = arg;
+
+  Decoder decoder;
+  int channels, sample_rate;
+  Decoder_Options options = { .direct = true };
+  if(!decoder_init_options(&decoder, decoder_memory_read, decoder_memory_seek, &s->memory,
+			   s->fmt, s->volume, DECODER_SLURP_SAMPLES, &options, &channels, &sample_rate)) {
+    return NULL;
+  }
+  size_t sample_size = (size_t) decoder.sample_size;
+
+  if(s->start > 0 && !decoder_seek_preroll(&decoder, s->start, DECODER_PARALLEL_PREROLL)) {
+    decoder_free(&decoder);
+    return NULL;
+  }
+
+  // Near the end of the slice decode into scratch, the next slice belongs
+  // to another thread
+  unsigned char *scratch = malloc(DECODER_SLURP_SAMPLES * sample_size);
+  if(!scratch) {
+    decoder_free(&decoder);
+    return NULL;
+  }
+
+  while(s->written < s->capacity) {
+    int64_t left = s->capacity - s->written;
+    unsigned char *dst = left >= DECODER_SLURP_SAMPLES
+      ? s->out + s->written * sample_size
+      : scratch;
+
+    int n;
+    if(!decoder_decode(&decoder, &n, dst)) {
+      break;
+    }
+    if(decoder.seek_late > 0) {
+      // Started past s->start, the slice would be shifted. Leave s->ok
+      // unset, so that the caller falls back to decoder_slurp
+      free(scratch);
+      decoder_free(&decoder);
+      return NULL;
+    }
+    if(n > left) {
+      n = (int) left;
+      if(s->end < 0) s->overflow = true;
+    }
+    if(dst == scratch) {
+      memcpy(s->out + s->written * sample_size, scratch, (size_t) n * sample_size);
+    }
+    s->written += n;
+  }
+  if(s->end < 0 && s->written == s->capacity) {
+    // The last slice filled the whole buffer, check for more
+    int n;
+    while(!s->overflow && decoder_decode(&decoder, &n, scratch)) {
+      if(n > 0) s->overflow = true;
+    }
+  }
+
+  free(scratch);
+  decoder_free(&decoder);
+  s->ok = true;
+  return NULL;
+}
+
+DECODER_DEF bool decoder_slurp_chunks(Decoder_Read read,
+				      Decoder_Seek seek,
+				      void *opaque,
+				      Decoder_Fmt fmt,
+				      float volume,
+				      int *channels,
+				      int *sample_rate,
+				      Decoder_Chunks *chunks) {
+  Decoder decoder;
+  if(!decoder_init(&decoder, read, seek, opaque,
+		   fmt, volume, DECODER_SLURP_SAMPLES, channels, sample_rate)) {
+    return false;
+  }
+
+  bool ok = decoder_chunks_fill(&decoder, chunks);
+  decoder_free(&decoder);
+  return ok;
+}
+
+DECODER_DEF bool decoder_chunks_fill(Decoder *decoder, Decoder_Chunks *chunks) {
+  chunks->first = NULL;
+  chunks->last = NULL;
+  chunks->sample_size = decoder->sample_size;
+  chunks->samples_count = 0;
+
+  if(decoder_fmt_is_planar(decoder->fmt)) {
+    return false;
+  }
+
+  size_t sample_size = (size_t) decoder->sample_size;
+  unsigned int chunk_cap = (unsigned int) (DECODER_CHUNK_SIZE / sample_size);
+  if(chunk_cap < DECODER_SLURP_SAMPLES) {
+    return false;
+  }
+
+  Decoder_Chunk *chunk = NULL;
+  while(true) {
+    if(!chunk || chunk_cap - chunk->samples_count < DECODER_SLURP_SAMPLES) {
+      void *mem = malloc(sizeof(Decoder_Chunk) + 63 + (size_t) chunk_cap * sample_size);
+      if(!mem) {
+	decoder_chunks_free(chunks);
+	return false;
+      }
+      chunk = mem;
+      chunk->next = NULL;
+      chunk->data = (unsigned char *) (((uintptr_t) (chunk + 1) + 63) & ~(uintptr_t) 63);
+      chunk->samples_count = 0;
+
+      if(chunks->last) chunks->last->next = chunk;
+      else chunks->first = chunk;
+      chunks->last = chunk;
+    }
+
+    int decoded_samples_count;
+    if(!decoder_decode(decoder, &decoded_samples_count,
+		       chunk->data + chunk->samples_count * sample_size)) {
+      break;
+    }
+    chunk->samples_count += (unsigned int) decoded_samples_count;
+    chunks->samples_count += (uint64_t) decoded_samples_count;
+  }
+
+  return true;
+}
+
+DECODER_DEF void decoder_chunks_free(Decoder_Chunks *chunks) {
+  Decoder_Chunk *chunk = chunks->first;
+  while(chunk) {
+    Decoder_Chunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  chunks->first = NULL;
+  chunks->last = NULL;
+  chunks->samples_count = 0;
+}
+
+// Duration of the audio stream in output samples, -1 if unknown
+DECODER_DEF int64_t decoder_estimate_samples(Decoder *decoder) {
+  AVStream *stream = decoder->av_format_context->streams[decoder->stream_index];
+  AVRational out = {1, decoder->sample_rate};
+
+  if(stream->duration != AV_NOPTS_VALUE && stream->duration > 0) {
+    return av_rescale_q(stream->duration, stream->time_base, out);
+  }
+
+  int64_t duration = decoder->av_format_context->duration;
+  if(duration != AV_NOPTS_VALUE && duration > 0) {
+    return av_rescale_q(duration, (AVRational) {1, AV_TIME_BASE}, out);
+  }
+
+  return -1;
+}
+
+DECODER_DEF bool decoder_init(Decoder *decoder,
+			      Decoder_Read read,
+			      Decoder_Seek seek,
+			      void *opaque,
+			      Decoder_Fmt fmt,
+			      float volume,
+			      int samples,
+			      int *channels,
+			      int *sample_rate) {
+  return decoder_init_options(decoder, read, seek, opaque, fmt, volume, samples,
+			      NULL, channels, sample_rate);
+}
+
+DECODER_DEF bool decoder_init_options(Decoder *decoder,
+				      Decoder_Read read,
+				      Decoder_Seek seek,
+				      void *opaque,
+				      Decoder_Fmt fmt,
+				      float volume,
+				      int samples,
+				      const Decoder_Options *options,
+				      int *channels,
+				      int *sample_rate) {
+  Decoder_Options defaults = {0};
+  if(!options) options = &defaults;
+  if(options->sample_rate < 0 || options->channels < 0) {
+    return false;
+  }
+
+  decoder->av_io_context = NULL;
+  decoder->av_format_context = NULL;
+  decoder->av_codec_context = NULL;
+  decoder->swr_context = NULL;
+  decoder->packet = NULL;
+  decoder->frame = NULL;
+  decoder->pipeline = NULL;
+  memset(decoder->held, 0, sizeof(decoder->held));
+  decoder->held_head = 0;
+  decoder->held_count = 0;
+  decoder->pool = options->pool;
+  decoder->codec_key = 0;
+  decoder->swr_key = 0;
+  decoder->target_volume = volume;
+  decoder->volume = volume;
+  for(int c=0;c<DECODER_MAX_CHANNELS;c++) {
+    decoder->channel_gains[c] = 1.f;
+    decoder->gains[c] = volume;
+  }
+  decoder->continue_receive = false;
+  decoder->continue_convert = false;
+
+  decoder->convert_buffer = NULL;
+  decoder->convert_capacity = 0;
+  decoder->draining = false;
+  decoder->fmt = fmt;
+  decoder->mix = options->mix;
+
+  decoder->index = NULL;
+  decoder->index_sequential = true;
+  decoder->seek_pending = false;
+  decoder->discard = 0;
+  decoder->seek_late = 0;
+  decoder->pts_sync = false;
+  decoder->pts_offset = 0;
+
+  decoder->samples = samples;
+  enum AVSampleFormat av_sample_format;
+  if(!decoder_fmt_to_libav_fmt(&av_sample_format, fmt)) {
+      return false;
+  }
+
+  unsigned char *av_io_buffer = decoder_pool_take(decoder->pool, DECODER_POOL_BUFFER, 0);
+  if(!av_io_buffer) av_io_buffer = av_malloc(DECODER_AVIO_BUFFER_SIZE);
+  if(!av_io_buffer) {
+    decoder_free(decoder);
+    return false;
+  }
+  decoder->av_io_context = avio_alloc_context(av_io_buffer, DECODER_AVIO_BUFFER_SIZE, 0, opaque, read, NULL, seek);
+  if(!decoder->av_io_context) {
+    decoder_pool_put(decoder->pool, DECODER_POOL_BUFFER, 0, av_io_buffer);
+    decoder_free(decoder);
+    return false;
+  }
+  decoder->av_io_context->direct = options->direct;
+
+  decoder->av_format_context = avformat_alloc_context();
+  if(!decoder->av_format_context) {
+    decoder_free(decoder);
+    return false;
+  }
+
+  decoder->av_format_context->pb = decoder->av_io_context;
+  decoder->av_format_context->flags = AVFMT_FLAG_CUSTOM_IO;
+  // Without seek, everything probed stays buffered in libav, so bound it
+  int64_t probesize = options->probesize;
+  int64_t analyzeduration = options->analyzeduration;
+  if(!seek) {
+    if(probesize <= 0) probesize = DECODER_STREAM_PROBESIZE;
+    if(analyzeduration <= 0) analyzeduration = DECODER_STREAM_ANALYZEDURATION;
+  }
+  if(probesize > 0) {
+    av_opt_set_int(decoder->av_format_context, "probesize", probesize, 0);
+  }
+  if(analyzeduration > 0) {
+    av_opt_set_int(decoder->av_format_context, "analyzeduration", analyzeduration, 0);
+  }
+
+  // A cached probe also names the demuxer, which skips format probing
+  Decoder_Probe probe;
+  unsigned char *probe_extradata = NULL;
+  bool cached = decoder_probe_load(options, &probe, &probe_extradata);
+  const AVInputFormat *av_input_format = cached ? av_find_input_format(probe.format) : NULL;
+
+  if (avformat_open_input(&decoder->av_format_context, "", av_input_format, NULL) != 0) {
+    free(probe_extradata);
+    decoder_free(decoder);
+    return false;
+  }
+
+  bool probed = cached && decoder_probe_apply(decoder->av_format_context, &probe, probe_extradata);
+  free(probe_extradata);
+  if(!probed && avformat_find_stream_info(decoder->av_format_context, NULL) < 0) {
+    decoder_free(decoder);
+    return false;
+  }
+
+  decoder->stream_index = -1;
+
+  const AVCodec *av_codec = NULL;
+  AVCodecParameters *av_codec_parameters = NULL;
+  for(size_t i=0;i<decoder->av_format_context->nb_streams;i++) {
+    av_codec_parameters = decoder->av_format_context->streams[i]->codecpar;
+    if(av_codec_parameters->codec_type == AVMEDIA_TYPE_AUDIO) {
+      decoder->stream_index = (int) i;
+      av_codec = avcodec_find_decoder(av_codec_parameters->codec_id);
+      if(!av_codec) {
+	decoder_free(decoder);
+	return false;
+      }
+      break;
+    }
+  }
+  if(av_codec == NULL) {
+    decoder_free(decoder);
+    return false;
+  }
+  if(!probed) {
+    decoder_probe_store(options, decoder->av_format_context, decoder->stream_index);
+  }
+
+  // Let the demuxer skip everything but the audio stream, e.g. video
+  for(size_t i=0;i<decoder->av_format_context->nb_streams;i++) {
+    if((int) i != decoder->stream_index) {
+      decoder->av_format_context->streams[i]->discard = AVDISCARD_ALL;
+    }
+  }
+  
+  // A pooled context was opened for the same parameters, a flush is enough
+  uint64_t codec_key = decoder_pool_codec_key(av_codec_parameters);
+  decoder->av_codec_context = decoder_pool_take(decoder->pool, DECODER_POOL_CODEC, codec_key);
+  bool codec_pooled = decoder->av_codec_context != NULL;
+  if(codec_pooled) {
+    avcodec_flush_buffers(decoder->av_codec_context);
+  } else {
+    decoder->av_codec_context = avcodec_alloc_context3(av_codec);
+    if(!decoder->av_codec_context) {
+      decoder_free(decoder);
+      return false;
+    }
+
+    if(avcodec_parameters_to_context(decoder->av_codec_context, av_codec_parameters) < 0) {
+      decoder_free(decoder);
+      return false;
+    }
+  }
+  // Without it the codec can not move pts past the samples it trims
+  // (encoder delay), and decoder_seek_resolve would discard them twice
+  decoder->av_codec_context->pkt_timebase =
+    decoder->av_format_context->streams[decoder->stream_index]->time_base;
+
+  int in_rate = decoder->av_codec_context->sample_rate;
+  *sample_rate = options->sample_rate ? options->sample_rate : in_rate;
+  decoder->sample_rate = *sample_rate;
+  decoder->index_interval =
+    av_rescale_q(DECODER_INDEX_INTERVAL_MS, (AVRational) {1, 1000},
+		 decoder->av_format_context->streams[decoder->stream_index]->time_base);
+
+  if(!codec_pooled && avcodec_open2(decoder->av_codec_context, av_codec, NULL) < 0) {
+    decoder_free(decoder);
+    return false;
+  }
+  decoder->codec_key = codec_key;
+  
+  // Files without a channel order (e.g. "2 channels") get the default
+  // layout for their channel count
+  AVChannelLayout in_layout;
+  if(av_codec_parameters->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC) {
+    av_channel_layout_default(&in_layout, av_codec_parameters->ch_layout.nb_channels);
+  } else if(av_channel_layout_copy(&in_layout, &av_codec_parameters->ch_layout) < 0) {
+    decoder_free(decoder);
+    return false;
+  }
+  if(in_layout.nb_channels <= 0) {
+    decoder_free(decoder);
+    return false;
+  }
+
+  AVChannelLayout out_layout;
+  switch(decoder->mix) {
+  case DECODER_MIX_NATIVE:
+    if(options->channels && options->channels != in_layout.nb_channels) {
+      av_channel_layout_default(&out_layout, options->channels);
+    } else {
+      av_channel_layout_copy(&out_layout, &in_layout);
+    }
+    break;
+  case DECODER_MIX_MONO:
+    out_layout = (AVChannelLayout) AV_CHANNEL_LAYOUT_MONO;
+    break;
+  case DECODER_MIX_MID_SIDE:
+    out_layout = (AVChannelLayout) AV_CHANNEL_LAYOUT_STEREO;
+    break;
+  default:
+    av_channel_layout_uninit(&in_layout);
+    decoder_free(decoder);
+    return false;
+  }
+  *channels = out_layout.nb_channels;
+  if(*channels > DECODER_MAX_CHANNELS) {
+    av_channel_layout_uninit(&in_layout);
+    av_channel_layout_uninit(&out_layout);
+    decoder_free(decoder);
+    return false;
+  }
+
+  uint64_t swr_key = decoder_pool_swr_key(&in_layout, decoder->av_codec_context->sample_fmt, in_rate,
+					  &out_layout, av_sample_format, *sample_rate, decoder->mix);
+  decoder->swr_context = decoder_pool_take(decoder->pool, DECODER_POOL_SWR, swr_key);
+  int sts = 0;
+  if(decoder->swr_context) {
+    // Without resampling a drained context holds no state, otherwise reset
+    if(in_rate != *sample_rate || swr_get_out_samples(decoder->swr_context, 0) > 0) {
+      sts = swr_init(decoder->swr_context);
+    }
+  } else {
+    sts = swr_alloc_set_opts2(&decoder->swr_context,
+			      &out_layout, av_sample_format, *sample_rate,
+			      &in_layout, decoder->av_codec_context->sample_fmt, in_rate,
+			      0, NULL);
+    if(sts >= 0 &&
+       decoder->mix == DECODER_MIX_MID_SIDE &&
+       !decoder_mid_side_matrix(decoder->swr_context, &in_layout)) {
+      sts = -1;
+    }
+    if(sts >= 0) {
+      sts = swr_init(decoder->swr_context);
+    }
+  }
+  av_channel_layout_uninit(&in_layout);
+  av_channel_layout_uninit(&out_layout);
+  if(sts < 0) {
+    decoder_free(decoder);
+    return false;
+  }
+  decoder->swr_key = swr_key;
+  //swr_set_quality(decoder->swr_context, 7);
+  //swr_set_resample_mode(decoder->swr_context, SWR_FILTER_TYPE_CUBIC);
+
+  int bits_per_sample;
+  if(!decoder_fmt_to_bits_per_sample(&bits_per_sample, fmt)) {
+    return false;
+  }
+  decoder->sample_size = *channels * bits_per_sample / 8;
+  decoder->channels = *channels;
+    
+  decoder->packet = decoder_pool_take(decoder->pool, DECODER_POOL_PACKET, 0);
+  if(!decoder->packet) decoder->packet = av_packet_alloc();
+  if(!decoder->packet) {
+    decoder_free(decoder);
+    return false;
+  }
+  
+  decoder->frame = decoder_pool_take(decoder->pool, DECODER_POOL_FRAME, 0);
+  if(!decoder->frame) decoder->frame = av_frame_alloc();
+  if(!decoder->frame) {
+    decoder_free(decoder);
+    return false;
+  }
+  
+  return true;    
+}
+
+DECODER_DEF bool decoder_probe_identity(const char *filepath, uint64_t *key) {
+  struct{
+    uint64_t device;
+    uint64_t file;
+    uint64_t size;
+    int64_t mtime;
+  } id = {0};
+
+#ifdef _WIN32
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if(!GetFileAttributesExA(filepath, GetFileExInfoStandard, &data)) {
+    return false;
+  }
+  // No inode here, the path stands in for it
+  id.file = decoder_hash(filepath, strlen(filepath), 0);
+  id.size = ((uint64_t) data.nFileSizeHigh << 32) | data.nFileSizeLow;
+  id.mtime = (int64_t) (((uint64_t) data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime);
+#else
+  struct stat st;
+  if(stat(filepath, &st) < 0) {
+    return false;
+  }
+  id.device = (uint64_t) st.st_dev;
+  id.file = (uint64_t) st.st_ino;
+  id.size = (uint64_t) st.st_size;
+  id.mtime = (int64_t) st.st_mtime;
+#endif //_WIN32
+
+  *key = decoder_hash(&id, sizeof(id), DECODER_PROBE_MAGIC);
+  return true;
+}
+
+DECODER_DEF bool decoder_probe_path(char *path, size_t path_size, const Decoder_Options *options) {
+  // Key 0 is the unset default, it would map every source to one entry
+  if(!options->probe_cache_dir || options->probe_key == 0) {
+    return false;
+  }
+  return snprintf(path, path_size, "%s/%016llx.probe",
+		  options->probe_cache_dir, (unsigned long long) options->probe_key) < (int) path_size;
+}
+
+DECODER_DEF bool decoder_probe_load(const Decoder_Options *options, Decoder_Probe *probe, unsigned char **extradata) {
+  char path[1024];
+  if(!decoder_probe_path(path, sizeof(path), options)) {
+    return false;
+  }
+
+  FILE *f = fopen(path, "rb");
+  if(!f) {
+    return false;
+  }
+
+  *extradata = NULL;
+  bool ok =
+    fread(probe, sizeof(*probe), 1, f) == 1 &&
+    probe->magic == DECODER_PROBE_MAGIC &&
+    probe->version == DECODER_PROBE_VERSION &&
+    probe->extradata_size >= 0 &&
+    probe->format[sizeof(probe->format) - 1] == '\0';
+  if(ok && probe->extradata_size > 0) {
+    *extradata = malloc((size_t) probe->extradata_size);
+    ok = *extradata &&
+      fread(*extradata, (size_t) probe->extradata_size, 1, f) == 1;
+  }
+  fclose(f);
+
+  if(!ok) {
+    free(*extradata);
+    *extradata = NULL;
+  }
+  return ok;
+}
+
+DECODER_DEF bool decoder_probe_store(const Decoder_Options *options, AVFormatContext *ctx, int stream_index) {
+  char path[1024];
+  char tmp[1024];
+  if(!decoder_probe_path(path, sizeof(path), options) ||
+     snprintf(tmp, sizeof(tmp), "%s.%lx.tmp", path, (unsigned long) (uintptr_t) ctx) >= (int) sizeof(tmp)) {
+    return false;
+  }
+
+  AVStream *stream = ctx->streams[stream_index];
+  AVCodecParameters *par = stream->codecpar;
+  if(par->ch_layout.order == AV_CHANNEL_ORDER_CUSTOM ||
+     par->ch_layout.order == AV_CHANNEL_ORDER_AMBISONIC) {
+    // Needs the channel map, not worth caching
+    return false;
+  }
+
+  Decoder_Probe probe = {
+    .magic = DECODER_PROBE_MAGIC,
+    .version = DECODER_PROBE_VERSION,
+    .stream_index = stream_index,
+    .codec_id = (int32_t) par->codec_id,
+    .sample_fmt = par->format,
+    .sample_rate = par->sample_rate,
+    .channels = par->ch_layout.nb_channels,
+    .channel_order = (int32_t) par->ch_layout.order,
+    .channel_mask = par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? par->ch_layout.u.mask : 0,
+    .bit_rate = par->bit_rate,
+    .block_align = par->block_align,
+    .frame_size = par->frame_size,
+    .bits_per_coded_sample = par->bits_per_coded_sample,
+    .bits_per_raw_sample = par->bits_per_raw_sample,
+    .initial_padding = par->initial_padding,
+    .trailing_padding = par->trailing_padding,
+    .seek_preroll = par->seek_preroll,
+    .profile = par->profile,
+    .time_base_num = stream->time_base.num,
+    .time_base_den = stream->time_base.den,
+    .start_time = stream->start_time,
+    .duration = stream->duration,
+    .format_duration = ctx->duration,
+    .extradata_size = par->extradata ? par->extradata_size : 0,
+  };
+  size_t name_len = strcspn(ctx->iformat->name, ",");
+  if(name_len >= sizeof(probe.format)) {
+    return false;
+  }
+  memcpy(probe.format, ctx->iformat->name, name_len);
+
+  FILE *f = fopen(tmp, "wb");
+  if(!f) {
+    return false;
+  }
+  bool ok =
+    fwrite(&probe, sizeof(probe), 1, f) == 1 &&
+    (probe.extradata_size == 0 || fwrite(par->extradata, (size_t) probe.extradata_size, 1, f) == 1);
+  if(fclose(f) != 0) ok = false;
+
+#ifdef _WIN32
+  if(ok) ok = MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  if(ok) ok = rename(tmp, path) == 0;
+#endif //_WIN32
+  if(!ok) remove(tmp);
+
+  return ok;
+}
+
+// Fills in what avformat_find_stream_info would have. Fails if the opened
+// file does not look like the one that was probed.
+DECODER_DEF bool decoder_probe_apply(AVFormatContext *ctx, const Decoder_Probe *probe, const unsigned char *extradata) {
+  if(probe->stream_index < 0 || (unsigned int) probe->stream_index >= ctx->nb_streams) {
+    return false;
+  }
+  for(int i=0;i<probe->stream_index;i++) {
+    if(ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+      return false;
+    }
+  }
+
+  AVStream *stream = ctx->streams[probe->stream_index];
+  AVCodecParameters *par = stream->codecpar;
+  if(par->codec_type != AVMEDIA_TYPE_AUDIO ||
+     (par->codec_id != AV_CODEC_ID_NONE && par->codec_id != (enum AVCodecID) probe->codec_id) ||
+     probe->channels <= 0 || probe->sample_rate <= 0) {
+    return false;
+  }
+
+  if(probe->extradata_size > 0 && !par->extradata) {
+    par->extradata = av_mallocz((size_t) probe->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if(!par->extradata) {
+      return false;
+    }
+    memcpy(par->extradata, extradata, (size_t) probe->extradata_size);
+    par->extradata_size = probe->extradata_size;
+  }
+
+  av_channel_layout_uninit(&par->ch_layout);
+  if(probe->channel_order == AV_CHANNEL_ORDER_NATIVE) {
+    av_channel_layout_from_mask(&par->ch_layout, probe->channel_mask);
+  } else {
+    par->ch_layout.order = AV_CHANNEL_ORDER_UNSPEC;
+    par->ch_layout.nb_channels = probe->channels;
+  }
+
+  par->codec_id = (enum AVCodecID) probe->codec_id;
+  par->format = probe->sample_fmt;
+  par->sample_rate = probe->sample_rate;
+  par->bit_rate = probe->bit_rate;
+  par->block_align = probe->block_align;
+  par->frame_size = probe->frame_size;
+  par->bits_per_coded_sample = probe->bits_per_coded_sample;
+  par->bits_per_raw_sample = probe->bits_per_raw_sample;
+  par->initial_padding = probe->initial_padding;
+  par->trailing_padding = probe->trailing_padding;
+  par->seek_preroll = probe->seek_preroll;
+  par->profile = probe->profile;
+
+  if(stream->time_base.num == probe->time_base_num &&
+     stream->time_base.den == probe->time_base_den) {
+    if(stream->start_time == AV_NOPTS_VALUE) stream->start_time = probe->start_time;
+    if(stream->duration == AV_NOPTS_VALUE) stream->duration = probe->duration;
+  }
+  if(ctx->duration == AV_NOPTS_VALUE) ctx->duration = probe->format_duration;
+
+  return true;
+}
+
+DECODER_DEF bool decoder_multi_init(Decoder_Multi *multi,
+				    Decoder_Read read,
+				    Decoder_Seek seek,
+				    void *opaque,
+				    Decoder_Fmt fmt,
+				    int samples) {
+  memset(multi, 0, sizeof(*multi));
+  multi->fmt = fmt;
+  multi->samples = samples;
+
+  enum AVSampleFormat av_sample_format;
+  if(samples <= 0 || decoder_fmt_is_planar(fmt) || !decoder_fmt_to_libav_fmt(&av_sample_format, fmt)) {
+    return false;
+  }
+
+  unsigned char *av_io_buffer = av_malloc(DECODER_AVIO_BUFFER_SIZE);
+  if(!av_io_buffer) {
+    return false;
+  }
+  multi->av_io_context = avio_alloc_context(av_io_buffer, DECODER_AVIO_BUFFER_SIZE, 0, opaque, read, NULL, seek);
+  if(!multi->av_io_context) {
+    av_free(av_io_buffer);
+    return false;
+  }
+
+  multi->av_format_context = avformat_alloc_context();
+  if(!multi->av_format_context) {
+    decoder_multi_free(multi);
+    return false;
+  }
+  multi->av_format_context->pb = multi->av_io_context;
+  multi->av_format_context->flags = AVFMT_FLAG_CUSTOM_IO;
+  if(!seek) {
+    av_opt_set_int(multi->av_format_context, "probesize", DECODER_STREAM_PROBESIZE, 0);
+    av_opt_set_int(multi->av_format_context, "analyzeduration", DECODER_STREAM_ANALYZEDURATION, 0);
+  }
+
+  if(avformat_open_input(&multi->av_format_context, "", NULL, NULL) != 0 ||
+     avformat_find_stream_info(multi->av_format_context, NULL) < 0) {
+    decoder_multi_free(multi);
+    return false;
+  }
+
+  // Streams that cannot be decoded are left out, not fatal
+  for(unsigned int i=0;i<multi->av_format_context->nb_streams;i++) {
+    AVStream *stream = multi->av_format_context->streams[i];
+    stream->discard = AVDISCARD_ALL;
+    if(stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO ||
+       multi->streams_count == DECODER_MULTI_MAX_STREAMS) {
+      continue;
+    }
+
+    Decoder_Multi_Stream *s = &multi->streams[multi->streams_count];
+    if(decoder_multi_stream_open(multi, s, (int) i)) {
+      multi->streams_count++;
+    } else {
+      decoder_multi_stream_close(s);
+    }
+  }
+
+  multi->packet = av_packet_alloc();
+  if(!multi->packet || multi->streams_count == 0) {
+    decoder_multi_free(multi);
+    return false;
+  }
+
+  return true;
+}
+
+DECODER_DEF bool decoder_multi_stream_open(Decoder_Multi *multi, Decoder_Multi_Stream *s, int stream_index) {
+  memset(s, 0, sizeof(*s));
+  s->multi = multi;
+  s->index = multi->streams_count;
+  s->stream_index = stream_index;
+
+  AVCodecParameters *par = multi->av_format_context->streams[stream_index]->codecpar;
+  const AVCodec *av_codec = avcodec_find_decoder(par->codec_id);
+  if(!av_codec) {
+    return false;
+  }
+
+  s->av_codec_context = avcodec_alloc_context3(av_codec);
+  if(!s->av_codec_context ||
+     avcodec_parameters_to_context(s->av_codec_context, par) < 0 ||
+     avcodec_open2(s->av_codec_context, av_codec, NULL) < 0) {
+    return false;
+  }
+
+  AVChannelLayout layout;
+  if(par->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC) {
+    av_channel_layout_default(&layout, par->ch_layout.nb_channels);
+  } else if(av_channel_layout_copy(&layout, &par->ch_layout) < 0) {
+    return false;
+  }
+
+  enum AVSampleFormat av_sample_format;
+  decoder_fmt_to_libav_fmt(&av_sample_format, multi->fmt);
+  s->channels = layout.nb_channels;
+  s->sample_rate = s->av_codec_context->sample_rate;
+  int sts = s->channels > 0 ? swr_alloc_set_opts2(&s->swr_context,
+						  &layout, av_sample_format, s->sample_rate,
+						  &layout, s->av_codec_context->sample_fmt, s->sample_rate,
+						  0, NULL) : -1;
+  av_channel_layout_uninit(&layout);
+  if(sts < 0 || swr_init(s->swr_context) < 0) {
+    return false;
+  }
+
+  int bits_per_sample;
+  decoder_fmt_to_bits_per_sample(&bits_per_sample, multi->fmt);
+  s->buffer = av_malloc((size_t) multi->samples * s->channels * bits_per_sample / 8);
+  s->packet = av_packet_alloc();
+  s->frame = av_frame_alloc();
+  s->ok = s->buffer && s->packet && s->frame;
+  return s->ok;
+}
+
+DECODER_DEF void decoder_multi_stream_close(Decoder_Multi_Stream *s) {
+  for(size_t i=0;i<DECODER_MULTI_PACKETS;i++) {
+    if(s->packets[i]) av_packet_free(&s->packets[i]);
+  }
+  if(s->frame) av_frame_free(&s->frame);
+  if(s->packet) av_packet_free(&s->packet);
+  if(s->buffer) av_freep(&s->buffer);
+  if(s->swr_context) swr_free(&s->swr_context);
+  if(s->av_codec_context) {
+    avcodec_close(s->av_codec_context);
+    avcodec_free_context(&s->av_codec_context);
+  }
+}
+
+DECODER_DEF bool decoder_multi_sink(Decoder_Multi *multi, int stream, Decoder_Multi_Sink sink, void *userdata) {
+  if(stream < 0 || stream >= multi->streams_count) {
+    return false;
+  }
+  multi->streams[stream].sink = sink;
+  multi->streams[stream].userdata = userdata;
+  return true;
+}
+
+// Decodes one packet and delivers everything it yields, NULL drains the
+// codec and swresample at the end
+DECODER_DEF bool decoder_multi_stream_decode(Decoder_Multi_Stream *s, const AVPacket *packet) {
+  if(avcodec_send_packet(s->av_codec_context, packet) < 0) {
+    return false;
+  }
+
+  int samples = s->multi->samples;
+  while(avcodec_receive_frame(s->av_codec_context, s->frame) >= 0) {
+    const unsigned char **in = (const unsigned char **) s->frame->data;
+    int in_count = s->frame->nb_samples;
+
+    // Keep converting while the block fills up, swresample buffers the rest
+    const unsigned char *none[1] = {NULL};
+    int n;
+    do {
+      n = swr_convert(s->swr_context, &s->buffer, samples, in, in_count);
+      if(n < 0) {
+	av_frame_unref(s->frame);
+	return false;
+      }
+      if(n > 0) s->sink(s->userdata, s->index, s->buffer, n);
+      in = none;
+      in_count = 0;
+    } while(n == samples);
+
+    av_frame_unref(s->frame);
+  }
+
+  if(!packet) {
+    int n;
+    while((n = swr_convert(s->swr_context, &s->buffer, samples, NULL, 0)) > 0) {
+      s->sink(s->userdata, s->index, s->buffer, n);
+    }
+  }
+
+  return true;
+}
+
+// Falls back to decoding on the demux thread if the thread cannot start
+DECODER_DEF bool decoder_multi_stream_start(Decoder_Multi_Stream *s) {
+  bool ok = true;
+  for(size_t i=0;ok && i<DECODER_MULTI_PACKETS;i++) {
+    s->packets[i] = av_packet_alloc();
+    ok = s->packets[i] != NULL;
+  }
+
+  if(ok && !mutex_create(&s->mutex)) {
+    ok = false;
+  } else if(ok && !cond_create(&s->cond)) {
+    mutex_free(&s->mutex);
+    ok = false;
+  } else if(ok && !thread_create(&s->thread, decoder_multi_thread, s)) {
+    cond_free(&s->cond);
+    mutex_free(&s->mutex);
+    ok = false;
+  }
+
+  s->running = ok;
+  return ok;
+}
+
+DECODER_DEF void *decoder_multi_thread(void *arg) {
+  Decoder_Multi_Stream *s = arg;
+
+  mutex_lock(&s->mutex);
+  while(true) {
+    while(s->count == 0 && !s->eof) {
+      cond_wait(&s->cond, &s->mutex);
+    }
+    if(s->count == 0) {
+      break;
+    }
+
+    av_packet_move_ref(s->packet, s->packets[s->head]);
+    s->head = (s->head + 1) % DECODER_MULTI_PACKETS;
+    s->count--;
+    cond_broadcast(&s->cond);
+    mutex_release(&s->mutex);
+
+    // A failed stream keeps draining its queue so the demuxer never blocks
+    if(s->ok) s->ok = decoder_multi_stream_decode(s, s->packet);
+    av_packet_unref(s->packet);
+
+    mutex_lock(&s->mutex);
+  }
+  mutex_release(&s->mutex);
+
+  if(s->ok) s->ok = decoder_multi_stream_decode(s, NULL);
+  return NULL;
+}
+
+// Decodes to the end. False if demuxing failed before the end, a stream
+// that failed on its own has `ok` cleared.
+DECODER_DEF bool decoder_multi_run(Decoder_Multi *multi, bool threaded) {
+  Decoder_Multi_Stream *by_index[DECODER_MULTI_MAX_STREAMS] = {0};
+  int by_index_count = 0;
+
+  for(int i=0;i<multi->streams_count;i++) {
+    Decoder_Multi_Stream *s = &multi->streams[i];
+    if(!s->sink) {
+      continue;
+    }
+    multi->av_format_context->streams[s->stream_index]->discard = AVDISCARD_DEFAULT;
+    by_index[by_index_count++] = s;
+    if(threaded) {
+      decoder_multi_stream_start(s);
+    }
+  }
+
+  int ret;
+  while((ret = av_read_frame(multi->av_format_context, multi->packet)) >= 0) {
+    Decoder_Multi_Stream *s = NULL;
+    for(int i=0;i<by_index_count;i++) {
+      if(by_index[i]->stream_index == multi->packet->stream_index) {
+	s = by_index[i];
+	break;
+      }
+    }
+
+    if(s && s->running) {
+      mutex_lock(&s->mutex);
+      while(s->count == DECODER_MULTI_PACKETS) {
+	cond_wait(&s->cond, &s->mutex);
+      }
+      av_packet_move_ref(s->packets[(s->head + s->count) % DECODER_MULTI_PACKETS], multi->packet);
+      s->count++;
+      cond_broadcast(&s->cond);
+      mutex_release(&s->mutex);
+    } else if(s && s->ok) {
+      s->ok = decoder_multi_stream_decode(s, multi->packet);
+    }
+    av_packet_unref(multi->packet);
+  }
+
+  for(int i=0;i<by_index_count;i++) {
+    Decoder_Multi_Stream *s = by_index[i];
+    if(!s->running) {
+      if(s->ok) s->ok = decoder_multi_stream_decode(s, NULL);
+      continue;
+    }
+
+    mutex_lock(&s->mutex);
+    s->eof = true;
+    cond_broadcast(&s->cond);
+    mutex_release(&s->mutex);
+    thread_join(s->thread);
+
+    cond_free(&s->cond);
+    mutex_free(&s->mutex);
+    s->running = false;
+  }
+
+  return ret == AVERROR_EOF;
+}
+
+DECODER_DEF void decoder_multi_free(Decoder_Multi *multi) {
+  for(int i=0;i<multi->streams_count;i++) {
+    decoder_multi_stream_close(&multi->streams[i]);
+  }
+  multi->streams_count = 0;
+
+  if(multi->packet) {
+    av_packet_free(&multi->packet);
+  }
+
+  if(multi->av_format_context) {
+    avformat_close_input(&multi->av_format_context);
+  }
+
+  if(multi->av_io_context) {
+    av_freep(&multi->av_io_context->buffer);
+    avio_context_free(&multi->av_io_context);
+  }
+}
+
+DECODER_DEF bool decoder_pool_init(Decoder_Pool *pool) {
+  memset(pool, 0, sizeof(*pool));
+  return mutex_create(&pool->mutex);
+}
+
+DECODER_DEF void decoder_pool_free(Decoder_Pool *pool) {
+  for(size_t i=0;i<pool->slots_count;i++) {
+    decoder_pool_destroy(pool->slots[i].kind, pool->slots[i].object);
+  }
+  mutex_free(&pool->mutex);
+  memset(pool, 0, sizeof(*pool));
+}
+
+// Most recently returned match first, NULL on a miss
+DECODER_DEF void *decoder_pool_take(Decoder_Pool *pool, Decoder_Pool_Kind kind, uint64_t key) {
+  if(!pool) {
+    return NULL;
+  }
+
+  void *object = NULL;
+  mutex_lock(&pool->mutex);
+  for(size_t i=pool->slots_count;i>0;i--) {
+    Decoder_Pool_Slot *slot = &pool->slots[i - 1];
+    if(slot->kind == kind && slot->key == key) {
+      object = slot->object;
+      memmove(slot, slot + 1, (pool->slots_count - i) * sizeof(*slot));
+      pool->slots_count--;
+      break;
+    }
+  }
+  if(object) pool->hits[kind]++;
+  else pool->misses[kind]++;
+  mutex_release(&pool->mutex);
+
+  return object;
+}
+
+DECODER_DEF void decoder_pool_put(Decoder_Pool *pool, Decoder_Pool_Kind kind, uint64_t key, void *object) {
+  if(!object) {
+    return;
+  }
+  if(!pool) {
+    decoder_pool_destroy(kind, object);
+    return;
+  }
+
+  if(kind == DECODER_POOL_PACKET) av_packet_unref(object);
+  if(kind == DECODER_POOL_FRAME) av_frame_unref(object);
+
+  void *evicted = NULL;
+  Decoder_Pool_Kind evicted_kind = DECODER_POOL_BUFFER;
+  mutex_lock(&pool->mutex);
+  if(pool->slots_count == DECODER_POOL_SLOTS) {
+    evicted = pool->slots[0].object;
+    evicted_kind = pool->slots[0].kind;
+    memmove(pool->slots, pool->slots + 1, (DECODER_POOL_SLOTS - 1) * sizeof(*pool->slots));
+    pool->slots_count--;
+  }
+  pool->slots[pool->slots_count++] = (Decoder_Pool_Slot) {
+    .kind = kind,
+    .key = key,
+    .object = object,
+  };
+  mutex_release(&pool->mutex);
+
+  if(evicted) {
+    decoder_pool_destroy(evicted_kind, evicted);
+  }
+}
+
+DECODER_DEF void decoder_pool_destroy(Decoder_Pool_Kind kind, void *object) {
+  switch(kind) {
+  case DECODER_POOL_BUFFER: {
+    av_free(object);
+  } break;
+  case DECODER_POOL_PACKET: {
+    AVPacket *packet = object;
+    av_packet_free(&packet);
+  } break;
+  case DECODER_POOL_FRAME: {
+    AVFrame *frame = object;
+    av_frame_free(&frame);
+  } break;
+  case DECODER_POOL_CODEC: {
+    AVCodecContext *codec = object;
+    avcodec_close(codec);
+    avcodec_free_context(&codec);
+  } break;
+  case DECODER_POOL_SWR: {
+    SwrContext *swr = object;
+    swr_free(&swr);
+  } break;
+  default:
+    break;
+  }
+}
+
+DECODER_DEF uint64_t decoder_pool_layout_hash(const AVChannelLayout *layout, uint64_t seed) {
+  int64_t head[2] = { layout->order, layout->nb_channels };
+  seed = decoder_hash(head, sizeof(head), seed);
+  if(layout->order == AV_CHANNEL_ORDER_CUSTOM) {
+    return decoder_hash(layout->u.map, (size_t) layout->nb_channels * sizeof(*layout->u.map), seed);
+  }
+  return decoder_hash(&layout->u.mask, sizeof(layout->u.mask), seed);
+}
+
+// Everything avcodec_parameters_to_context hands an audio decoder
+DECODER_DEF uint64_t decoder_pool_codec_key(const AVCodecParameters *par) {
+  int64_t fields[] = {
+    par->codec_id,
+    par->codec_tag,
+    par->format,
+    par->sample_rate,
+    par->block_align,
+    par->frame_size,
+    par->bits_per_coded_sample,
+    par->bits_per_raw_sample,
+    par->profile,
+    par->initial_padding,
+    par->trailing_padding,
+    par->seek_preroll,
+    par->extradata_size,
+  };
+  uint64_t key = decoder_hash(fields, sizeof(fields), DECODER_POOL_CODEC);
+  key = decoder_pool_layout_hash(&par->ch_layout, key);
+  if(par->extradata_size > 0) {
+    key = decoder_hash(par->extradata, (size_t) par->extradata_size, key);
+  }
+  return key;
+}
+
+DECODER_DEF uint64_t decoder_pool_swr_key(const AVChannelLayout *in_layout,
+					  enum AVSampleFormat in_fmt,
+					  int in_rate,
+					  const AVChannelLayout *out_layout,
+					  enum AVSampleFormat out_fmt,
+					  int out_rate,
+					  Decoder_Mix mix) {
+  int64_t fields[] = { in_fmt, in_rate, out_fmt, out_rate, mix };
+  uint64_t key = decoder_hash(fields, sizeof(fields), DECODER_POOL_SWR);
+  key = decoder_pool_layout_hash(in_layout, key);
+  return decoder_pool_layout_hash(out_layout, key);
+}
+
+DECODER_DEF void decoder_free(Decoder *decoder) {
+  decoder_pipeline_stop(decoder);
+  decoder_pipeline_drop(decoder);
+
+  decoder->continue_receive = false;
+  decoder->continue_convert = false;
+
+  if(decoder->convert_buffer) {
+    decoder_aligned_free(decoder->convert_buffer);
+    decoder->convert_buffer = NULL;
+  }
+
+  // Without a pool, or before they were set up, these are just freed
+  if(decoder->frame) {
+    decoder_pool_put(decoder->pool, DECODER_POOL_FRAME, 0, decoder->frame);
+    decoder->frame = NULL;    
+  }
+  
+  if(decoder->packet) {
+    decoder_pool_put(decoder->pool, DECODER_POOL_PACKET, 0, decoder->packet);
+    decoder->packet = NULL;    
+  }
+
+  if(decoder->swr_context) {
+    decoder_pool_put(decoder->swr_key ? decoder->pool : NULL, DECODER_POOL_SWR, decoder->swr_key, decoder->swr_context);
+    decoder->swr_context = NULL;    
+  }
+
+  if(decoder->av_codec_context) {
+    decoder_pool_put(decoder->codec_key ? decoder->pool : NULL, DECODER_POOL_CODEC, decoder->codec_key, decoder->av_codec_context);
+    decoder->av_codec_context = NULL;    
+  }
+
+  if(decoder->av_format_context) {
+    avformat_close_input(&decoder->av_format_context);
+    decoder->av_format_context = NULL;    
+  }
+
+  if(decoder->av_io_context) {
+    // libav may have reallocated the buffer, only the original size is pooled
+    Decoder_Pool *pool = decoder->av_io_context->buffer_size == DECODER_AVIO_BUFFER_SIZE ? decoder->pool : NULL;
+    decoder_pool_put(pool, DECODER_POOL_BUFFER, 0, decoder->av_io_context->buffer);
+    decoder->av_io_context->buffer = NULL;
+    avio_context_free(&decoder->av_io_context);
+    decoder->av_io_context = NULL;
+  }
+}
+
+// Interleaved formats only, see decoder_decode_planar
+DECODER_DEF bool decoder_decode(Decoder *decoder, int *out_samples, unsigned char *buffer) {
+  *out_samples = 0;
+  if(decoder_fmt_is_planar(decoder->fmt)) {
+    return false;
+  }
+  return decoder_decode_buffers(decoder, out_samples, &buffer);
+}
+
+// Like decoder_decode for planar formats, planes[c] holds `samples` samples
+// of channel c and is aligned to DECODER_PLANE_ALIGN
+DECODER_DEF bool decoder_decode_planar(Decoder *decoder, int *out_samples, unsigned char **planes) {
+  *out_samples = 0;
+  if(!decoder_fmt_is_planar(decoder->fmt)) {
+    return false;
+  }
+  for(int c=0;c<decoder->channels;c++) {
+    if((uintptr_t) planes[c] % DECODER_PLANE_ALIGN) {
+      return false;
+    }
+  }
+  return decoder_decode_buffers(decoder, out_samples, planes);
+}
+
+DECODER_DEF bool decoder_decode_buffers(Decoder *decoder, int *out_samples, unsigned char **buffers) {
+  *out_samples = 0;
+  if(!decoder->continue_convert) {
+    
+    if(!decoder->continue_receive) {
+      int ret = decoder->draining ? AVERROR_EOF : decoder_read_packet(decoder);
+      if(ret < 0) {
+	if(decoder->index && decoder->index_sequential) {
+	  decoder->index->complete = true;
+	}
+
+	if(ret == AVERROR_EOF && !decoder->draining) {
+	  // Flush the frames the codec still holds
+	  decoder->draining = true;
+	  decoder->continue_receive = true;
+	  if(avcodec_send_packet(decoder->av_codec_context, NULL) < 0) {
+	    return false;
+	  }
+	  return true;
+	}
+
+	if(ret == AVERROR_EOF) {
+	  // Last, whatever swresample still holds
+	  *out_samples = swr_convert(decoder->swr_context, buffers, decoder->samples, NULL, 0);
+	  decoder_discard(decoder, out_samples, buffers);
+	  decoder_gain(decoder, buffers, *out_samples);
+	  if(*out_samples > 0) {
+	    return true;
+	  }
+	}
+
+	decoder->continue_receive = false;
+	decoder->continue_convert = false;
+	return false;
+      }
+      if(decoder->packet->stream_index != decoder->stream_index) {
+	decoder->continue_receive = false;
+	decoder->continue_convert = false;
+
+	av_packet_unref(decoder->packet);
+	return true;
+      }
+
+      decoder_pts_sync(decoder, decoder->packet);
+      if(decoder->index && !decoder->index->complete) {
+	if(!decoder_index_append(decoder, decoder->packet)) {
+	  return false;
+	}
+      }
+    
+      decoder->continue_receive = true;
+
+      if(avcodec_send_packet(decoder->av_codec_context, decoder->packet) < 0) {
+	//fprintf(stderr, "ERROR: fatal error in avcodec_send_packet\n");
+	//exit(1);
+	return false;
+      }
+    }  
+
+    if(avcodec_receive_frame(decoder->av_codec_context, decoder->frame) >= 0) {
+
+      decoder->pts = decoder->frame->pts;
+
+      decoder_seek_resolve(decoder);
+      
+      *out_samples = swr_convert(decoder->swr_context, buffers, decoder->samples,
+				 (const unsigned char **) (decoder->frame->data),
+				 decoder->frame->nb_samples);
+      decoder_discard(decoder, out_samples, buffers);
+      decoder_gain(decoder, buffers, *out_samples);
+      
+      if(*out_samples > 0) {
+	decoder->continue_convert = true;
+      } else {
+	decoder->continue_convert = false;
+
+	av_frame_unref(decoder->frame);
+      }
+    } else {
+      *out_samples = 0;
+      
+      decoder->continue_convert = false;
+      decoder->continue_receive = false;
+
+      av_packet_unref(decoder->packet);
+    }
+
+    return true;
+  }
+      
+  // No input but not NULL, which would flush the resampler mid-stream
+  const unsigned char *none[1] = {NULL};
+  *out_samples = swr_convert(decoder->swr_context, buffers, decoder->samples, none, 0);
+  decoder_discard(decoder, out_samples, buffers);
+  decoder_gain(decoder, buffers, *out_samples);
+
+  if(*out_samples > 0) {
+    decoder->continue_convert = true;
+  } else {
+    decoder->continue_convert = false;    
+    av_packet_unref(decoder->packet);
+  }
+
+  return true;
+
+}
+
+// Moves demuxing to its own thread. Seeking stops and restarts it, the
+// stats carry over.
+DECODER_DEF bool decoder_pipeline_start(Decoder *decoder) {
+  return decoder_pipeline_resume(decoder, NULL);
+}
+
+// decoder_pipeline_start, continuing from `stats` if not NULL. They are
+// set before the demux thread runs, it updates them under p->mutex.
+DECODER_DEF bool decoder_pipeline_resume(Decoder *decoder, const Decoder_Pipeline_Stats *stats) {
+  if(decoder->pipeline) {
+    return true;
+  }
+
+  Decoder_Pipeline *p = calloc(1, sizeof(*p));
+  if(!p) {
+    return false;
+  }
+  p->decoder = decoder;
+  if(stats) p->stats = *stats;
+
+  p->packet = av_packet_alloc();
+  bool ok = p->packet != NULL;
+  for(size_t i=0;ok && i<DECODER_PIPELINE_PACKETS;i++) {
+    p->packets[i] = av_packet_alloc();
+    ok = p->packets[i] != NULL;
+  }
+
+  // Packets held since the last stop come first
+  if(ok) {
+    for(size_t i=0;i<decoder->held_count;i++) {
+      AVPacket **held = &decoder->held[(decoder->held_head + i) % DECODER_PIPELINE_PACKETS];
+      av_packet_move_ref(p->packets[i], *held);
+    }
+    p->count = decoder->held_count;
+  }
+
+  if(ok && !mutex_create(&p->mutex)) {
+    ok = false;
+  } else if(ok && !cond_create(&p->cond)) {
+    mutex_free(&p->mutex);
+    ok = false;
+  } else if(ok && !thread_create(&p->thread, decoder_pipeline_thread, p)) {
+    cond_free(&p->cond);
+    mutex_free(&p->mutex);
+    ok = false;
+  }
+
+  if(!ok) {
+    // Give the held packets back
+    for(size_t i=0;i<p->count;i++) {
+      AVPacket **held = &decoder->held[(decoder->held_head + i) % DECODER_PIPELINE_PACKETS];
+      av_packet_move_ref(*held, p->packets[i]);
+    }
+    for(size_t i=0;i<DECODER_PIPELINE_PACKETS;i++) av_packet_free(&p->packets[i]);
+    av_packet_free(&p->packet);
+    free(p);
+    return false;
+  }
+
+  decoder_pipeline_drop(decoder);
+  decoder->pipeline = p;
+  return true;
+}
+
+DECODER_DEF void decoder_pipeline_stop(Decoder *decoder) {
+  decoder_pipeline_pause(decoder, NULL);
+}
+
+// decoder_pipeline_stop, returning the stats as of the join in `stats` if
+// not NULL, for decoder_pipeline_resume. False if not pipelined
+DECODER_DEF bool decoder_pipeline_pause(Decoder *decoder, Decoder_Pipeline_Stats *stats) {
+  Decoder_Pipeline *p = decoder->pipeline;
+  if(!p) {
+    return false;
+  }
+
+  mutex_lock(&p->mutex);
+  p->quit = true;
+  cond_broadcast(&p->cond);
+  mutex_release(&p->mutex);
+  thread_join(p->thread);
+
+  // Keep what was queued, the demuxer is already past it. Nothing is held
+  // while pipelined, resume hands it all to the queue
+  for(size_t i=0;i<p->count;i++) {
+    size_t k = (p->head + i) % DECODER_PIPELINE_PACKETS;
+    decoder->held[i] = p->packets[k];
+    p->packets[k] = NULL;
+  }
+  decoder->held_head = 0;
+  decoder->held_count = p->count;
+  if(stats) {
+    *stats = p->stats;
+    stats->queued = 0;
+  }
+
+  cond_free(&p->cond);
+  mutex_free(&p->mutex);
+  for(size_t i=0;i<DECODER_PIPELINE_PACKETS;i++) av_packet_free(&p->packets[i]);
+  av_packet_free(&p->packet);
+  free(p);
+  decoder->pipeline = NULL;
+  return true;
+}
+
+DECODER_DEF bool decoder_pipeline_stats(Decoder *decoder, Decoder_Pipeline_Stats *stats) {
+  Decoder_Pipeline *p = decoder->pipeline;
+  if(!p) {
+    return false;
+  }
+
+  mutex_lock(&p->mutex);
+  *stats = p->stats;
+  stats->queued = p->count;
+  mutex_release(&p->mutex);
+  return true;
+}
+
+DECODER_DEF void *decoder_pipeline_thread(void *arg) {
+  Decoder_Pipeline *p = arg;
+  Decoder *decoder = p->decoder;
+
+  mutex_lock(&p->mutex);
+  while(!p->quit) {
+    if(p->count == DECODER_PIPELINE_PACKETS || p->error) {
+      // Full, or done and waiting to be stopped
+      uint64_t start = decoder_now_ns();
+      cond_wait(&p->cond, &p->mutex);
+      if(!p->error) p->stats.demux.wait_ns += decoder_now_ns() - start;
+      continue;
+    }
+    mutex_release(&p->mutex);
+
+    uint64_t start = decoder_now_ns();
+    int ret = av_read_frame(decoder->av_format_context, p->packet);
+    uint64_t ns = decoder_now_ns() - start;
+
+    mutex_lock(&p->mutex);
+    p->stats.read_ns += ns;
+    if(ret < 0) {
+      p->error = ret;
+      cond_broadcast(&p->cond);
+      continue;
+    }
+    if(p->packet->stream_index != decoder->stream_index) {
+      av_packet_unref(p->packet);
+      continue;
+    }
+
+    p->stats.demux.packets++;
+    p->stats.demux.bytes += (uint64_t) p->packet->size;
+    av_packet_move_ref(p->packets[(p->head + p->count) % DECODER_PIPELINE_PACKETS], p->packet);
+    p->count++;
+    cond_broadcast(&p->cond);
+  }
+  mutex_release(&p->mutex);
+
+  return NULL;
+}
+
+// Frees the packets held since decoder_pipeline_stop
+DECODER_DEF void decoder_pipeline_drop(Decoder *decoder) {
+  for(size_t i=0;i<DECODER_PIPELINE_PACKETS;i++) av_packet_free(&decoder->held[i]);
+  decoder->held_head = 0;
+  decoder->held_count = 0;
+}
+
+// av_read_frame into decoder->packet, from the queue when pipelined
+DECODER_DEF int decoder_read_packet(Decoder *decoder) {
+  Decoder_Pipeline *p = decoder->pipeline;
+  if(!p && decoder->held_count > 0) {
+    AVPacket **held = &decoder->held[decoder->held_head];
+    av_packet_move_ref(decoder->packet, *held);
+    av_packet_free(held);
+    decoder->held_head = (decoder->held_head + 1) % DECODER_PIPELINE_PACKETS;
+    decoder->held_count--;
+    return 0;
+  }
+  if(!p) {
+    return av_read_frame(decoder->av_format_context, decoder->packet);
+  }
+
+  mutex_lock(&p->mutex);
+  if(p->count == 0 && !p->error) {
+    uint64_t start = decoder_now_ns();
+    while(p->count == 0 && !p->error) {
+      cond_wait(&p->cond, &p->mutex);
+    }
+    p->stats.decode.wait_ns += decoder_now_ns() - start;
+  }
+
+  if(p->count == 0) {
+    int error = p->error;
+    mutex_release(&p->mutex);
+    return error;
+  }
+
+  av_packet_move_ref(decoder->packet, p->packets[p->head]);
+  p->head = (p->head + 1) % DECODER_PIPELINE_PACKETS;
+  p->count--;
+  p->stats.decode.packets++;
+  p->stats.decode.bytes += (uint64_t) decoder->packet->size;
+  cond_broadcast(&p->cond);
+  mutex_release(&p->mutex);
+
+  return 0;
+}
+
+DECODER_DEF void decoder_set_volume(Decoder *decoder, float volume) {
+  decoder->target_volume = volume;
+}
+
+DECODER_DEF bool decoder_set_channel_gain(Decoder *decoder, int channel, float gain) {
+  if(channel < 0 || channel >= decoder->channels) {
+    return false;
+  }
+  decoder->channel_gains[channel] = gain;
+  return true;
+}
+
+// True if no gain is applied now and none is pending
+DECODER_DEF bool decoder_gain_unity(Decoder *decoder) {
+  for(int c=0;c<decoder->channels;c++) {
+    if(decoder->gains[c] != 1.f ||
+       decoder->target_volume * decoder->channel_gains[c] != 1.f) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#define DECODER_GAIN_LOOP(type, real, convert)			\
+  do {									\
+    type *p = (type *) buffer;						\
+    if(steady) {							\
+      for(int i=0;i<samples;i++) {					\
+	for(int c=0;c<channels;c++) {					\
+	  real x = (real) p[c] * target[c];				\
+	  p[c] = convert;						\
+	}								\
+	p += channels;							\
+      }									\
+    } else {								\
+      for(int i=0;i<samples;i++) {					\
+	for(int c=0;c<channels;c++) {					\
+	  real x = (real) p[c] * (gains[c] + step[c] * (float) (i + 1)); \
+	  p[c] = convert;						\
+	}								\
+	p += channels;							\
+      }									\
+    }									\
+  } while(0)
+
+// Same per channel plane, the inner loops run over contiguous samples
+#define DECODER_GAIN_PLANAR_LOOP(type, real, convert)			\
+  do {									\
+    for(int c=0;c<channels;c++) {					\
+      type *p = (type *) buffers[c];					\
+      if(steady) {							\
+	real g = target[c];						\
+	for(int i=0;i<samples;i++) {					\
+	  real x = (real) p[i] * g;					\
+	  p[i] = convert;						\
+	}								\
+      } else {								\
+	real g = gains[c];						\
+	real s = step[c];						\
+	for(int i=0;i<samples;i++) {					\
+	  real x = (real) p[i] * (g + s * (real) (i + 1));		\
+	  p[i] = convert;						\
+	}								\
+      }									\
+    }									\
+  } while(0)
+
+// Multiplies every channel by volume * channel_gains[c]. A change since the
+// last block is ramped linearly across this block, so there are no steps.
+DECODER_DEF void decoder_gain(Decoder *decoder, unsigned char **buffers, int samples) {
+  if(samples <= 0) {
+    return;
+  }
+
+  unsigned char *buffer = buffers[0];
+  int channels = decoder->channels;
+  float *gains = decoder->gains;
+  float target[DECODER_MAX_CHANNELS];
+  float step[DECODER_MAX_CHANNELS];
+  bool steady = true;
+  bool unity = true;
+  for(int c=0;c<channels;c++) {
+    target[c] = decoder->target_volume * decoder->channel_gains[c];
+    step[c] = (target[c] - gains[c]) / (float) samples;
+    if(target[c] != gains[c]) steady = false;
+    if(target[c] != 1.f) unity = false;
+  }
+  if(steady && unity) {
+    return;
+  }
+
+  switch(decoder->fmt) {
+  case DECODER_FMT_FLT:
+    DECODER_GAIN_LOOP(float, float, x);
+    break;
+  case DECODER_FMT_S16:
+    DECODER_GAIN_LOOP(int16_t, float,
+		      x >= 32767.f ? 32767 : x <= -32768.f ? -32768 : (int16_t) lrintf(x));
+    break;
+  case DECODER_FMT_S32:
+    DECODER_GAIN_LOOP(int32_t, double,
+		      x >= 2147483647.0 ? INT32_MAX : x <= -2147483648.0 ? INT32_MIN : (int32_t) lrint(x));
+    break;
+  case DECODER_FMT_FLTP:
+    DECODER_GAIN_PLANAR_LOOP(float, float, x);
+    break;
+  case DECODER_FMT_S16P:
+    DECODER_GAIN_PLANAR_LOOP(int16_t, float,
+			     x >= 32767.f ? 32767 : x <= -32768.f ? -32768 : (int16_t) lrintf(x));
+    break;
+  default:
+    break;
+  }
+
+  for(int c=0;c<channels;c++) {
+    gains[c] = target[c];
+  }
+  decoder->volume = decoder->target_volume;
+}
+
+DECODER_DEF void decoder_discard(Decoder *decoder, int *out_samples, unsigned char **buffers) {
+  if(decoder->discard <= 0 || *out_samples <= 0) {
+    return;
+  }
+
+  int drop = *out_samples;
+  if((int64_t) drop > decoder->discard) drop = (int) decoder->discard;
+
+  int planes = decoder_fmt_is_planar(decoder->fmt) ? decoder->channels : 1;
+  int stride = decoder->sample_size / planes;
+  for(int p=0;p<planes;p++) {
+    memmove(buffers[p],
+	    buffers[p] + drop * stride,
+	    (*out_samples - drop) * stride);
+  }
+  *out_samples -= drop;
+  decoder->discard -= drop;
+}
+
+// Receives the next frame into decoder->frame, feeding packets as needed.
+// Returns 0, AVERROR_EOF or another negative error.
+DECODER_DEF int decoder_receive(Decoder *decoder) {
+  while(true) {
+    int ret = avcodec_receive_frame(decoder->av_codec_context, decoder->frame);
+    if(ret != AVERROR(EAGAIN)) {
+      return ret;
+    }
+
+    ret = decoder_read_packet(decoder);
+    if(ret < 0) {
+      if(ret != AVERROR_EOF) {
+	return ret;
+      }
+      if(decoder->index && decoder->index_sequential) {
+	decoder->index->complete = true;
+      }
+      if(decoder->draining) {
+	return AVERROR_EOF;
+      }
+      // Flush the frames the codec still holds
+      decoder->draining = true;
+      ret = avcodec_send_packet(decoder->av_codec_context, NULL);
+      if(ret < 0) {
+	return ret;
+      }
+      continue;
+    }
+
+    if(decoder->packet->stream_index != decoder->stream_index) {
+      av_packet_unref(decoder->packet);
+      continue;
+    }
+
+    decoder_pts_sync(decoder, decoder->packet);
+    if(decoder->index && !decoder->index->complete) {
+      if(!decoder_index_append(decoder, decoder->packet)) {
+	av_packet_unref(decoder->packet);
+	return AVERROR(ENOMEM);
+      }
+    }
+
+    ret = avcodec_send_packet(decoder->av_codec_context, decoder->packet);
+    av_packet_unref(decoder->packet);
+    if(ret < 0) {
+      return ret;
+    }
+  }
+}
+
+// Stereo downmix of in_layout as swresample would build it, folded into
+// mid and side rows
+DECODER_DEF bool decoder_mid_side_matrix(SwrContext *swr, const AVChannelLayout *in_layout) {
+  int in_channels = in_layout->nb_channels;
+  double *matrix = av_malloc_array(2 * (size_t) in_channels, sizeof(*matrix));
+  if(!matrix) {
+    return false;
+  }
+
+  AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
+  bool ok = swr_build_matrix2(in_layout, &stereo, M_SQRT1_2, M_SQRT1_2, 0.0, 1.0, 1.0,
+			      matrix, in_channels, AV_MATRIX_ENCODING_NONE, NULL) >= 0;
+  if(ok) {
+    for(int i=0;i<in_channels;i++) {
+      double l = matrix[i];
+      double r = matrix[in_channels + i];
+      matrix[i] = 0.5 * (l + r);
+      matrix[in_channels + i] = 0.5 * (l - r);
+    }
+    ok = swr_set_matrix(swr, matrix, in_channels) >= 0;
+  }
+
+  av_free(matrix);
+  return ok;
+}
+
+// Lends out the next decoded frame. swresample is bypassed when the codec
+// already outputs exactly the requested format at unity volume, with the
+// native mix, layout and rate. Returns false at the end of
+// the stream. frame->samples can be 0 after a seek.
+DECODER_DEF bool decoder_frame_borrow(Decoder *decoder, Decoder_Frame *frame) {
+  frame->samples = 0;
+  frame->planes = 0;
+
+  if(decoder_receive(decoder) < 0) {
+    return false;
+  }
+  decoder->pts = decoder->frame->pts;
+  decoder_seek_resolve(decoder);
+
+  AVFrame *av_frame = decoder->frame;
+  enum AVSampleFormat av_fmt = (enum AVSampleFormat) av_frame->format;
+  enum AVSampleFormat av_out_fmt;
+  if(!decoder_fmt_to_libav_fmt(&av_out_fmt, decoder->fmt)) {
+    return false;
+  }
+
+  bool planar = av_sample_fmt_is_planar(av_fmt);
+  bool passthrough =
+    av_fmt == av_out_fmt &&
+    decoder_gain_unity(decoder) &&
+    decoder->mix == DECODER_MIX_NATIVE &&
+    decoder->channels == decoder->av_codec_context->ch_layout.nb_channels &&
+    decoder->sample_rate == decoder->av_codec_context->sample_rate &&
+    (!planar || decoder->channels <= DECODER_MAX_PLANES);
+
+  int bytes = av_get_bytes_per_sample(av_fmt);
+  int stride = planar ? bytes : bytes * decoder->channels;
+  int skip = av_frame->nb_samples;
+  if((int64_t) skip > decoder->discard) skip = (int) decoder->discard;
+
+  // Lent planes keep the DECODER_PLANE_ALIGN guarantee, libav's frame
+  // buffers or a skip into them need not
+  for(int i=0;passthrough && planar && i<decoder->channels;i++) {
+    if((uintptr_t) (av_frame->extended_data[i] + skip * stride) % DECODER_PLANE_ALIGN) {
+      passthrough = false;
+    }
+  }
+
+  if(passthrough) {
+    decoder->discard -= skip;
+
+    frame->planes = planar ? decoder->channels : 1;
+    for(int i=0;i<frame->planes;i++) {
+      frame->data[i] = av_frame->extended_data[i] + skip * stride;
+    }
+    frame->samples = av_frame->nb_samples - skip;
+    if(!decoder_libav_fmt_to_fmt(&frame->fmt, av_fmt)) {
+      return false;
+    }
+    return true;
+  }
+
+  // Planar output gets a plane per channel in convert_buffer, a multiple of
+  // DECODER_PLANE_ALIGN samples apart
+  int planes = decoder_fmt_is_planar(decoder->fmt) ? decoder->channels : 1;
+  if(planes > DECODER_MAX_PLANES) {
+    return false;
+  }
+  int capacity = swr_get_out_samples(decoder->swr_context, av_frame->nb_samples);
+  capacity = (capacity + DECODER_PLANE_ALIGN - 1) / DECODER_PLANE_ALIGN * DECODER_PLANE_ALIGN;
+  if(capacity > decoder->convert_capacity) {
+    decoder_aligned_free(decoder->convert_buffer);
+    decoder->convert_buffer = decoder_aligned_alloc((size_t) capacity * decoder->sample_size);
+    if(!decoder->convert_buffer) {
+      decoder->convert_capacity = 0;
+      return false;
+    }
+    decoder->convert_capacity = capacity;
+  }
+
+  unsigned char *buffers[DECODER_MAX_PLANES];
+  for(int p=0;p<planes;p++) {
+    buffers[p] = decoder->convert_buffer + (size_t) p * decoder->convert_capacity * (decoder->sample_size / planes);
+  }
+  int out_samples = swr_convert(decoder->swr_context, buffers, decoder->convert_capacity,
+				(const unsigned char **) av_frame->extended_data,
+				av_frame->nb_samples);
+  av_frame_unref(av_frame);
+  if(out_samples < 0) {
+    return false;
+  }
+  decoder_discard(decoder, &out_samples, buffers);
+  decoder_gain(decoder, buffers, out_samples);
+
+  frame->planes = planes;
+  for(int p=0;p<planes;p++) {
+    frame->data[p] = buffers[p];
+  }
+  frame->samples = out_samples;
+  frame->fmt = decoder->fmt;
+  return true;
+}
+
+DECODER_DEF void decoder_frame_release(Decoder *decoder, Decoder_Frame *frame) {
+  av_frame_unref(decoder->frame);
+  frame->samples = 0;
+  frame->planes = 0;
+}
+
+// Called with the first frame after a seek, to know how much to discard
+DECODER_DEF void decoder_seek_resolve(Decoder *decoder) {
+  if(!decoder->seek_pending) {
+    return;
+  }
+
+  AVStream *stream = decoder->av_format_context->streams[decoder->stream_index];
+  int64_t ts = decoder->frame->pts != AV_NOPTS_VALUE
+    ? decoder->frame->pts + decoder->pts_offset
+    : decoder->seek_ts;
+  if(stream->start_time != AV_NOPTS_VALUE) ts -= stream->start_time;
+  int64_t frame_pos = av_rescale_q(ts, stream->time_base, (AVRational) {1, decoder->sample_rate});
+
+  // Estimate-based byte seeks (raw mp3, adts) can land too late
+  decoder->discard = decoder->seek_target - frame_pos;
+  if(decoder->discard < 0) {
+    decoder->seek_late = -decoder->discard;
+    decoder->discard = 0;
+  }
+  decoder->seek_pending = false;
+}
+
+DECODER_DEF void decoder_pts_sync(Decoder *decoder, const AVPacket *packet) {
+  if(!decoder->pts_sync) {
+    return;
+  }
+
+  int64_t ts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+  decoder->pts_offset = ts != AV_NOPTS_VALUE ? decoder->seek_ts - ts : 0;
+  decoder->pts_sync = false;
+}
+
+// Seeks to the keyframe before sample_pos, the following decoder_decode
+// calls discard everything up to sample_pos.
+DECODER_DEF bool decoder_seek(Decoder *decoder, int64_t sample_pos) {
+  return decoder_seek_preroll(decoder, sample_pos, 0);
+}
+
+// Like decoder_seek, but decodes at least `preroll` samples before
+// sample_pos and discards them, so that the codec state has converged
+DECODER_DEF bool decoder_seek_preroll(Decoder *decoder, int64_t sample_pos, int64_t preroll) {
+  if(sample_pos < 0 || !(decoder->av_io_context->seekable & AVIO_SEEKABLE_NORMAL)) {
+    return false;
+  }
+
+  AVStream *stream = decoder->av_format_context->streams[decoder->stream_index];
+  int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+  int64_t ts = start + av_rescale_q(sample_pos, (AVRational) {1, decoder->sample_rate}, stream->time_base);
+
+  // Start one frame early, so that the overlap of transform codecs is
+  // primed when reaching sample_pos. mp3 also needs the bit reservoir
+  int64_t frames = decoder->av_codec_context->codec_id == AV_CODEC_ID_MP3 ? DECODER_SEEK_MP3_FRAMES : 1;
+  if(decoder->av_codec_context->frame_size * frames > preroll) preroll = decoder->av_codec_context->frame_size * frames;
+  if(stream->codecpar->seek_preroll > preroll) preroll = stream->codecpar->seek_preroll;
+  // May go before start: the encoder delay (e.g. aac in mp4) is stored
+  // as packets before it
+  int64_t key_ts = ts - av_rescale_q(preroll, (AVRational) {1, decoder->sample_rate}, stream->time_base);
+
+  // The demux thread must not read while the format context seeks
+  Decoder_Pipeline_Stats pipeline_stats;
+  bool pipelined = decoder_pipeline_pause(decoder, &pipeline_stats);
+
+  const Decoder_Index_Entry *entry = NULL;
+  Decoder_Index *index = decoder->index;
+  if(index && index->len > 0 &&
+     index->stream_index == decoder->stream_index &&
+     av_cmp_q(index->time_base, stream->time_base) == 0 &&
+     (index->complete || key_ts <= index->items[index->len - 1].ts) &&
+     !(decoder->av_format_context->iformat->flags & AVFMT_NO_BYTE_SEEK)) {
+    entry = decoder_index_find(index, key_ts);
+  }
+
+  int ret;
+  if(entry) {
+    ret = av_seek_frame(decoder->av_format_context, decoder->stream_index, entry->pos, AVSEEK_FLAG_BYTE);
+    decoder->seek_ts = entry->ts;
+    decoder->pts_sync = true;
+    decoder->pts_offset = 0;
+  } else {
+    ret = av_seek_frame(decoder->av_format_context, decoder->stream_index, key_ts, AVSEEK_FLAG_BACKWARD);
+    // Demuxers fail with nothing before key_ts, or bisecting near the end
+    // (flac). Retry further back, up to start, the discard covers the rest
+    int64_t back = av_rescale_q(1, (AVRational) {1, 1}, stream->time_base);
+    while(ret < 0 && key_ts != start) {
+      key_ts = key_ts - back > start ? key_ts - back : start;
+      back *= 2;
+      ret = av_seek_frame(decoder->av_format_context, decoder->stream_index, key_ts, AVSEEK_FLAG_BACKWARD);
+    }
+    decoder->seek_ts = key_ts;
+    decoder->pts_sync = false;
+    decoder->pts_offset = 0;
+  }
+  if(ret < 0) {
+    // Keep demuxing from wherever the failed seek left it
+    if(pipelined) decoder_pipeline_resume(decoder, &pipeline_stats);
+    return false;
+  }
+  decoder_pipeline_drop(decoder);
+
+  if(index && !index->complete) {
+    decoder->index_sequential = false;
+  }
+
+  av_packet_unref(decoder->packet);
+  av_frame_unref(decoder->frame);
+  avcodec_flush_buffers(decoder->av_codec_context);
+  // Drop whatever swresample still buffers
+  if(swr_init(decoder->swr_context) < 0) {
+    return false;
+  }
+
+  decoder->continue_receive = false;
+  decoder->continue_convert = false;
+  decoder->draining = false;
+  decoder->seek_pending = true;
+  decoder->seek_target = sample_pos;
+  decoder->discard = 0;
+  decoder->seek_late = 0;
+
+  if(pipelined && !decoder_pipeline_resume(decoder, &pipeline_stats)) {
+    return false;
+  }
+
+  return true;
+}
+
+DECODER_DEF bool decoder_index_append(Decoder *decoder, const AVPacket *packet) {
+  Decoder_Index *index = decoder->index;
+
+  if(packet->pos < 0 || packet->pts == AV_NOPTS_VALUE || !(packet->flags & AV_PKT_FLAG_KEY)) {
+    return true;
+  }
+  int64_t pts = packet->pts + decoder->pts_offset;
+  if(index->len > 0 &&
+     pts < index->items[index->len - 1].ts + decoder->index_interval) {
+    return true;
+  }
+
+  if(index->len == 0) {
+    AVStream *stream = decoder->av_format_context->streams[decoder->stream_index];
+    index->stream_index = decoder->stream_index;
+    index->time_base = stream->time_base;
+  }
+
+  if(index->len >= index->cap) {
+    size_t cap = index->cap ? index->cap * 2 : 1024;
+    Decoder_Index_Entry *items = realloc(index->items, cap * sizeof(*items));
+    if(!items) {
+      return false;
+    }
+    index->items = items;
+    index->cap = cap;
+  }
+
+  index->items[index->len++] = (Decoder_Index_Entry) {
+    .pos = packet->pos,
+    .ts = pts,
+  };
+
+  return true;
+}
+
+// Last entry with entry.ts <= ts, or the first entry
+DECODER_DEF const Decoder_Index_Entry *decoder_index_find(const Decoder_Index *index, int64_t ts) {
+  size_t lo = 0;
+  size_t hi = index->len;
+  while(hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if(index->items[mid].ts <= ts) lo = mid;
+    else hi = mid;
+  }
+
+  return &index->items[lo];
+}
+
+// Sidecar layout (native endianness):
+//   u32 magic, i32 stream_index, i32 time_base.num, i32 time_base.den,
+//   u64 key, u64 len, len * { i64 pos, i64 ts }
+// Only complete indices are saved. key identifies the indexed source, e.g.
+// decoder_probe_identity of the media file, and must not be 0.
+DECODER_DEF bool decoder_index_save(const Decoder_Index *index, const char *filepath, uint64_t key) {
+  if(!index->complete || key == 0) {
+    return false;
+  }
+
+  FILE *f = fopen(filepath, "wb");
+  if(!f) {
+    return false;
+  }
+
+  uint32_t magic = DECODER_INDEX_MAGIC;
+  int32_t header[3] = { index->stream_index, index->time_base.num, index->time_base.den };
+  uint64_t len = (uint64_t) index->len;
+
+  bool ok =
+    fwrite(&magic, sizeof(magic), 1, f) == 1 &&
+    fwrite(header, sizeof(header), 1, f) == 1 &&
+    fwrite(&key, sizeof(key), 1, f) == 1 &&
+    fwrite(&len, sizeof(len), 1, f) == 1 &&
+    fwrite(index->items, sizeof(*index->items), index->len, f) == index->len;
+
+  if(fclose(f) != 0) ok = false;
+  return ok;
+}
+
+// Fails if the sidecar was written for another key, e.g. an older
+// version of the file
+DECODER_DEF bool decoder_index_load(Decoder_Index *index, const char *filepath, uint64_t key) {
+  memset(index, 0, sizeof(*index));
+  if(key == 0) {
+    return false;
+  }
+
+  FILE *f = fopen(filepath, "rb");
+  if(!f) {
+    return false;
+  }
+
+  uint32_t magic;
+  int32_t header[3];
+  uint64_t file_key;
+  uint64_t len;
+  if(fread(&magic, sizeof(magic), 1, f) != 1 || magic != DECODER_INDEX_MAGIC ||
+     fread(header, sizeof(header), 1, f) != 1 || header[2] == 0 ||
+     fread(&file_key, sizeof(file_key), 1, f) != 1 || file_key != key ||
+     fread(&len, sizeof(len), 1, f) != 1 || len == 0 || len > DECODER_INDEX_MAX_ENTRIES) {
+    fclose(f);
+    return false;
+  }
+
+  index->items = malloc(len * sizeof(*index->items));
+  if(!index->items) {
+    fclose(f);
+    return false;
+  }
+  if(fread(index->items, sizeof(*index->items), len, f) != len) {
+    fclose(f);
+    decoder_index_free(index);
+    return false;
+  }
+  fclose(f);
+
+  index->len = (size_t) len;
+  index->cap = (size_t) len;
+  index->stream_index = header[0];
+  index->time_base = (AVRational) { header[1], header[2] };
+  index->complete = true;
+
+  return true;
+}
+
+DECODER_DEF void decoder_index_free(Decoder_Index *index) {
+  if(index->items) free(index->items);
+  memset(index, 0, sizeof(*index));
+}
+
+DECODER_DEF bool decoder_fmt_to_libav_fmt(enum AVSampleFormat *av_fmt, Decoder_Fmt fmt) {
+  switch(fmt) {
+  case DECODER_FMT_S16: {
+    *av_fmt = AV_SAMPLE_FMT_S16;
+    return true;
+  } break;
+  case DECODER_FMT_S32: {
+    *av_fmt = AV_SAMPLE_FMT_S32;
+    return true;
+  } break;
+  case DECODER_FMT_FLT: {
+    *av_fmt = AV_SAMPLE_FMT_FLT;
+    return true;
+  } break;
+  case DECODER_FMT_S16P: {
+    *av_fmt = AV_SAMPLE_FMT_S16P;
+    return true;
+  } break;
+  case DECODER_FMT_FLTP: {
+    *av_fmt = AV_SAMPLE_FMT_FLTP;
+    return true;
+  } break;
+  default: {
     return false;
+  } 
   }
+}
 
-  *sample_rate = (int) decoder->av_codec_context->sample_rate;
+DECODER_DEF bool decoder_libav_fmt_to_fmt(Decoder_Fmt *fmt, enum AVSampleFormat av_fmt) {
+  switch(av_fmt) {
+  case AV_SAMPLE_FMT_U8:   *fmt = DECODER_FMT_U8;   return true;
+  case AV_SAMPLE_FMT_S16:  *fmt = DECODER_FMT_S16;  return true;
+  case AV_SAMPLE_FMT_S32:  *fmt = DECODER_FMT_S32;  return true;
+  case AV_SAMPLE_FMT_FLT:  *fmt = DECODER_FMT_FLT;  return true;
+  case AV_SAMPLE_FMT_DBL:  *fmt = DECODER_FMT_DBL;  return true;
+  case AV_SAMPLE_FMT_U8P:  *fmt = DECODER_FMT_U8P;  return true;
+  case AV_SAMPLE_FMT_S16P: *fmt = DECODER_FMT_S16P; return true;
+  case AV_SAMPLE_FMT_S32P: *fmt = DECODER_FMT_S32P; return true;
+  case AV_SAMPLE_FMT_FLTP: *fmt = DECODER_FMT_FLTP; return true;
+  case AV_SAMPLE_FMT_DBLP: *fmt = DECODER_FMT_DBLP; return true;
+  default: {
+    return false;
+  }
+  }
+}
 
-  if(avcodec_open2(decoder->av_codec_context, av_codec, NULL) < 0) {
-    decoder_free(decoder);
+DECODER_DEF bool decoder_fmt_to_bits_per_sample(int *bits, Decoder_Fmt fmt) {
+  switch(fmt) {
+  case DECODER_FMT_S16: {
+    *bits = 16;
+    return true;
+  } break;
+  case DECODER_FMT_S32: {
+    *bits = 32;
+    return true;
+  } break;
+  case DECODER_FMT_FLT: {
+    *bits = 32;
+    return true;
+  } break;
+  case DECODER_FMT_S16P: {
+    *bits = 16;
+    return true;
+  } break;
+  case DECODER_FMT_FLTP: {
+    *bits = 32;
+    return true;
+  } break;
+  default: {
     return false;
+  } 
+  }  
+}
+
+DECODER_DEF bool decoder_fmt_is_planar(Decoder_Fmt fmt) {
+  return fmt >= DECODER_FMT_U8P && fmt <= DECODER_FMT_DBLP;
+}
+
+// One block holding `channels` planes of `samples` samples, every plane on
+// a DECODER_PLANE_ALIGN boundary. Free the returned block with
+// decoder_planes_free.
+DECODER_DEF unsigned char *decoder_planes_alloc(unsigned char **planes, int channels, int samples, Decoder_Fmt fmt) {
+  int bits;
+  if(channels <= 0 || samples <= 0 || !decoder_fmt_to_bits_per_sample(&bits, fmt)) {
+    return NULL;
   }
-  
-  decoder->swr_context = swr_alloc();
-  if(!decoder->swr_context) {
-    decoder_free(decoder);
+
+  size_t stride = (size_t) samples * (size_t) (bits / 8);
+  stride = (stride + DECODER_PLANE_ALIGN - 1) / DECODER_PLANE_ALIGN * DECODER_PLANE_ALIGN;
+
+  unsigned char *block = decoder_aligned_alloc(stride * channels);
+  if(!block) {
+    return NULL;
+  }
+
+  for(int c=0;c<channels;c++) {
+    planes[c] = block + (size_t) c * stride;
+  }
+  return block;
+}
+
+DECODER_DEF void decoder_planes_free(unsigned char *block) {
+  decoder_aligned_free(block);
+}
+
+// av_malloc only aligns to 16 or 32 bytes unless libav has AVX-512
+DECODER_DEF unsigned char *decoder_aligned_alloc(size_t size) {
+#ifdef _WIN32
+  return _aligned_malloc(size, DECODER_PLANE_ALIGN);
+#else
+  void *mem;
+  return posix_memalign(&mem, DECODER_PLANE_ALIGN, size) == 0 ? mem : NULL;
+#endif //_WIN32
+}
+
+DECODER_DEF void decoder_aligned_free(unsigned char *block) {
+#ifdef _WIN32
+  _aligned_free(block);
+#else
+  free(block);
+#endif //_WIN32
+}
+
+DECODER_DEF int decoder_memory_read(void *opaque, uint8_t *buf, int _buf_size) {
+  Decoder_Memory *memory = (Decoder_Memory *) opaque;
+
+  size_t buf_size = (size_t) _buf_size;
+
+  if (buf_size > memory->size - memory->pos) {
+    buf_size = memory->size - memory->pos;
+  }
+
+  if (buf_size <= 0) {
+    return AVERROR_EOF;
+  }
+
+  memcpy(buf, memory->data + memory->pos, buf_size);
+  memory->pos += buf_size;
+
+  return (int )buf_size;
+}
+
+DECODER_DEF int64_t decoder_memory_seek(void *opaque, int64_t offset, int whence) {
+
+  Decoder_Memory *memory = (Decoder_Memory *) opaque;
+
+  switch (whence) {
+  case SEEK_SET:
+    memory->pos = offset;
+    break;
+  case SEEK_CUR:
+    memory->pos += offset;
+    break;
+  case SEEK_END:
+    memory->pos = memory->size + offset;
+    break;
+  case AVSEEK_SIZE:
+    return (int64_t) memory->size;
+  default:
+    return AVERROR_INVALIDDATA;
+  }
+
+  if (memory->pos > memory->size) {
+    return AVERROR(EIO);
+  }
+    
+  return memory->pos;
+}
+
+DECODER_DEF uint64_t decoder_now_ns(void) {
+#ifdef _WIN32
+  LARGE_INTEGER freq, counter;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&counter);
+  return (uint64_t) ((double) counter.QuadPart * 1e9 / (double) freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+#endif //_WIN32
+}
+
+DECODER_DEF bool decoder_prefetch_open(Decoder_Prefetch *p, const char *filepath) {
+  memset(p, 0, sizeof(*p));
+
+#ifdef _WIN32
+  p->file = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if(p->file == INVALID_HANDLE_VALUE) {
     return false;
   }
-  
-  char chLayoutDescription[128];
+  LARGE_INTEGER size;
+  if(!GetFileSizeEx(p->file, &size)) {
+    CloseHandle(p->file);
+    return false;
+  }
+  p->size = (int64_t) size.QuadPart;
+#else
+  p->fd = open(filepath, O_RDONLY);
+  if(p->fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if(fstat(p->fd, &st) < 0) {
+    close(p->fd);
+    return false;
+  }
+  p->size = S_ISREG(st.st_mode) ? (int64_t) st.st_size : -1;
+#  ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(p->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#  endif //POSIX_FADV_SEQUENTIAL
+#endif //_WIN32
+
+  if(!decoder_prefetch_start(p)) {
+#ifdef _WIN32
+    CloseHandle(p->file);
+#else
+    close(p->fd);
+#endif //_WIN32
+    return false;
+  }
+  return true;
+}
 
-  // I have received different compile errors/warnings, due to 
-  // different libav-versions. Use one of the following implementations:
+DECODER_DEF bool decoder_prefetch_wrap(Decoder_Prefetch *p, Decoder_Read read, Decoder_Seek seek, void *opaque) {
+  memset(p, 0, sizeof(*p));
+#ifdef _WIN32
+  p->file = INVALID_HANDLE_VALUE;
+#else
+  p->fd = -1;
+#endif //_WIN32
+  p->read = read;
+  p->seek = seek;
+  p->opaque = opaque;
+  p->size = seek ? seek(opaque, 0, AVSEEK_SIZE) : -1;
+  if(p->size < 0) p->size = -1;
 
-  // BEGIN FIRST
-  int sts = av_channel_layout_describe(&av_codec_parameters->ch_layout, chLayoutDescription, sizeof(chLayoutDescription));
-  if(sts < 0) {
+  return decoder_prefetch_start(p);
+}
+
+DECODER_DEF bool decoder_prefetch_start(Decoder_Prefetch *p) {
+  for(size_t i=0;i<DECODER_PREFETCH_CHUNKS;i++) {
+    p->chunks[i].data = malloc(DECODER_PREFETCH_CHUNK);
+    if(!p->chunks[i].data) {
+      for(size_t j=0;j<i;j++) free(p->chunks[j].data);
+      return false;
+    }
+  }
+
+  if(!mutex_create(&p->mutex)) {
+    for(size_t i=0;i<DECODER_PREFETCH_CHUNKS;i++) free(p->chunks[i].data);
+    return false;
+  }
+  if(!cond_create(&p->cond)) {
+    mutex_free(&p->mutex);
+    for(size_t i=0;i<DECODER_PREFETCH_CHUNKS;i++) free(p->chunks[i].data);
+    return false;
+  }
+  if(!thread_create(&p->thread, decoder_prefetch_thread, p)) {
+    cond_free(&p->cond);
+    mutex_free(&p->mutex);
+    for(size_t i=0;i<DECODER_PREFETCH_CHUNKS;i++) free(p->chunks[i].data);
+    return false;
+  }
+
+  return true;
+}
+
+DECODER_DEF void decoder_prefetch_close(Decoder_Prefetch *p) {
+  mutex_lock(&p->mutex);
+  p->quit = true;
+  cond_broadcast(&p->cond);
+  mutex_release(&p->mutex);
+  thread_join(p->thread);
+
+  cond_free(&p->cond);
+  mutex_free(&p->mutex);
+  for(size_t i=0;i<DECODER_PREFETCH_CHUNKS;i++) free(p->chunks[i].data);
+
+#ifdef _WIN32
+  if(p->file != INVALID_HANDLE_VALUE) CloseHandle(p->file);
+#else
+  if(p->fd >= 0) close(p->fd);
+#endif //_WIN32
+}
+
+// Fills buf from offset, only called on the I/O thread. Returns the bytes
+// read, 0 at the end, or a negative AVERROR.
+DECODER_DEF int decoder_prefetch_fetch(Decoder_Prefetch *p, int64_t offset, unsigned char *buf, int size) {
+  int filled = 0;
+
+  if(!p->read) {
+    while(filled < size) {
+#ifdef _WIN32
+      OVERLAPPED overlapped = {0};
+      int64_t at = offset + filled;
+      overlapped.Offset = (DWORD) (at & 0xffffffff);
+      overlapped.OffsetHigh = (DWORD) (at >> 32);
+      DWORD n = 0;
+      if(!ReadFile(p->file, buf + filled, (DWORD) (size - filled), &n, &overlapped)) {
+	if(GetLastError() == ERROR_HANDLE_EOF) break;
+	return AVERROR(EIO);
+      }
+#else
+      ssize_t n = pread(p->fd, buf + filled, (size_t) (size - filled), (off_t) (offset + filled));
+      if(n < 0) {
+	if(errno == EINTR) continue;
+	return AVERROR(errno);
+      }
+#endif //_WIN32
+      if(n == 0) break;
+      filled += (int) n;
+    }
+    return filled;
+  }
+
+  if(p->opaque_pos != offset) {
+    if(!p->seek || p->seek(p->opaque, offset, SEEK_SET) < 0) {
+      return AVERROR(EIO);
+    }
+    p->opaque_pos = offset;
+  }
+  while(filled < size) {
+    int n = p->read(p->opaque, buf + filled, size - filled);
+    if(n == AVERROR_EOF || n == 0) break;
+    if(n < 0) return n;
+    filled += n;
+    p->opaque_pos += n;
+  }
+  return filled;
+}
+
+DECODER_DEF void *decoder_prefetch_thread(void *arg) {
+  Decoder_Prefetch *p = arg;
+
+  mutex_lock(&p->mutex);
+  while(!p->quit) {
+    if(p->count == DECODER_PREFETCH_CHUNKS || p->eof || p->error) {
+      cond_wait(&p->cond, &p->mutex);
+      continue;
+    }
+
+    // The slot after the last filled chunk is never read by the consumer
+    size_t slot = (p->head + p->count) % DECODER_PREFETCH_CHUNKS;
+    uint64_t generation = p->generation;
+    int64_t offset = p->fetch_pos;
+    mutex_release(&p->mutex);
+
+    int n = decoder_prefetch_fetch(p, offset, p->chunks[slot].data, DECODER_PREFETCH_CHUNK);
+
+    mutex_lock(&p->mutex);
+    if(generation != p->generation) {
+      continue;
+    }
+    if(n < 0) {
+      p->error = n;
+    } else if(n == 0) {
+      p->eof = true;
+    } else {
+      p->chunks[slot].offset = offset;
+      p->chunks[slot].size = n;
+      p->count++;
+      p->fetch_pos += n;
+      p->bytes_fetched += (uint64_t) n;
+      if(n < DECODER_PREFETCH_CHUNK) p->eof = true;
+    }
+    cond_broadcast(&p->cond);
+  }
+  mutex_release(&p->mutex);
+
+  return NULL;
+}
+
+DECODER_DEF int decoder_prefetch_read(void *opaque, uint8_t *buf, int buf_size) {
+  Decoder_Prefetch *p = (Decoder_Prefetch *) opaque;
+
+  mutex_lock(&p->mutex);
+  if(p->count == 0 && !p->eof && !p->error) {
+    uint64_t start = decoder_now_ns();
+    while(p->count == 0 && !p->eof && !p->error) {
+      cond_wait(&p->cond, &p->mutex);
+    }
+    p->stalls++;
+    p->stall_ns += decoder_now_ns() - start;
+  }
+  if(p->count == 0) {
+    int ret = p->error ? p->error : AVERROR_EOF;
+    mutex_release(&p->mutex);
+    return ret;
+  }
+  Decoder_Prefetch_Chunk *chunk = &p->chunks[p->head];
+  mutex_release(&p->mutex);
+
+  // Only this thread moves head, the I/O thread never touches it
+  int64_t within = p->pos - chunk->offset;
+  int n = chunk->size - (int) within;
+  if(n > buf_size) n = buf_size;
+  memcpy(buf, chunk->data + within, (size_t) n);
+  p->pos += n;
+
+  if(p->pos == chunk->offset + chunk->size) {
+    mutex_lock(&p->mutex);
+    p->head = (p->head + 1) % DECODER_PREFETCH_CHUNKS;
+    p->count--;
+    cond_broadcast(&p->cond);
+    mutex_release(&p->mutex);
+  }
+
+  return n;
+}
+
+DECODER_DEF int64_t decoder_prefetch_seek(void *opaque, int64_t offset, int whence) {
+  Decoder_Prefetch *p = (Decoder_Prefetch *) opaque;
+
+  int64_t target;
+  switch(whence) {
+  case SEEK_SET: target = offset; break;
+  case SEEK_CUR: target = p->pos + offset; break;
+  case SEEK_END: {
+    if(p->size < 0) return AVERROR(ENOSYS);
+    target = p->size + offset;
+  } break;
+  case AVSEEK_SIZE: {
+    return p->size < 0 ? AVERROR(ENOSYS) : p->size;
+  } break;
+  default: {
+    return AVERROR_INVALIDDATA;
+  }
+  }
+  if(target < 0 || (p->size >= 0 && target > p->size)) {
+    return AVERROR(EIO);
+  }
+
+  mutex_lock(&p->mutex);
+
+  // Forward inside the buffered range: drop the chunks before it
+  if(p->count > 0 && target >= p->pos && target < p->fetch_pos) {
+    while(target >= p->chunks[p->head].offset + p->chunks[p->head].size) {
+      p->head = (p->head + 1) % DECODER_PREFETCH_CHUNKS;
+      p->count--;
+    }
+  } else {
+    // Cancel: whatever the I/O thread is fetching gets dropped
+    p->generation++;
+    p->head = 0;
+    p->count = 0;
+    p->fetch_pos = target;
+    p->eof = false;
+    p->error = 0;
+  }
+  p->pos = target;
+  cond_broadcast(&p->cond);
+  mutex_release(&p->mutex);
+
+  return target;
+}
+
+DECODER_DEF bool decoder_mmap_open(Decoder_Mmap *m, const char *filepath) {
+  memset(m, 0, sizeof(*m));
+
+#ifdef _WIN32
+  m->file = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if(m->file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if(!GetFileSizeEx(m->file, &size)) {
+    CloseHandle(m->file);
+    return false;
+  }
+  m->memory.size = (uint64_t) size.QuadPart;
+
+  if(m->memory.size > 0) {
+    m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(!m->mapping) {
+      CloseHandle(m->file);
+      return false;
+    }
+    m->memory.data = MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0);
+    if(!m->memory.data) {
+      CloseHandle(m->mapping);
+      CloseHandle(m->file);
+      return false;
+    }
+  }
+#else
+  // Opening a FIFO would block and then swallow the writer
+  struct stat st;
+  if(stat(filepath, &st) < 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+
+  m->fd = open(filepath, O_RDONLY);
+  if(m->fd < 0) {
+    return false;
+  }
+
+  if(fstat(m->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(m->fd);
+    return false;
+  }
+  m->memory.size = (uint64_t) st.st_size;
+
+  if(m->memory.size > 0) {
+    void *data = mmap(NULL, (size_t) m->memory.size, PROT_READ, MAP_PRIVATE, m->fd, 0);
+    if(data == MAP_FAILED) {
+      close(m->fd);
+      return false;
+    }
+    madvise(data, (size_t) m->memory.size, MADV_SEQUENTIAL);
+    m->memory.data = data;
+  }
+#endif //_WIN32
+
+  return true;
+}
+
+DECODER_DEF void decoder_mmap_close(Decoder_Mmap *m) {
+#ifdef _WIN32
+  if(m->memory.data) UnmapViewOfFile(m->memory.data);
+  if(m->mapping) CloseHandle(m->mapping);
+  CloseHandle(m->file);
+#else
+  if(m->memory.data) munmap((void *) m->memory.data, (size_t) m->memory.size);
+  close(m->fd);
+#endif //_WIN32
+
+  memset(m, 0, sizeof(*m));
+}
+
+DECODER_DEF int decoder_mmap_read(void *opaque, uint8_t *buf, int buf_size) {
+  Decoder_Mmap *m = (Decoder_Mmap *) opaque;
+
+#ifndef _WIN32
+  // Ask for the next window before the copy faults on it
+  uint64_t pos = m->memory.pos;
+  if(pos + (uint64_t) buf_size > m->advised && pos < m->memory.size) {
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t start = pos - pos % (uint64_t) page;
+    uint64_t len = DECODER_MMAP_WINDOW;
+    if(start + len > m->memory.size) len = m->memory.size - start;
+    madvise((void *) (m->memory.data + start), (size_t) len, MADV_WILLNEED);
+    m->advised = start + len;
+  }
+#endif //_WIN32
+
+  return decoder_memory_read(&m->memory, buf, buf_size);
+}
+
+DECODER_DEF int64_t decoder_mmap_seek(void *opaque, int64_t offset, int whence) {
+  Decoder_Mmap *m = (Decoder_Mmap *) opaque;
+  return decoder_memory_seek(&m->memory, offset, whence);
+}
+
+#ifdef _WIN32
+#  define DECODER_INVALID_SOCKET INVALID_SOCKET
+#  define decoder_closesocket closesocket
+#  define decoder_strncasecmp _strnicmp
+#else
+#  define DECODER_INVALID_SOCKET (-1)
+#  define decoder_closesocket close
+#  define decoder_strncasecmp strncasecmp
+#endif //_WIN32
+
+DECODER_DEF bool decoder_url_open(Decoder_Url *u, const char *url) {
+  memset(u, 0, sizeof(*u));
+  u->fd = DECODER_INVALID_SOCKET;
+  u->size = -1;
+
+  if(strncmp(url, "http://", 7) != 0) {
+    return false;
+  }
+
+  // host[:port] or [v6]:port, then the path
+  const char *host = url + 7;
+  const char *host_end;
+  const char *rest;
+  if(*host == '[') {
+    host++;
+    host_end = strchr(host, ']');
+    if(!host_end) {
+      return false;
+    }
+    rest = host_end + 1;
+  } else {
+    host_end = host + strcspn(host, ":/?");
+    rest = host_end;
+  }
+
+  size_t host_len = (size_t) (host_end - host);
+  if(!host_len || host_len >= sizeof(u->host)) {
     return false;
   }
+  memcpy(u->host, host, host_len);
+
+  strcpy(u->port, "80");
+  if(*rest == ':') {
+    size_t port_len = strcspn(rest + 1, "/?");
+    if(!port_len || port_len >= sizeof(u->port)) {
+      return false;
+    }
+    memcpy(u->port, rest + 1, port_len);
+    u->port[port_len] = 0;
+    rest += 1 + port_len;
+  }
 
-  if(strcmp(chLayoutDescription, "stereo") == 0) {
-    *channels = 2;
-  } else if(strcmp(chLayoutDescription, "mono") == 0) {
-    *channels = 1;    
-  } else if(strcmp(chLayoutDescription, "2 channels") == 0) {
-    memcpy(chLayoutDescription, "stereo", 7);
-    *channels = 2;
-  } else if(strcmp(chLayoutDescription, "1 channel")) {
-  memcpy(chLayoutDescription, "mono", 5);
-    *channels = 1;
+  if(*rest != '/') {
+    u->path[0] = '/';
+    if(strlen(rest) + 1 >= sizeof(u->path)) {
+      return false;
+    }
+    strcpy(u->path + 1, rest);
   } else {
-    return false;
+    if(strlen(rest) >= sizeof(u->path)) {
+      return false;
+    }
+    strcpy(u->path, rest);
   }
-  // END FIRST
 
-  /*
-  // BEGIN SECOND
-  uint64_t ch_layout = av_codec_parameters->channel_layout;
-  if(ch_layout & AV_CH_LAYOUT_MONO) {
-    memcpy(chLayoutDescription, "mono", 5);
-    *channels = 2;
-  } else if (ch_layout & AV_CH_LAYOUT_STEREO) {
-    memcpy(chLayoutDescription, "stereo", 7);
-    *channels = 2;
-  } else {
+#ifdef _WIN32
+  WSADATA wsa;
+  if(WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
     return false;
   }
-  // END SECOND
-  */
+#endif //_WIN32
 
-  av_opt_set(decoder->swr_context, "in_channel_layout", chLayoutDescription, 0);
-  av_opt_set(decoder->swr_context, "out_channel_layout", chLayoutDescription, 0);
-  av_opt_set_int(decoder->swr_context, "in_sample_fmt", decoder->av_codec_context->sample_fmt, 0);
-  av_opt_set_int(decoder->swr_context, "in_sample_rate", decoder->av_codec_context->sample_rate, 0);
-  av_opt_set_int(decoder->swr_context, "out_sample_fmt", av_sample_format, 0);
-  av_opt_set_int(decoder->swr_context, "out_sample_rate", decoder->av_codec_context->sample_rate, 0);
-  av_opt_set_double(decoder->swr_context, "rmvol", volume, 0);
+  u->window = malloc(DECODER_URL_WINDOW_MAX);
+  u->readahead = DECODER_URL_WINDOW_MIN;
   
-  decoder->target_volume = volume;
-  decoder->volume = volume;
-    
-  if(swr_init(decoder->swr_context) < 0) {
-    decoder_free(decoder);
+  // The first window tells the size and whether Range is honored
+  if(!u->window || decoder_url_fill(u) < 0) {
+    decoder_url_close(u);
     return false;
   }
-  //swr_set_quality(decoder->swr_context, 7);
-  //swr_set_resample_mode(decoder->swr_context, SWR_FILTER_TYPE_CUBIC);
 
-  int bits_per_sample;
-  if(!decoder_fmt_to_bits_per_sample(&bits_per_sample, fmt)) {
+  return true;
+}
+
+DECODER_DEF void decoder_url_close(Decoder_Url *u) {
+  decoder_url_disconnect(u);
+  free(u->window);
+#ifdef _WIN32
+  WSACleanup();
+#endif //_WIN32
+  memset(u, 0, sizeof(*u));
+  u->fd = DECODER_INVALID_SOCKET;
+}
+
+DECODER_DEF bool decoder_url_connect(Decoder_Url *u) {
+  decoder_url_disconnect(u);
+
+  struct addrinfo hints = {0}, *addrs;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if(getaddrinfo(u->host, u->port, &hints, &addrs) != 0) {
     return false;
   }
-  decoder->sample_size = *channels * bits_per_sample / 8;
-    
-  decoder->packet = av_packet_alloc();
-  if(!decoder->packet) {
-    decoder_free(decoder);
-    return false;
+
+  for(struct addrinfo *a=addrs;a;a=a->ai_next) {
+    u->fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if(u->fd == DECODER_INVALID_SOCKET) {
+      continue;
+    }
+    if(connect(u->fd, a->ai_addr, (int) a->ai_addrlen) == 0) {
+      break;
+    }
+    decoder_closesocket(u->fd);
+    u->fd = DECODER_INVALID_SOCKET;
   }
-  
-  decoder->frame = av_frame_alloc();
-  if(!decoder->frame) {
-    decoder_free(decoder);
+  freeaddrinfo(addrs);
+
+  if(u->fd == DECODER_INVALID_SOCKET) {
     return false;
   }
-  
-  return true;    
+
+#ifdef _WIN32
+  DWORD timeout = DECODER_URL_TIMEOUT_MS;
+#else
+  struct timeval timeout = {
+    .tv_sec = DECODER_URL_TIMEOUT_MS / 1000,
+    .tv_usec = (DECODER_URL_TIMEOUT_MS % 1000) * 1000,
+  };
+#endif //_WIN32
+  setsockopt(u->fd, SOL_SOCKET, SO_RCVTIMEO, (const char *) &timeout, sizeof(timeout));
+
+  u->connected = true;
+  u->connects++;
+  return true;
 }
 
-DECODER_DEF void decoder_free(Decoder *decoder) {
-  
-  decoder->continue_receive = false;
-  decoder->continue_convert = false;
+DECODER_DEF void decoder_url_disconnect(Decoder_Url *u) {
+  if(u->connected) {
+    decoder_closesocket(u->fd);
+  }
+  u->fd = DECODER_INVALID_SOCKET;
+  u->connected = false;
+  u->body_left = 0;
+  u->head_pos = 0;
+  u->head_len = 0;
+}
 
-  if(decoder->frame) {
-    av_frame_free(&decoder->frame);
-    decoder->frame = NULL;    
+// Up to `size` bytes, leftovers from the header read first. 0 means the
+// server closed the connection.
+DECODER_DEF int decoder_url_recv(Decoder_Url *u, unsigned char *buf, size_t size) {
+  if(u->head_pos < u->head_len) {
+    size_t n = u->head_len - u->head_pos;
+    if(n > size) n = size;
+    memcpy(buf, u->head + u->head_pos, n);
+    u->head_pos += n;
+    return (int) n;
   }
-  
-  if(decoder->packet) {
-    av_packet_free(&decoder->packet);
-    decoder->packet = NULL;    
+
+  int n;
+  do {
+    n = (int) recv(u->fd, (char *) buf, (int) size, 0);
+#ifdef _WIN32
+  } while(0);
+#else
+  } while(n < 0 && errno == EINTR);
+#endif //_WIN32
+  return n;
+}
+
+DECODER_DEF bool decoder_url_skip(Decoder_Url *u, int64_t n) {
+  unsigned char buf[4096];
+  while(n > 0) {
+    int got = decoder_url_recv(u, buf, n < (int64_t) sizeof(buf) ? (size_t) n : sizeof(buf));
+    if(got <= 0) {
+      return false;
+    }
+    n -= got;
+    u->body_pos += got;
+    if(u->body_left > 0) u->body_left -= got;
   }
+  return true;
+}
 
-  if(decoder->swr_context) {
-    swr_free(&decoder->swr_context);
-    decoder->swr_context = NULL;    
+// Sends a GET for [pos, pos + readahead) and parses the response head.
+// 0 on success, AVERROR_EOF past the end, another AVERROR otherwise.
+DECODER_DEF int decoder_url_request(Decoder_Url *u) {
+  int64_t last = u->pos + (int64_t) u->readahead - 1;
+  if(u->size >= 0 && last >= u->size) last = u->size - 1;
+
+  char request[sizeof(u->path) + sizeof(u->host) + 256];
+  int request_len = snprintf(request, sizeof(request),
+			     "GET %s HTTP/1.1\r\n"
+			     "Host: %s:%s\r\n"
+			     "Range: bytes=%lld-%lld\r\n"
+			     "Connection: keep-alive\r\n"
+			     "\r\n",
+			     u->path, u->host, u->port,
+			     (long long) u->pos, (long long) last);
+  if(request_len < 0 || request_len >= (int) sizeof(request)) {
+    return AVERROR(EINVAL);
   }
 
-  if(decoder->av_codec_context) {
-    avcodec_close(decoder->av_codec_context);
-    avcodec_free_context(&decoder->av_codec_context);
-    decoder->av_codec_context = NULL;    
+#ifdef MSG_NOSIGNAL
+  int flags = MSG_NOSIGNAL;
+#else
+  int flags = 0;
+#endif //MSG_NOSIGNAL
+  for(int off=0;off<request_len;) {
+    int n = (int) send(u->fd, request + off, request_len - off, flags);
+    if(n <= 0) {
+      return AVERROR(EIO);
+    }
+    off += n;
   }
+  u->requests++;
 
-  if(decoder->av_format_context) {
-    avformat_close_input(&decoder->av_format_context);
-    decoder->av_format_context = NULL;    
+  // Read until the blank line, whatever follows is body
+  u->head_pos = 0;
+  u->head_len = 0;
+  char *end = NULL;
+  while(!end) {
+    if(u->head_len == sizeof(u->head) - 1) {
+      return AVERROR_INVALIDDATA;
+    }
+    int n = (int) recv(u->fd, u->head + u->head_len, (int) (sizeof(u->head) - 1 - u->head_len), 0);
+    if(n <= 0) {
+      return AVERROR(EIO);
+    }
+    u->head_len += n;
+    u->head[u->head_len] = 0;
+    end = strstr(u->head, "\r\n\r\n");
   }
+  u->head_pos = (size_t) (end + 4 - u->head);
 
-  if(decoder->av_io_context) {
-    avio_context_free(&decoder->av_io_context);
-    decoder->av_io_context = NULL;
+  int status;
+  if(sscanf(u->head, "HTTP/1.%*d %d", &status) != 1) {
+    return AVERROR_INVALIDDATA;
   }
-}
 
-DECODER_DEF bool decoder_decode(Decoder *decoder, int *out_samples, unsigned char *buffer) {
-  *out_samples = 0;
-  if(!decoder->continue_convert) {
-    
-    if(!decoder->continue_receive) {
-      if(av_read_frame(decoder->av_format_context, decoder->packet) < 0) {
-	decoder->continue_receive = false;
-	decoder->continue_convert = false;
-	return false;
+  int64_t content_length = -1;
+  int64_t range_first = 0;
+  int64_t range_size = -1;
+  bool close = false;
+  for(char *line=strstr(u->head, "\r\n") + 2;line<end;line=strstr(line, "\r\n") + 2) {
+    if(decoder_strncasecmp(line, "Content-Length:", 15) == 0) {
+      content_length = strtoll(line + 15, NULL, 10);
+    } else if(decoder_strncasecmp(line, "Content-Range:", 14) == 0) {
+      long long first, last_byte, total;
+      int fields = sscanf(line + 14, " bytes %lld-%lld/%lld", &first, &last_byte, &total);
+      if(fields == 3) {
+	range_size = total;
+      } else if(fields == 2) {
+	// bytes a-b/*, the total is not known yet
+      } else if(sscanf(line + 14, " bytes */%lld", &total) == 1) {
+	range_size = total;
+	first = total;
+      } else {
+	first = 0;
       }
-      if(decoder->packet->stream_index != decoder->stream_index) {
-	decoder->continue_receive = false;
-	decoder->continue_convert = false;
+      range_first = first;
+    } else if(decoder_strncasecmp(line, "Connection:", 11) == 0) {
+      char *value = strstr(line, "close");
+      close = value && value < strstr(line, "\r\n");
+    } else if(decoder_strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+      // Object stores send Content-Length, chunked bodies are not handled
+      return AVERROR_PATCHWELCOME;
+    }
+  }
 
-	av_packet_unref(decoder->packet);
-	return true;
-      }
-    
-      decoder->continue_receive = true;
+  u->keep_alive = !close && strncmp(u->head, "HTTP/1.0", 8) != 0;
+  u->body_left = content_length;
 
-      if(avcodec_send_packet(decoder->av_codec_context, decoder->packet) < 0) {
-	//fprintf(stderr, "ERROR: fatal error in avcodec_send_packet\n");
-	//exit(1);
-	return false;
-      }
-    }  
+  if(status == 206) {
+    u->seekable = true;
+    u->body_pos = range_first;
+    if(range_size >= 0) u->size = range_size;
+    return 0;
+  }
 
-    if(avcodec_receive_frame(decoder->av_codec_context, decoder->frame) >= 0) {
+  if(status == 200) {
+    // Range ignored, the body is the whole file
+    u->seekable = false;
+    u->body_pos = 0;
+    u->size = content_length;
+    return 0;
+  }
 
-      if(decoder->target_volume != decoder->volume) {
-	av_opt_set_double(decoder->swr_context, "rmvol", decoder->target_volume, 0);
-	double volume;
-	swr_init(decoder->swr_context);
-	av_opt_get_double(decoder->swr_context, "rmvol", 0, &volume);
-	decoder->volume = (float) volume;
-      }
+  if(status == 416) {
+    if(range_size >= 0) u->size = range_size;
+    if(!decoder_url_skip(u, content_length > 0 ? content_length : 0) || !u->keep_alive) {
+      decoder_url_disconnect(u);
+    }
+    return AVERROR_EOF;
+  }
 
-      decoder->pts = decoder->frame->pts;
-      
-      *out_samples = swr_convert(decoder->swr_context, &buffer, decoder->samples,
-				 (const unsigned char **) (decoder->frame->data),
-				 decoder->frame->nb_samples);
-      
-      if(*out_samples > 0) {
-	decoder->continue_convert = true;
-      } else {
-	decoder->continue_convert = false;
+  decoder_url_disconnect(u);
+  return AVERROR(EIO);
+}
 
-	av_frame_unref(decoder->frame);
+// Refills the window at u->pos, reusing the response already on the
+// connection when it covers pos
+DECODER_DEF int decoder_url_fill(Decoder_Url *u) {
+  if(u->size >= 0 && u->pos >= u->size) {
+    return AVERROR_EOF;
+  }
+
+  // Sequential reads grow the window, anything else starts small again
+  bool sequential = u->window_len > 0 && u->pos == u->window_pos + (int64_t) u->window_len;
+  if(!sequential) {
+    u->readahead = DECODER_URL_WINDOW_MIN;
+  } else if(u->readahead < DECODER_URL_WINDOW_MAX) {
+    u->readahead *= 2;
+  }
+  u->window_len = 0;
+
+  bool reuse = u->connected && u->body_left != 0 &&
+    u->body_pos <= u->pos && u->pos - u->body_pos <= DECODER_URL_WINDOW_MAX;
+
+  if(!reuse) {
+    // Finish what is left of the last response to keep the connection
+    if(u->connected && u->seekable && u->keep_alive &&
+       u->body_left > 0 && u->body_left <= DECODER_URL_WINDOW_MAX) {
+      decoder_url_skip(u, u->body_left);
+    }
+    if(u->connected && (u->body_left != 0 || !u->keep_alive)) {
+      decoder_url_disconnect(u);
+    }
+
+    // An idle kept-alive connection may have been closed by the server,
+    // retry once on a fresh one
+    int err = AVERROR(EIO);
+    for(int attempt=0;attempt<2;attempt++) {
+      bool fresh = !u->connected;
+      if(!u->connected && !decoder_url_connect(u)) {
+	return AVERROR(EIO);
       }
-    } else {
-      *out_samples = 0;
-      
-      decoder->continue_convert = false;
-      decoder->continue_receive = false;
+      err = decoder_url_request(u);
+      if(err == 0 || err == AVERROR_EOF || fresh) {
+	break;
+      }
+      decoder_url_disconnect(u);
+    }
+    if(err < 0) {
+      return err;
+    }
 
-      av_packet_unref(decoder->packet);
+    if(u->body_pos > u->pos) {
+      decoder_url_disconnect(u);
+      return AVERROR(EIO);
     }
+  }
 
-    return true;
+  if(!decoder_url_skip(u, u->pos - u->body_pos)) {
+    decoder_url_disconnect(u);
+    return AVERROR(EIO);
   }
-      
-  *out_samples = swr_convert(decoder->swr_context, &buffer, decoder->samples, NULL, 0);
 
-  if(*out_samples > 0) {
-    decoder->continue_convert = true;
-  } else {
-    decoder->continue_convert = false;    
-    av_packet_unref(decoder->packet);
+  size_t want = u->readahead;
+  if(u->body_left >= 0 && (int64_t) want > u->body_left) want = (size_t) u->body_left;
+
+  u->window_pos = u->pos;
+  while(u->window_len < want) {
+    int n = decoder_url_recv(u, u->window + u->window_len, want - u->window_len);
+    if(n <= 0) {
+      break;
+    }
+    u->window_len += n;
+  }
+  u->body_pos += u->window_len;
+  if(u->body_left > 0) {
+    u->body_left -= u->window_len;
   }
 
-  return true;
+  if(u->window_len < want) {
+    // Without a length the body ends when the server closes
+    bool done = u->body_left < 0;
+    decoder_url_disconnect(u);
+    if(done && u->size < 0) u->size = u->window_pos + u->window_len;
+    if(!done) {
+      return AVERROR(EIO);
+    }
+  } else if(u->body_left == 0 && !u->keep_alive) {
+    decoder_url_disconnect(u);
+  }
 
+  return u->window_len > 0 ? 0 : AVERROR_EOF;
 }
 
+DECODER_DEF int decoder_url_read(void *opaque, uint8_t *buf, int buf_size) {
+  Decoder_Url *u = (Decoder_Url *) opaque;
 
-DECODER_DEF bool decoder_fmt_to_libav_fmt(enum AVSampleFormat *av_fmt, Decoder_Fmt fmt) {
-  switch(fmt) {
-  case DECODER_FMT_S16: {
-    *av_fmt = AV_SAMPLE_FMT_S16;
-    return true;
-  } break;
-  case DECODER_FMT_S32: {
-    *av_fmt = AV_SAMPLE_FMT_S32;
-    return true;
-  } break;
-  case DECODER_FMT_FLT: {
-    *av_fmt = AV_SAMPLE_FMT_FLT;
-    return true;
-  } break;
-  default: {
-    return false;
-  } 
+  if(u->pos < u->window_pos || u->pos >= u->window_pos + (int64_t) u->window_len) {
+    int err = decoder_url_fill(u);
+    if(err < 0) {
+      return err;
+    }
   }
-}
 
-DECODER_DEF bool decoder_fmt_to_bits_per_sample(int *bits, Decoder_Fmt fmt) {
-  switch(fmt) {
-  case DECODER_FMT_S16: {
-    *bits = 16;
-    return true;
-  } break;
-  case DECODER_FMT_S32: {
-    *bits = 32;
-    return true;
-  } break;
-  case DECODER_FMT_FLT: {
-    *bits = 32;
-    return true;
-  } break;
-  default: {
-    return false;
-  } 
-  }  
+  size_t n = (size_t) (u->window_pos + (int64_t) u->window_len - u->pos);
+  if(n > (size_t) buf_size) n = (size_t) buf_size;
+  memcpy(buf, u->window + (u->pos - u->window_pos), n);
+  u->pos += n;
+  return (int) n;
 }
 
-DECODER_DEF int decoder_memory_read(void *opaque, uint8_t *buf, int _buf_size) {
-  Decoder_Memory *memory = (Decoder_Memory *) opaque;
+DECODER_DEF int64_t decoder_url_seek(void *opaque, int64_t offset, int whence) {
+  Decoder_Url *u = (Decoder_Url *) opaque;
 
-  size_t buf_size = (size_t) _buf_size;
+  if(whence == AVSEEK_SIZE) {
+    return u->size >= 0 ? u->size : AVERROR(ENOSYS);
+  }
 
-  if (buf_size > memory->size - memory->pos) {
-    buf_size = memory->size - memory->pos;
+  int64_t pos;
+  if(whence == SEEK_SET) {
+    pos = offset;
+  } else if(whence == SEEK_CUR) {
+    pos = u->pos + offset;
+  } else if(whence == SEEK_END && u->size >= 0) {
+    pos = u->size + offset;
+  } else {
+    return AVERROR(EINVAL);
   }
 
-  if (buf_size <= 0) {
-    return AVERROR_EOF;
+  // Without Range only the current window and forward are reachable
+  if(pos < 0 || (!u->seekable && pos < u->window_pos)) {
+    return AVERROR(EINVAL);
   }
 
-  memcpy(buf, memory->data + memory->pos, buf_size);
-  memory->pos += buf_size;
+  // Nothing is fetched until the next read
+  u->pos = pos;
+  return pos;
+}
 
-  return (int )buf_size;
+DECODER_DEF bool decoder_stream_open(Decoder_Stream *s, const char *path) {
+  memset(s, 0, sizeof(*s));
+  s->owned = strcmp(path, "-") != 0;
+
+#ifdef _WIN32
+  if(!s->owned) {
+    s->handle = GetStdHandle(STD_INPUT_HANDLE);
+  } else {
+    s->handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+			    OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  }
+  if(s->handle == INVALID_HANDLE_VALUE || s->handle == NULL) {
+    return false;
+  }
+  s->seekable = GetFileType(s->handle) == FILE_TYPE_DISK;
+#else
+  if(!s->owned) {
+    s->fd = STDIN_FILENO;
+  } else if(strncmp(path, "unix:", 5) == 0) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if(strlen(path + 5) >= sizeof(addr.sun_path)) {
+      return false;
+    }
+    strcpy(addr.sun_path, path + 5);
+
+    s->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(s->fd < 0) {
+      return false;
+    }
+    if(connect(s->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+      close(s->fd);
+      return false;
+    }
+  } else {
+    s->fd = open(path, O_RDONLY);
+    if(s->fd < 0) {
+      return false;
+    }
+  }
+
+  struct stat st;
+  s->seekable = fstat(s->fd, &st) == 0 && S_ISREG(st.st_mode);
+#endif //_WIN32
+
+  return true;
 }
 
-DECODER_DEF int64_t decoder_memory_seek(void *opaque, int64_t offset, int whence) {
+DECODER_DEF void decoder_stream_close(Decoder_Stream *s) {
+  if(s->owned) {
+#ifdef _WIN32
+    CloseHandle(s->handle);
+#else
+    close(s->fd);
+#endif //_WIN32
+  }
+  memset(s, 0, sizeof(*s));
+}
 
-  Decoder_Memory *memory = (Decoder_Memory *) opaque;
+DECODER_DEF int decoder_stream_read(void *opaque, uint8_t *buf, int buf_size) {
+  Decoder_Stream *s = (Decoder_Stream *) opaque;
 
-  switch (whence) {
-  case SEEK_SET:
-    memory->pos = offset;
-    break;
-  case SEEK_CUR:
-    memory->pos += offset;
-    break;
-  case SEEK_END:
-    memory->pos = memory->size + offset;
-    break;
-  case AVSEEK_SIZE:
-    return (int64_t) memory->size;
-  default:
-    return AVERROR_INVALIDDATA;
+#ifdef _WIN32
+  DWORD n;
+  if(!ReadFile(s->handle, buf, (DWORD) buf_size, &n, NULL)) {
+    // The writer closed its end of the pipe
+    return GetLastError() == ERROR_BROKEN_PIPE ? AVERROR_EOF : AVERROR(EIO);
   }
+#else
+  ssize_t n;
+  do {
+    n = read(s->fd, buf, (size_t) buf_size);
+  } while(n < 0 && errno == EINTR);
+  if(n < 0) {
+    return AVERROR(errno);
+  }
+#endif //_WIN32
 
-  if (memory->pos > memory->size) {
+  if(n == 0) {
+    return AVERROR_EOF;
+  }
+  return (int) n;
+}
+
+DECODER_DEF int64_t decoder_stream_seek(void *opaque, int64_t offset, int whence) {
+  Decoder_Stream *s = (Decoder_Stream *) opaque;
+  if(!s->seekable) {
+    return AVERROR(ESPIPE);
+  }
+
+#ifdef _WIN32
+  LARGE_INTEGER distance, pos;
+  if(whence == AVSEEK_SIZE) {
+    return GetFileSizeEx(s->handle, &pos) ? (int64_t) pos.QuadPart : AVERROR(EIO);
+  }
+  DWORD method = whence == SEEK_SET ? FILE_BEGIN : whence == SEEK_CUR ? FILE_CURRENT : FILE_END;
+  distance.QuadPart = offset;
+  if(!SetFilePointerEx(s->handle, distance, &pos, method)) {
     return AVERROR(EIO);
   }
-    
-  return memory->pos;
+  return (int64_t) pos.QuadPart;
+#else
+  if(whence == AVSEEK_SIZE) {
+    struct stat st;
+    return fstat(s->fd, &st) == 0 ? (int64_t) st.st_size : AVERROR(errno);
+  }
+  off_t pos = lseek(s->fd, (off_t) offset, whence);
+  if(pos < 0) {
+    return AVERROR(errno);
+  }
+  return (int64_t) pos;
+#endif //_WIN32
 }
 
 DECODER_DEF int decoder_file_read(void *opaque, uint8_t *buf, int buf_size) {
@@ -618,16 +4896,38 @@ DECODER_DEF int decoder_file_read(void *opaque, uint8_t *buf, int buf_size) {
 DECODER_DEF int64_t decoder_file_seek(void *opaque, int64_t offset, int whence) {
   
   FILE *f = (FILE *)opaque;
+
+#ifdef _WIN32
+#  define decoder_fseek _fseeki64
+#  define decoder_ftell _ftelli64
+#else
+#  define decoder_fseek(f, offset, whence) fseeko((f), (off_t) (offset), (whence))
+#  define decoder_ftell ftello
+#endif //_WIN32
+
+  if(whence == AVSEEK_SIZE) {
+    int64_t pos = (int64_t) decoder_ftell(f);
+    if(pos < 0 || decoder_fseek(f, 0, SEEK_END)) {
+      return AVERROR(errno);
+    }
+    int64_t size = (int64_t) decoder_ftell(f);
+    if(decoder_fseek(f, pos, SEEK_SET)) {
+      return AVERROR(errno);
+    }
+    return size;
+  }
   
   if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) {
     return AVERROR_INVALIDDATA;
   }
 
-  if(fseek(f, (long) offset, whence)) {
+  if(decoder_fseek(f, offset, whence)) {
     return AVERROR(errno);
   }
 
-  return ftell(f);
+  return (int64_t) decoder_ftell(f);
+#undef decoder_fseek
+#undef decoder_ftell
 }
 
 #endif //DECODER_IMPLEMENTATION
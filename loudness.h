@@ -0,0 +1,279 @@
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+// EBU R128 / ITU-R BS.1770-4 loudness and true-peak meter.
+// Feed it the same interleaved float blocks as spectrum_push/audio_play.
+
+// linux
+//   gcc  : -lm
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef LOUDNESS_DEF
+#  define LOUDNESS_DEF static inline
+#endif //LOUDNESS_DEF
+
+// Double precision, the filter design needs more than the float PI
+#define LOUDNESS_PI 3.14159265358979323846
+
+#define LOUDNESS_MAX_CHANNELS 8
+#define LOUDNESS_SHORT_TERM_BLOCKS 30 // 3s in 100ms blocks
+#define LOUDNESS_MOMENTARY_BLOCKS 4   // 400ms in 100ms blocks
+
+// Gating histogram, 0.1 LU bins from -70 to +30 LUFS
+#define LOUDNESS_HISTOGRAM_MIN -70.0
+#define LOUDNESS_HISTOGRAM_BINS 1000
+
+// 4x oversampling for true peak, polyphase with 12 taps per phase
+#define LOUDNESS_OVERSAMPLE 4
+#define LOUDNESS_PHASE_TAPS 12
+
+typedef struct{
+  int channels;
+  int sample_rate;
+  float weights[LOUDNESS_MAX_CHANNELS];
+
+  // K-weighting: high shelf followed by high pass, transposed direct form II.
+  // The state is laid out per stage with the channel innermost, so the
+  // per-frame loops run across channels.
+  double b[2][3];
+  double a[2][3];
+  double z[2][2][LOUDNESS_MAX_CHANNELS];
+
+  // Mean square of the current 100ms block
+  double block_sum;
+  int block_len;
+  int block_pos;
+
+  // Ring of the last weighted 100ms block energies
+  double blocks[LOUDNESS_SHORT_TERM_BLOCKS];
+  size_t blocks_count;
+  size_t blocks_pos;
+
+  // Gating block counts and their summed energies per bin, the sums keep
+  // the integrated loudness exact instead of using the bin centres
+  unsigned int histogram[LOUDNESS_HISTOGRAM_BINS];
+  double histogram_energy[LOUDNESS_HISTOGRAM_BINS];
+
+  float phases[LOUDNESS_OVERSAMPLE][LOUDNESS_PHASE_TAPS];
+  float history[LOUDNESS_MAX_CHANNELS][LOUDNESS_PHASE_TAPS];
+  float true_peak;
+}Loudness;
+
+// Public
+LOUDNESS_DEF bool loudness_init(Loudness *l, int channels, int sample_rate);
+LOUDNESS_DEF void loudness_push(Loudness *l, const float *frames, size_t frames_count);
+LOUDNESS_DEF float loudness_momentary(Loudness *l);
+LOUDNESS_DEF float loudness_short_term(Loudness *l);
+LOUDNESS_DEF float loudness_integrated(Loudness *l);
+LOUDNESS_DEF float loudness_true_peak(Loudness *l);
+LOUDNESS_DEF void loudness_reset(Loudness *l);
+
+// Private
+LOUDNESS_DEF float loudness_energy_to_lufs(double energy);
+LOUDNESS_DEF double loudness_lufs_to_energy(double lufs);
+LOUDNESS_DEF double loudness_blocks_energy(Loudness *l, size_t count);
+
+#ifdef LOUDNESS_IMPLEMENTATION
+
+LOUDNESS_DEF bool loudness_init(Loudness *l, int channels, int sample_rate) {
+  memset(l, 0, sizeof(*l));
+  if(channels <= 0 || channels > LOUDNESS_MAX_CHANNELS || sample_rate < 10) {
+    return false;
+  }
+
+  l->channels = channels;
+  l->sample_rate = sample_rate;
+  l->block_len = sample_rate / 10;
+
+  // Channel weights, assuming the libav 5.1 order L R C LFE Ls Rs
+  for(int c=0;c<channels;c++) {
+    l->weights[c] = 1.f;
+  }
+  if(channels == 6) {
+    l->weights[3] = 0.f;
+    l->weights[4] = 1.41f;
+    l->weights[5] = 1.41f;
+  }
+
+  // K-weighting coefficients for arbitrary rates, as in libebur128
+  double f0 = 1681.974450955533;
+  double G  = 3.999843853973347;
+  double Q  = 0.7071752369554196;
+  double K  = tan(LOUDNESS_PI * f0 / (double) sample_rate);
+  double Vh = pow(10.0, G / 20.0);
+  double Vb = pow(Vh, 0.4996667741545416);
+  double a0 = 1.0 + K / Q + K * K;
+  l->b[0][0] = (Vh + Vb * K / Q + K * K) / a0;
+  l->b[0][1] = 2.0 * (K * K - Vh) / a0;
+  l->b[0][2] = (Vh - Vb * K / Q + K * K) / a0;
+  l->a[0][0] = 1.0;
+  l->a[0][1] = 2.0 * (K * K - 1.0) / a0;
+  l->a[0][2] = (1.0 - K / Q + K * K) / a0;
+
+  f0 = 38.13547087602444;
+  Q  = 0.5003270373238773;
+  K  = tan(LOUDNESS_PI * f0 / (double) sample_rate);
+  a0 = 1.0 + K / Q + K * K;
+  l->b[1][0] = 1.0;
+  l->b[1][1] = -2.0;
+  l->b[1][2] = 1.0;
+  l->a[1][0] = 1.0;
+  l->a[1][1] = 2.0 * (K * K - 1.0) / a0;
+  l->a[1][2] = (1.0 - K / Q + K * K) / a0;
+
+  // Interpolation filter: Hann-windowed sinc, split into polyphase branches
+  int taps = LOUDNESS_OVERSAMPLE * LOUDNESS_PHASE_TAPS;
+  double center = (taps - 1) / 2.0;
+  for(int k=0;k<taps;k++) {
+    double t = ((double) k - center) / LOUDNESS_OVERSAMPLE;
+    double sinc = t == 0.0 ? 1.0 : sin(LOUDNESS_PI * t) / (LOUDNESS_PI * t);
+    double hann = 0.5 - 0.5 * cos(2.0 * LOUDNESS_PI * (k + 0.5) / taps);
+    l->phases[k % LOUDNESS_OVERSAMPLE][k / LOUDNESS_OVERSAMPLE] = (float) (sinc * hann);
+  }
+
+  return true;
+}
+
+LOUDNESS_DEF void loudness_reset(Loudness *l) {
+  int channels = l->channels;
+  int sample_rate = l->sample_rate;
+  loudness_init(l, channels, sample_rate);
+}
+
+LOUDNESS_DEF void loudness_push(Loudness *l, const float *frames, size_t frames_count) {
+  int channels = l->channels;
+
+  for(size_t i=0;i<frames_count;i++) {
+    const float *frame = frames + i * channels;
+
+    // K-weighting and the weighted square sum
+    double sum = 0.0;
+    for(int c=0;c<channels;c++) {
+      double x = frame[c];
+      for(int s=0;s<2;s++) {
+	double y = l->b[s][0] * x + l->z[s][0][c];
+	l->z[s][0][c] = l->b[s][1] * x - l->a[s][1] * y + l->z[s][1][c];
+	l->z[s][1][c] = l->b[s][2] * x - l->a[s][2] * y;
+	x = y;
+      }
+      sum += l->weights[c] * x * x;
+    }
+    l->block_sum += sum;
+
+    // True peak, every output phase of the oversampler
+    float peak = l->true_peak;
+    for(int c=0;c<channels;c++) {
+      float *h = l->history[c];
+      memmove(h + 1, h, (LOUDNESS_PHASE_TAPS - 1) * sizeof(*h));
+      h[0] = frame[c];
+      for(int p=0;p<LOUDNESS_OVERSAMPLE;p++) {
+	float y = 0.f;
+	for(int j=0;j<LOUDNESS_PHASE_TAPS;j++) {
+	  y += l->phases[p][j] * h[j];
+	}
+	y = fabsf(y);
+	if(y > peak) peak = y;
+      }
+    }
+    l->true_peak = peak;
+
+    if(++l->block_pos < l->block_len) {
+      continue;
+    }
+
+    // Finished a 100ms block
+    l->blocks[l->blocks_pos] = l->block_sum / l->block_len;
+    l->blocks_pos = (l->blocks_pos + 1) % LOUDNESS_SHORT_TERM_BLOCKS;
+    if(l->blocks_count < LOUDNESS_SHORT_TERM_BLOCKS) l->blocks_count++;
+    l->block_sum = 0.0;
+    l->block_pos = 0;
+
+    // Gating blocks are 400ms with 75% overlap, one per 100ms block
+    if(l->blocks_count >= LOUDNESS_MOMENTARY_BLOCKS) {
+      double energy = loudness_blocks_energy(l, LOUDNESS_MOMENTARY_BLOCKS);
+      float lufs = loudness_energy_to_lufs(energy);
+      if(lufs > LOUDNESS_HISTOGRAM_MIN) {
+	int bin = (int) ((lufs - LOUDNESS_HISTOGRAM_MIN) * 10.0);
+	if(bin >= LOUDNESS_HISTOGRAM_BINS) bin = LOUDNESS_HISTOGRAM_BINS - 1;
+	l->histogram[bin]++;
+	l->histogram_energy[bin] += energy;
+      }
+    }
+  }
+}
+
+LOUDNESS_DEF double loudness_blocks_energy(Loudness *l, size_t count) {
+  double sum = 0.0;
+  for(size_t i=0;i<count;i++) {
+    size_t k = (l->blocks_pos + LOUDNESS_SHORT_TERM_BLOCKS - 1 - i) % LOUDNESS_SHORT_TERM_BLOCKS;
+    sum += l->blocks[k];
+  }
+  return sum / (double) count;
+}
+
+LOUDNESS_DEF float loudness_momentary(Loudness *l) {
+  if(l->blocks_count < LOUDNESS_MOMENTARY_BLOCKS) {
+    return -INFINITY;
+  }
+  return loudness_energy_to_lufs(loudness_blocks_energy(l, LOUDNESS_MOMENTARY_BLOCKS));
+}
+
+LOUDNESS_DEF float loudness_short_term(Loudness *l) {
+  if(l->blocks_count < LOUDNESS_SHORT_TERM_BLOCKS) {
+    return -INFINITY;
+  }
+  return loudness_energy_to_lufs(loudness_blocks_energy(l, LOUDNESS_SHORT_TERM_BLOCKS));
+}
+
+LOUDNESS_DEF float loudness_integrated(Loudness *l) {
+  // Absolute gate at -70 LUFS is applied when filling the histogram
+  double sum = 0.0;
+  unsigned long long count = 0;
+  for(int i=0;i<LOUDNESS_HISTOGRAM_BINS;i++) {
+    sum += l->histogram_energy[i];
+    count += l->histogram[i];
+  }
+  if(!count) {
+    return -INFINITY;
+  }
+
+  // Relative gate at -10 LU
+  double gate = loudness_energy_to_lufs(sum / (double) count) - 10.0;
+  int start = (int) ((gate - LOUDNESS_HISTOGRAM_MIN) * 10.0);
+  if(start < 0) start = 0;
+
+  sum = 0.0;
+  count = 0;
+  for(int i=start;i<LOUDNESS_HISTOGRAM_BINS;i++) {
+    sum += l->histogram_energy[i];
+    count += l->histogram[i];
+  }
+  if(!count) {
+    return -INFINITY;
+  }
+
+  return loudness_energy_to_lufs(sum / (double) count);
+}
+
+LOUDNESS_DEF float loudness_true_peak(Loudness *l) {
+  return 20.f * log10f(l->true_peak);
+}
+
+LOUDNESS_DEF float loudness_energy_to_lufs(double energy) {
+  if(energy <= 0.0) {
+    return -INFINITY;
+  }
+  return (float) (-0.691 + 10.0 * log10(energy));
+}
+
+LOUDNESS_DEF double loudness_lufs_to_energy(double lufs) {
+  return pow(10.0, (lufs + 0.691) / 10.0);
+}
+
+#endif //LOUDNESS_IMPLEMENTATION
+
+#endif //LOUDNESS_H
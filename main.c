@@ -1,49 +1,54 @@
 #include <stdio.h>
 
+// decoder.h goes first: it includes thread.h itself, and on win32 it
+// needs winsock2.h ahead of windows.h
+#define THREAD_IMPLEMENTATION
+#define DECODER_IMPLEMENTATION
+#include "decoder.h"
+
 #define WINDOW_IMPLEMENTATION
 #include "window.h"
 
 #define SPECTRUM_IMPLEMENTATION
 #include "spectrum.h"
 
-#define DECODER_IMPLEMENTATION
-#include "decoder.h"
+#define PLAYLIST_IMPLEMENTATION
+#include "playlist.h"
 
 #define AUDIO_IMPLEMENTATION
 #include "audio.h"
 
-#define THREAD_IMPLEMENTATION
-#include "thread.h"
-
 #define VOLUME .05f
+#define CROSSFADE_SECONDS 2.f
 
 Spectrum spec = {0};
 
 #define return_defer(n) do{ result = (n); goto defer; }while(0)
 
+typedef struct{
+  const char **paths;
+  size_t paths_count;
+}Tracks;
+
 void *audio_thread(void *arg) {
-  const char *filepath = arg;
+  Tracks *tracks = arg;
 
   void *result = NULL;
+  Audio audio = {0};
 
-  FILE *f = fopen(filepath, "rb");
-  if(!f) {
-    return_defer(NULL);
-  }
-
-  Decoder decoder;
-  int channels = -1;
+  // Stereo for the whole list, the spectrum reads the left channel
+  Playlist playlist;
+  bool opened = false;
+  int channels = 2;
   int sample_rate;
-  if(!decoder_init(&decoder,
-		   decoder_file_read,
-		   decoder_file_seek,
-		   f,		     
-		   DECODER_FMT_FLT, VOLUME, 1152,
-		   &channels, &sample_rate)) {
+  if(!playlist_init(&playlist,
+		    tracks->paths, tracks->paths_count,
+		    DECODER_FMT_FLT, VOLUME, 1152, CROSSFADE_SECONDS,
+		    &channels, &sample_rate)) {
     return_defer(NULL);
   }
+  opened = true;
 
-  Audio audio = {0};
   if(!audio_init(&audio, AUDIO_FMT_FLT, channels, sample_rate)) {
     return_defer(NULL);
   }
@@ -53,7 +58,7 @@ void *audio_thread(void *arg) {
   int samples = 0;
 
   int out_samples;
-  while(decoder_decode(&decoder, &out_samples, buffer[current] + samples * audio.sample_size)) {
+  while(playlist_decode(&playlist, &out_samples, buffer[current] + samples * audio.sample_size)) {
     samples += out_samples;
     if(samples > 1024) {
       audio_play(&audio, buffer[current], samples);
@@ -74,8 +79,7 @@ void *audio_thread(void *arg) {
 
  defer:
   if(audio.sample_size != 0) audio_free(&audio);
-  if(f) fclose(f);
-  if(channels != -1) decoder_free(&decoder);
+  if(opened) playlist_free(&playlist);
 
   return result;
 }
@@ -131,10 +135,17 @@ int mai4n() {
   window_free(&window);
 }
 
-int main() {
+int main(int argc, const char **argv) {
 
   memset(&spec, 0, sizeof(spec));
 
+  static const char *default_paths[] = { "videoplayback.mp4" };
+  Tracks tracks = { default_paths, 1 };
+  if(argc > 1) {
+    tracks.paths = argv + 1;
+    tracks.paths_count = (size_t) (argc - 1);
+  }
+
 
   Window window;
   if(!window_init(&window, 160*5, 90*5, "Spectrum", 0)) {
@@ -142,7 +153,7 @@ int main() {
   }
 
   Thread id;
-  if(!thread_create(&id, audio_thread, "videoplayback.mp4")) {
+  if(!thread_create(&id, audio_thread, &tracks)) {
     return 1;
   }
 
@@ -0,0 +1,405 @@
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+// Gapless playback of a list of files as one continuous PCM stream. While
+// a track plays, the next one is opened and its first block decoded on a
+// loader thread, so switching costs nothing. Every track is converted to
+// the channels and rate of the first, so a single Audio serves the list.
+//
+// Encoder delay and padding are trimmed by libavcodec (LAME/iTunes gapless
+// info, mp4 edit lists, Opus pre-skip), and decoder_decode drains codec and
+// resampler at the end of each track, so tracks splice sample-exact.
+
+// Uses decoder.h and thread.h, define THREAD_IMPLEMENTATION once
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "decoder.h"
+
+#ifndef PI
+#  define PI 3.141592653589793f
+#endif //PI
+
+#ifndef PLAYLIST_DEF
+#  define PLAYLIST_DEF static inline
+#endif //PLAYLIST_DEF
+
+typedef struct Playlist Playlist;
+
+typedef struct{
+  Playlist *playlist;
+  size_t index;
+  float volume;
+  bool ok;
+
+  Decoder_Mmap source;
+  Decoder decoder;
+
+  // First block, decoded by the loader
+  unsigned char *primed;
+  int primed_samples;
+  bool ended;
+}Playlist_Track;
+
+struct Playlist{
+  const char **paths;
+  size_t paths_count;
+
+  Decoder_Fmt fmt;
+  float volume;
+  int samples;
+  int channels;
+  int sample_rate;
+  int sample_size;
+
+  Playlist_Track tracks[2];
+  Playlist_Track *current;
+  Playlist_Track *next;
+  Thread loader;
+  bool loading; // loader thread running for next
+  bool loaded;  // next was loaded without a thread
+
+  // Crossfade, DECODER_FMT_FLT only. The last `crossfade` samples of a
+  // track are held back in the ring, then faded into the next track. The
+  // fade never exceeds `crossfade` samples: a track shorter than that
+  // carries the unfinished fade-out on, mixed against silence.
+  int crossfade;
+  unsigned char *ring;
+  int ring_cap;
+  int ring_head;
+  int ring_len;
+  unsigned char *fade;
+  int fade_len;
+  int fade_pos;
+};
+
+// Public
+PLAYLIST_DEF bool playlist_init(Playlist *p,
+				const char **paths,
+				size_t paths_count,
+				Decoder_Fmt fmt,
+				float volume,
+				int samples,
+				float crossfade_seconds,
+				int *channels,
+				int *sample_rate);
+PLAYLIST_DEF bool playlist_decode(Playlist *p, int *out_samples, unsigned char *buffer);
+PLAYLIST_DEF void playlist_set_volume(Playlist *p, float volume);
+PLAYLIST_DEF void playlist_free(Playlist *p);
+
+// Private
+PLAYLIST_DEF bool playlist_track_open(Playlist_Track *t, const char *path);
+PLAYLIST_DEF void playlist_track_close(Playlist_Track *t);
+PLAYLIST_DEF void *playlist_track_load(void *arg);
+PLAYLIST_DEF void playlist_load_start(Playlist *p, size_t index);
+PLAYLIST_DEF bool playlist_advance(Playlist *p);
+PLAYLIST_DEF bool playlist_read(Playlist *p, int *out_samples, unsigned char *buffer);
+PLAYLIST_DEF void playlist_ring_push(Playlist *p, const unsigned char *data, int samples);
+PLAYLIST_DEF void playlist_ring_pop(Playlist *p, unsigned char *data, int samples);
+PLAYLIST_DEF void playlist_mix(Playlist *p, float *data, int samples);
+
+#ifdef PLAYLIST_IMPLEMENTATION
+
+PLAYLIST_DEF bool playlist_init(Playlist *p,
+				const char **paths,
+				size_t paths_count,
+				Decoder_Fmt fmt,
+				float volume,
+				int samples,
+				float crossfade_seconds,
+				int *channels,
+				int *sample_rate) {
+  memset(p, 0, sizeof(*p));
+  p->paths = paths;
+  p->paths_count = paths_count;
+  p->fmt = fmt;
+  p->volume = volume;
+  p->samples = samples;
+  p->channels = *channels > 0 ? *channels : 0;
+  p->tracks[0].playlist = p;
+  p->tracks[1].playlist = p;
+  p->current = &p->tracks[0];
+  p->next = &p->tracks[1];
+
+  // The first readable track decides the format of the whole list
+  size_t index = 0;
+  while(index < paths_count) {
+    p->current->index = index;
+    p->current->volume = volume;
+    playlist_track_load(p->current);
+    if(p->current->ok) break;
+    index++;
+  }
+  if(!p->current->ok) {
+    return false;
+  }
+  p->channels = p->current->decoder.channels;
+  p->sample_rate = p->current->decoder.sample_rate;
+  p->sample_size = p->current->decoder.sample_size;
+
+  if(fmt == DECODER_FMT_FLT && crossfade_seconds > 0.f) {
+    p->crossfade = (int) (crossfade_seconds * (float) p->sample_rate);
+    p->ring_cap = p->crossfade + samples;
+    p->ring = malloc((size_t) p->ring_cap * p->sample_size);
+    // Twice, the second half is scratch for the silence of a short track
+    p->fade = malloc((size_t) 2 * p->crossfade * p->sample_size);
+    if(!p->ring || !p->fade) {
+      playlist_free(p);
+      return false;
+    }
+  }
+
+  playlist_load_start(p, index + 1);
+
+  *channels = p->channels;
+  *sample_rate = p->sample_rate;
+  return true;
+}
+
+PLAYLIST_DEF void playlist_free(Playlist *p) {
+  if(p->loading) {
+    thread_join(p->loader);
+    p->loading = false;
+  }
+  playlist_track_close(&p->tracks[0]);
+  playlist_track_close(&p->tracks[1]);
+  free(p->ring);
+  free(p->fade);
+  p->ring = NULL;
+  p->fade = NULL;
+}
+
+// Volume of the current track. The next one may already be open, so
+// playlist_advance applies it again after the switch
+PLAYLIST_DEF void playlist_set_volume(Playlist *p, float volume) {
+  p->volume = volume;
+  decoder_set_volume(&p->current->decoder, volume);
+}
+
+// Like decoder_decode, but runs on into the next track. Returns false
+// after the last track.
+PLAYLIST_DEF bool playlist_decode(Playlist *p, int *out_samples, unsigned char *buffer) {
+  *out_samples = 0;
+
+  int samples;
+  if(!playlist_read(p, &samples, buffer)) {
+    // End of the list, let out what is held back
+    int n = p->ring_len < p->samples ? p->ring_len : p->samples;
+    playlist_ring_pop(p, buffer, n);
+    *out_samples = n;
+    return n > 0;
+  }
+
+  if(!p->crossfade) {
+    *out_samples = samples;
+    return true;
+  }
+
+  playlist_mix(p, (float *) buffer, samples);
+
+  playlist_ring_push(p, buffer, samples);
+  int n = p->ring_len - p->crossfade;
+  if(n < 0) n = 0;
+  playlist_ring_pop(p, buffer, n);
+  *out_samples = n;
+  return true;
+}
+
+// Next block of the current track, switching tracks at the end
+PLAYLIST_DEF bool playlist_read(Playlist *p, int *out_samples, unsigned char *buffer) {
+  Playlist_Track *t = p->current;
+
+  if(t->primed_samples > 0) {
+    memcpy(buffer, t->primed, (size_t) t->primed_samples * p->sample_size);
+    *out_samples = t->primed_samples;
+    t->primed_samples = 0;
+    return true;
+  }
+
+  if(!t->ended && decoder_decode(&t->decoder, out_samples, buffer)) {
+    return true;
+  }
+  t->ended = true;
+  *out_samples = 0;
+
+  if(!playlist_advance(p)) {
+    return false;
+  }
+
+  if(p->crossfade) {
+    // Fade-out not finished, the track was shorter than the fade: the rest
+    // fades against silence
+    if(p->fade_pos < p->fade_len) {
+      int rest = p->fade_len - p->fade_pos;
+      float *silence = (float *) (p->fade + (size_t) p->fade_len * p->sample_size);
+      memset(silence, 0, (size_t) rest * p->sample_size);
+      playlist_mix(p, silence, rest);
+      playlist_ring_push(p, (unsigned char *) silence, rest);
+    }
+
+    p->fade_len = p->ring_len;
+    p->fade_pos = 0;
+    playlist_ring_pop(p, p->fade, p->fade_len);
+  }
+
+  return true;
+}
+
+// Equal-power crossfade of data (the new track) with the held back tail
+PLAYLIST_DEF void playlist_mix(Playlist *p, float *data, int samples) {
+  int channels = p->channels;
+  float *fade = (float *) p->fade;
+
+  for(int i=0;i<samples && p->fade_pos < p->fade_len;i++) {
+    float x = ((float) p->fade_pos + 0.5f) / (float) p->fade_len;
+    float in = sinf(x * PI * 0.5f);
+    float out = cosf(x * PI * 0.5f);
+
+    float *a = data + (size_t) i * channels;
+    float *b = fade + (size_t) p->fade_pos * channels;
+    for(int c=0;c<channels;c++) {
+      a[c] = a[c] * in + b[c] * out;
+    }
+    p->fade_pos++;
+  }
+}
+
+PLAYLIST_DEF void playlist_ring_push(Playlist *p, const unsigned char *data, int samples) {
+  size_t sample_size = (size_t) p->sample_size;
+  int tail = (p->ring_head + p->ring_len) % p->ring_cap;
+  int first = p->ring_cap - tail;
+  if(first > samples) first = samples;
+
+  memcpy(p->ring + tail * sample_size, data, first * sample_size);
+  memcpy(p->ring, data + first * sample_size, (samples - first) * sample_size);
+  p->ring_len += samples;
+}
+
+PLAYLIST_DEF void playlist_ring_pop(Playlist *p, unsigned char *data, int samples) {
+  if(samples <= 0) {
+    return;
+  }
+  size_t sample_size = (size_t) p->sample_size;
+  int first = p->ring_cap - p->ring_head;
+  if(first > samples) first = samples;
+
+  memcpy(data, p->ring + p->ring_head * sample_size, first * sample_size);
+  memcpy(data + first * sample_size, p->ring, (samples - first) * sample_size);
+  p->ring_head = (p->ring_head + samples) % p->ring_cap;
+  p->ring_len -= samples;
+}
+
+// Waits for the loader and makes its track current, skipping tracks that
+// could not be opened
+PLAYLIST_DEF bool playlist_advance(Playlist *p) {
+  while(p->loading || p->loaded) {
+    if(p->loading) {
+      thread_join(p->loader);
+      p->loading = false;
+    }
+    p->loaded = false;
+
+    Playlist_Track *t = p->current;
+    playlist_track_close(t);
+    p->current = p->next;
+    p->next = t;
+
+    playlist_load_start(p, p->current->index + 1);
+    if(p->current->ok) {
+      // Opened with the volume at load time, it may have changed since
+      decoder_set_volume(&p->current->decoder, p->volume);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+PLAYLIST_DEF void playlist_load_start(Playlist *p, size_t index) {
+  if(index >= p->paths_count) {
+    return;
+  }
+
+  p->next->index = index;
+  p->next->volume = p->volume;
+  if(thread_create(&p->loader, playlist_track_load, p->next)) {
+    p->loading = true;
+    return;
+  }
+
+  // No thread, load it right here
+  playlist_track_load(p->next);
+  p->loaded = true;
+}
+
+PLAYLIST_DEF void *playlist_track_load(void *arg) {
+  Playlist_Track *t = arg;
+  Playlist *p = t->playlist;
+
+  t->ok = playlist_track_open(t, p->paths[t->index]);
+  return NULL;
+}
+
+PLAYLIST_DEF bool playlist_track_open(Playlist_Track *t, const char *path) {
+  Playlist *p = t->playlist;
+  t->ok = false;
+  t->ended = false;
+  t->primed_samples = 0;
+
+  if(!decoder_mmap_open(&t->source, path)) {
+    return false;
+  }
+
+  Decoder_Options options = {
+    .sample_rate = p->sample_rate,
+    .channels = p->channels,
+    .direct = true,
+  };
+  int channels, sample_rate;
+  if(!decoder_init_options(&t->decoder,
+			   decoder_mmap_read,
+			   decoder_mmap_seek,
+			   &t->source,
+			   p->fmt, t->volume, p->samples,
+			   &options,
+			   &channels, &sample_rate)) {
+    decoder_mmap_close(&t->source);
+    return false;
+  }
+
+  t->primed = malloc((size_t) p->samples * t->decoder.sample_size);
+  if(!t->primed) {
+    decoder_free(&t->decoder);
+    decoder_mmap_close(&t->source);
+    return false;
+  }
+
+  // Prime: open the codec state and have the first block ready
+  while(t->primed_samples == 0) {
+    if(!decoder_decode(&t->decoder, &t->primed_samples, t->primed)) {
+      t->ended = true;
+      break;
+    }
+  }
+
+  return true;
+}
+
+PLAYLIST_DEF void playlist_track_close(Playlist_Track *t) {
+  if(t->ok) {
+    decoder_free(&t->decoder);
+    decoder_mmap_close(&t->source);
+    free(t->primed);
+  }
+  t->ok = false;
+  t->primed = NULL;
+  t->primed_samples = 0;
+  t->ended = false;
+}
+
+#endif //PLAYLIST_IMPLEMENTATION
+
+#endif //PLAYLIST_H
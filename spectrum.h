@@ -1,6 +1,9 @@
 #ifndef SPECTRUM_H
 #define SPECTRUM_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <assert.h>
@@ -10,10 +13,42 @@
 #endif // SPECTRUM_DEF
 
 #define SPECTRUM_N 8192
+#define SPECTRUM_PLAN_MAX_FACTORS 32
+#define SPECTRUM_WELCH_BUCKETS 10
+#ifndef SPECTRUM_ROLLOFF
+#  define SPECTRUM_ROLLOFF 0.85f
+#endif //SPECTRUM_ROLLOFF
 #ifndef PI
 #  define PI 3.141592653589793f
 #endif //PI
 
+// Sequence counter of Spectrum_Welch. The interlocked calls are full
+// barriers, the builtins get the fences spelled out. Fields a snapshot
+// reads go through the get/set macros, relaxed atomics, so a read that
+// overlaps a push is retried rather than being a data race.
+#ifdef _WIN32
+#  include <intrin.h>
+typedef volatile long Spectrum_Seq;
+#  define spectrum_seq_begin(seq) _InterlockedIncrement(seq)
+#  define spectrum_seq_end(seq) _InterlockedIncrement(seq)
+#  define spectrum_seq_load(seq) ((unsigned int) _InterlockedOr((seq), 0))
+#  define spectrum_seq_fence() _ReadWriteBarrier()
+#  define spectrum_seq_getf(p) (*(const volatile float *) (p))
+#  define spectrum_seq_setf(p, v) (*(volatile float *) (p) = (v))
+#  define spectrum_seq_get64(p) (*(const volatile uint64_t *) (p))
+#  define spectrum_seq_set64(p, v) (*(volatile uint64_t *) (p) = (v))
+#elif __GNUC__
+typedef unsigned int Spectrum_Seq;
+#  define spectrum_seq_begin(seq) do{ __atomic_fetch_add((seq), 1, __ATOMIC_RELAXED); __atomic_thread_fence(__ATOMIC_RELEASE); }while(0)
+#  define spectrum_seq_end(seq) __atomic_fetch_add((seq), 1, __ATOMIC_RELEASE)
+#  define spectrum_seq_load(seq) __atomic_load_n((seq), __ATOMIC_ACQUIRE)
+#  define spectrum_seq_fence() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#  define spectrum_seq_getf(p) __extension__ ({ float v_; __atomic_load((p), &v_, __ATOMIC_RELAXED); v_; })
+#  define spectrum_seq_setf(p, v) do{ float v_ = (v); __atomic_store((p), &v_, __ATOMIC_RELAXED); }while(0)
+#  define spectrum_seq_get64(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#  define spectrum_seq_set64(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#endif
+
 typedef struct{
   float real;
   float imag;
@@ -23,6 +58,75 @@ SPECTRUM_DEF Spectrum_Complex spectrum_complex_add(Spectrum_Complex za, Spectrum
 SPECTRUM_DEF Spectrum_Complex spectrum_complex_sub(Spectrum_Complex za, Spectrum_Complex zb);
 SPECTRUM_DEF Spectrum_Complex spectrum_complex_mul(Spectrum_Complex za, Spectrum_Complex zb);
 
+// Mixed-radix (2/3/4/5) FFT for arbitrary n, e.g. 1152 or 4800.
+// Lengths with a prime factor greater than 5 fall back to Bluestein's
+// algorithm on top of a power-of-two plan.
+typedef struct Spectrum_Plan Spectrum_Plan;
+
+struct Spectrum_Plan{
+  size_t n;
+  size_t factors[2*SPECTRUM_PLAN_MAX_FACTORS]; // (radix, remaining length) pairs
+  Spectrum_Complex *twiddles;
+  Spectrum_Complex *scratch;
+
+  // Bluestein
+  Spectrum_Plan *sub;
+  Spectrum_Complex *chirp;
+  Spectrum_Complex *chirp_fft;
+  Spectrum_Complex *work;
+};
+
+SPECTRUM_DEF bool spectrum_plan_init(Spectrum_Plan *p, size_t n);
+SPECTRUM_DEF void spectrum_plan_fft(Spectrum_Plan *p, float in[], size_t stride, Spectrum_Complex out[]);
+SPECTRUM_DEF void spectrum_plan_cfft(Spectrum_Plan *p, const Spectrum_Complex in[], Spectrum_Complex out[]);
+SPECTRUM_DEF void spectrum_plan_icfft(Spectrum_Plan *p, const Spectrum_Complex in[], Spectrum_Complex out[]);
+SPECTRUM_DEF void spectrum_plan_free(Spectrum_Plan *p);
+
+// Uniformly partitioned overlap-save convolution for long FIR filters.
+// The latency is exactly `block` samples, and nothing is allocated after
+// spectrum_convolver_init. Use one convolver per channel.
+typedef struct{
+  size_t block;
+  size_t partitions;
+  Spectrum_Plan plan; // 2*block
+
+  Spectrum_Complex *filter; // partitions * (block + 1) bins
+  Spectrum_Complex *fdl;    // frequency-domain delay line, same layout
+  size_t fdl_pos;
+
+  float *in;                // previous and current input block
+  float *out;               // last output block
+  Spectrum_Complex *acc;
+  Spectrum_Complex *tmp;
+  size_t pos;
+}Spectrum_Convolver;
+
+SPECTRUM_DEF bool spectrum_convolver_init(Spectrum_Convolver *c, const float *taps, size_t taps_count, size_t block);
+SPECTRUM_DEF void spectrum_convolver_process(Spectrum_Convolver *c, const float *in, size_t in_stride, float *out, size_t out_stride, size_t count);
+SPECTRUM_DEF void spectrum_convolver_free(Spectrum_Convolver *c);
+
+// Bits for Spectrum.features_mask, features that are not set are not
+// computed and keep their previous value.
+typedef enum{
+  SPECTRUM_FEATURE_CENTROID = 1 << 0,
+  SPECTRUM_FEATURE_ROLLOFF  = 1 << 1,
+  SPECTRUM_FEATURE_FLATNESS = 1 << 2,
+  SPECTRUM_FEATURE_FLUX     = 1 << 3,
+  SPECTRUM_FEATURE_RMS      = 1 << 4,
+  SPECTRUM_FEATURE_ALL      = (1 << 5) - 1,
+}Spectrum_Feature;
+
+// Computed in the same passes as the window and the band reduction of
+// spectrum_analyze. Frequencies are in cycles per sample (0..0.5), multiply
+// by the sample rate for Hz. DC is excluded.
+typedef struct{
+  float centroid; // magnitude-weighted mean frequency
+  float rolloff;  // frequency below which SPECTRUM_ROLLOFF of the magnitude lies
+  float flatness; // geometric over arithmetic mean of the power, 0..1
+  float flux;     // L2 distance of the magnitudes to the previous analysis
+  float rms;      // of the unwindowed input
+}Spectrum_Features;
+
 typedef struct{
   float in_raw[SPECTRUM_N];
   float in_win[SPECTRUM_N];
@@ -30,10 +134,65 @@ typedef struct{
   float out_log[SPECTRUM_N];
   float out_smooth[SPECTRUM_N];
   float out_smear[SPECTRUM_N];
+  float out_mag[SPECTRUM_N/2];
 
   size_t m;
+
+  unsigned int features_mask;
+  Spectrum_Features features;
+
+  // Window length, 0 means SPECTRUM_N with the radix-2 spectrum_fft
+  size_t n;
+  Spectrum_Plan plan;
 }Spectrum;
 
+// Long-term average spectrum (Welch). Push every analyzed frame, then read
+// the one-sided power spectrum since start, as an exponentially weighted
+// average, or over a sliding window of SPECTRUM_WELCH_BUCKETS buckets.
+// Snapshots may be taken from another thread, the pushing side never waits.
+typedef enum{
+  SPECTRUM_WELCH_TOTAL = 0,
+  SPECTRUM_WELCH_EXPONENTIAL,
+  SPECTRUM_WELCH_WINDOW,
+}Spectrum_Welch_Kind;
+
+typedef struct{
+  size_t n;
+  size_t bins;  // n/2 + 1
+  float scale;  // 1 / sum(hann^2)
+  float alpha;  // weight of the newest frame in the exponential average
+
+  // Sums are Kahan-compensated (the *_c arrays), they run over many
+  // frames. The exponential average needs none: it decays its own error
+  // by (1 - alpha) every frame.
+
+  // Since start
+  float *total;
+  float *total_c;
+  uint64_t total_frames;
+
+  float *ew;
+  float ew_weight;
+
+  // Sliding window, each bucket holds bucket_frames frames
+  float *buckets;
+  float *buckets_c;
+  uint64_t bucket_frames;
+  uint64_t bucket_counts[SPECTRUM_WELCH_BUCKETS];
+  size_t bucket;
+
+  // Seqlock, odd while a push is in progress
+  Spectrum_Seq seq;
+}Spectrum_Welch;
+
+SPECTRUM_DEF bool spectrum_welch_init(Spectrum_Welch *w, size_t n, float alpha, uint64_t bucket_frames);
+SPECTRUM_DEF void spectrum_welch_push(Spectrum_Welch *w, const Spectrum_Complex *spectrum);
+SPECTRUM_DEF uint64_t spectrum_welch_snapshot(Spectrum_Welch *w, Spectrum_Welch_Kind kind, float *out);
+SPECTRUM_DEF void spectrum_welch_free(Spectrum_Welch *w);
+SPECTRUM_DEF void spectrum_kahan_add(float *sum, float *c, float x);
+
+SPECTRUM_DEF bool spectrum_init(Spectrum *s, size_t n);
+SPECTRUM_DEF void spectrum_free(Spectrum *s);
 SPECTRUM_DEF void spectrum_push(Spectrum *s, float frame);
 SPECTRUM_DEF void spectrum_analyze(Spectrum *s, float dt);
 
@@ -73,38 +232,126 @@ SPECTRUM_DEF Spectrum_Complex spectrum_complex_mul(Spectrum_Complex za, Spectrum
 
 /////////////////////////////////////////////////////////////////////////////////
 
+SPECTRUM_DEF bool spectrum_init(Spectrum *s, size_t n) {
+  memset(s, 0, sizeof(*s));
+  // n == 1 has no bins below n/2 to analyze
+  if(n < 2 || n > SPECTRUM_N) {
+    return false;
+  }
+
+  if(!spectrum_plan_init(&s->plan, n)) {
+    return false;
+  }
+  s->n = n;
+
+  return true;
+}
+
+SPECTRUM_DEF void spectrum_free(Spectrum *s) {
+  if(s->n) spectrum_plan_free(&s->plan);
+  s->n = 0;
+}
+
 SPECTRUM_DEF void spectrum_push(Spectrum *s, float frame) {
   memmove(s->in_raw, s->in_raw + 1, (SPECTRUM_N - 1)*sizeof(s->in_raw[0]));
   s->in_raw[SPECTRUM_N-1] = frame;
 }
 
 SPECTRUM_DEF void spectrum_analyze(Spectrum *s, float dt) {
+  size_t n = s->n ? s->n : SPECTRUM_N;
+  const float *in = s->in_raw + (SPECTRUM_N - n);
+
+  unsigned int mask = s->features_mask;
+  bool want_mag = (mask & (SPECTRUM_FEATURE_CENTROID |
+			   SPECTRUM_FEATURE_ROLLOFF |
+			   SPECTRUM_FEATURE_FLUX)) != 0;
+  bool want_flatness = (mask & SPECTRUM_FEATURE_FLATNESS) != 0;
+  bool want_flux = (mask & SPECTRUM_FEATURE_FLUX) != 0;
+
   // Apply the Hann Window on the Input - https://en.wikipedia.org/wiki/Hann_function
-  for (size_t i = 0; i < SPECTRUM_N; ++i) {
-    float t = (float)i/(SPECTRUM_N - 1);
+  for (size_t i = 0; i < n; ++i) {
+    float t = (float)i/(n - 1);
     float hann = 0.5 - 0.5*cosf(2*PI*t);
-    s->in_win[i] = s->in_raw[i]*hann;
+    s->in_win[i] = in[i]*hann;
+  }
+  if (mask & SPECTRUM_FEATURE_RMS) {
+    float sum_sq = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+      sum_sq += in[i]*in[i];
+    }
+    s->features.rms = sqrtf(sum_sq / n);
   }
 
   // FFT
-  spectrum_fft(s->in_win, 1, s->out_raw, SPECTRUM_N);
+  if(s->n) {
+    spectrum_plan_fft(&s->plan, s->in_win, 1, s->out_raw);
+  } else {
+    spectrum_fft(s->in_win, 1, s->out_raw, SPECTRUM_N);
+  }
 
   // "Squash" into the Logarithmic Scale
   float step = 1.06;
   float lowf = 1.0f;
   size_t m = 0;
   float max_amp = 1.0f;
-  for (float f = lowf; (size_t) f < SPECTRUM_N/2; f = ceilf(f*step)) {
+  float sum_mag = 0.0f;
+  float sum_fmag = 0.0f;
+  float sum_pow = 0.0f;
+  float sum_log = 0.0f;
+  float sum_flux = 0.0f;
+  size_t q_end = 1;
+  for (float f = lowf; (size_t) f < n/2; f = ceilf(f*step)) {
     float f1 = ceilf(f*step);
     float a = 0.0f;
-    for (size_t q = (size_t) f; q < SPECTRUM_N/2 && q < (size_t) f1; ++q) {
-      float b = spectrum_amp(s->out_raw[q]);
+    for (size_t q = (size_t) f; q < n/2 && q < (size_t) f1; ++q) {
+      float re = s->out_raw[q].real;
+      float im = s->out_raw[q].imag;
+      float p = re*re + im*im;
+      float b = logf(p);
       if (b > a) a = b;
+
+      if (want_flatness) {
+	sum_pow += p;
+	sum_log += b;
+      }
+      if (want_mag) {
+	float mag = sqrtf(p);
+	sum_mag += mag;
+	sum_fmag += (float) q * mag;
+	if (want_flux) {
+	  float d = mag - s->out_mag[q];
+	  sum_flux += d*d;
+	}
+	s->out_mag[q] = mag;
+      }
+      q_end = q + 1;
     }
     if (max_amp < a) max_amp = a;
     s->out_log[m++] = a;
   }
 
+  if (mask & SPECTRUM_FEATURE_CENTROID) {
+    s->features.centroid = sum_mag > 0.0f ? sum_fmag / sum_mag / (float) n : 0.0f;
+  }
+  if (mask & SPECTRUM_FEATURE_ROLLOFF) {
+    // Only pass over out_mag, which is still in cache
+    float threshold = SPECTRUM_ROLLOFF * sum_mag;
+    float acc = 0.0f;
+    size_t q = 1;
+    for (; q + 1 < q_end; ++q) {
+      acc += s->out_mag[q];
+      if (acc >= threshold) break;
+    }
+    s->features.rolloff = (float) q / (float) n;
+  }
+  if (want_flatness) {
+    size_t bins = q_end - 1;
+    s->features.flatness = sum_pow > 0.0f ? expf(sum_log / bins) / (sum_pow / bins) : 0.0f;
+  }
+  if (want_flux) {
+    s->features.flux = sqrtf(sum_flux);
+  }
+
   // Normalize Frequencies to 0..1 range
   for (size_t i = 0; i < m; ++i) {
     s->out_log[i] /= max_amp;
@@ -123,7 +370,8 @@ SPECTRUM_DEF void spectrum_analyze(Spectrum *s, float dt) {
 }
 
 SPECTRUM_DEF void spectrum_fft(float in[], size_t stride, Spectrum_Complex out[], size_t n) {
-  assert(n > 0);
+  // Radix-2 only, use a Spectrum_Plan for other lengths
+  assert(n > 0 && (n & (n - 1)) == 0);
 
   if (n == 1) {
     out[0].real = in[0];
@@ -145,6 +393,530 @@ SPECTRUM_DEF void spectrum_fft(float in[], size_t stride, Spectrum_Complex out[]
   }
 }
 
+/////////////////////////////////////////////////////////////////////////////////
+
+SPECTRUM_DEF void spectrum_plan_bfly2(const Spectrum_Plan *p, Spectrum_Complex *out, size_t fstride, size_t m) {
+  for (size_t k = 0; k < m; ++k) {
+    Spectrum_Complex t = spectrum_complex_mul(out[k + m], p->twiddles[k*fstride]);
+    out[k + m] = spectrum_complex_sub(out[k], t);
+    out[k]     = spectrum_complex_add(out[k], t);
+  }
+}
+
+SPECTRUM_DEF void spectrum_plan_bfly3(const Spectrum_Plan *p, Spectrum_Complex *out, size_t fstride, size_t m) {
+  float epi3 = p->twiddles[fstride*m].imag;
+
+  for (size_t k = 0; k < m; ++k) {
+    Spectrum_Complex s1 = spectrum_complex_mul(out[k + m],   p->twiddles[k*fstride]);
+    Spectrum_Complex s2 = spectrum_complex_mul(out[k + 2*m], p->twiddles[2*k*fstride]);
+    Spectrum_Complex s3 = spectrum_complex_add(s1, s2);
+    Spectrum_Complex s0 = spectrum_complex_sub(s1, s2);
+    s0.real *= epi3;
+    s0.imag *= epi3;
+
+    Spectrum_Complex e = {
+      .real = out[k].real - 0.5f*s3.real,
+      .imag = out[k].imag - 0.5f*s3.imag,
+    };
+    out[k] = spectrum_complex_add(out[k], s3);
+    out[k + 2*m] = (Spectrum_Complex) { .real = e.real + s0.imag, .imag = e.imag - s0.real };
+    out[k + m]   = (Spectrum_Complex) { .real = e.real - s0.imag, .imag = e.imag + s0.real };
+  }
+}
+
+SPECTRUM_DEF void spectrum_plan_bfly4(const Spectrum_Plan *p, Spectrum_Complex *out, size_t fstride, size_t m) {
+  for (size_t k = 0; k < m; ++k) {
+    Spectrum_Complex s0 = spectrum_complex_mul(out[k + m],   p->twiddles[k*fstride]);
+    Spectrum_Complex s1 = spectrum_complex_mul(out[k + 2*m], p->twiddles[2*k*fstride]);
+    Spectrum_Complex s2 = spectrum_complex_mul(out[k + 3*m], p->twiddles[3*k*fstride]);
+
+    Spectrum_Complex s5 = spectrum_complex_sub(out[k], s1);
+    Spectrum_Complex e  = spectrum_complex_add(out[k], s1);
+    Spectrum_Complex s3 = spectrum_complex_add(s0, s2);
+    Spectrum_Complex s4 = spectrum_complex_sub(s0, s2);
+
+    out[k + 2*m] = spectrum_complex_sub(e, s3);
+    out[k]       = spectrum_complex_add(e, s3);
+    out[k + m]   = (Spectrum_Complex) { .real = s5.real + s4.imag, .imag = s5.imag - s4.real };
+    out[k + 3*m] = (Spectrum_Complex) { .real = s5.real - s4.imag, .imag = s5.imag + s4.real };
+  }
+}
+
+SPECTRUM_DEF void spectrum_plan_bfly5(const Spectrum_Plan *p, Spectrum_Complex *out, size_t fstride, size_t m) {
+  Spectrum_Complex ya = p->twiddles[fstride*m];
+  Spectrum_Complex yb = p->twiddles[2*fstride*m];
+
+  for (size_t k = 0; k < m; ++k) {
+    Spectrum_Complex s0 = out[k];
+    Spectrum_Complex s1 = spectrum_complex_mul(out[k + m],   p->twiddles[k*fstride]);
+    Spectrum_Complex s2 = spectrum_complex_mul(out[k + 2*m], p->twiddles[2*k*fstride]);
+    Spectrum_Complex s3 = spectrum_complex_mul(out[k + 3*m], p->twiddles[3*k*fstride]);
+    Spectrum_Complex s4 = spectrum_complex_mul(out[k + 4*m], p->twiddles[4*k*fstride]);
+
+    Spectrum_Complex s7  = spectrum_complex_add(s1, s4);
+    Spectrum_Complex s10 = spectrum_complex_sub(s1, s4);
+    Spectrum_Complex s8  = spectrum_complex_add(s2, s3);
+    Spectrum_Complex s9  = spectrum_complex_sub(s2, s3);
+
+    out[k].real = s0.real + s7.real + s8.real;
+    out[k].imag = s0.imag + s7.imag + s8.imag;
+
+    Spectrum_Complex s5 = {
+      .real = s0.real + s7.real*ya.real + s8.real*yb.real,
+      .imag = s0.imag + s7.imag*ya.real + s8.imag*yb.real,
+    };
+    Spectrum_Complex s6 = {
+      .real =  s10.imag*ya.imag + s9.imag*yb.imag,
+      .imag = -s10.real*ya.imag - s9.real*yb.imag,
+    };
+    out[k + m]   = spectrum_complex_sub(s5, s6);
+    out[k + 4*m] = spectrum_complex_add(s5, s6);
+
+    Spectrum_Complex s11 = {
+      .real = s0.real + s7.real*yb.real + s8.real*ya.real,
+      .imag = s0.imag + s7.imag*yb.real + s8.imag*ya.real,
+    };
+    Spectrum_Complex s12 = {
+      .real = -s10.imag*yb.imag + s9.imag*ya.imag,
+      .imag =  s10.real*yb.imag - s9.real*ya.imag,
+    };
+    out[k + 2*m] = spectrum_complex_add(s11, s12);
+    out[k + 3*m] = spectrum_complex_sub(s11, s12);
+  }
+}
+
+// Decimation in time: recursively transform the `radix` interleaved
+// sub-sequences of length m, then combine them with one butterfly pass.
+SPECTRUM_DEF void spectrum_plan_work(const Spectrum_Plan *p, Spectrum_Complex *out, const Spectrum_Complex *in, size_t fstride, const size_t *factors) {
+  size_t radix = factors[0];
+  size_t m = factors[1];
+
+  for (size_t r = 0; r < radix; ++r) {
+    if (m == 1) {
+      out[r] = in[r*fstride];
+    } else {
+      spectrum_plan_work(p, out + r*m, in + r*fstride, fstride*radix, factors + 2);
+    }
+  }
+
+  switch (radix) {
+  case 2: spectrum_plan_bfly2(p, out, fstride, m); break;
+  case 3: spectrum_plan_bfly3(p, out, fstride, m); break;
+  case 4: spectrum_plan_bfly4(p, out, fstride, m); break;
+  case 5: spectrum_plan_bfly5(p, out, fstride, m); break;
+  default: assert(!"unreachable");
+  }
+}
+
+SPECTRUM_DEF bool spectrum_plan_factor(size_t *factors, size_t n) {
+  static const size_t radices[] = {4, 2, 3, 5};
+  size_t k = 0;
+
+  for (size_t r = 0; r < sizeof(radices)/sizeof(radices[0]); ++r) {
+    while (n > 1 && n % radices[r] == 0) {
+      assert(k < SPECTRUM_PLAN_MAX_FACTORS);
+      n /= radices[r];
+      factors[2*k + 0] = radices[r];
+      factors[2*k + 1] = n;
+      k++;
+    }
+  }
+
+  return n == 1;
+}
+
+SPECTRUM_DEF bool spectrum_plan_init(Spectrum_Plan *p, size_t n) {
+  memset(p, 0, sizeof(*p));
+  if (n == 0) {
+    return false;
+  }
+  p->n = n;
+
+  p->scratch = malloc(n * sizeof(*p->scratch));
+  if (!p->scratch) {
+    spectrum_plan_free(p);
+    return false;
+  }
+
+  if (n == 1 || spectrum_plan_factor(p->factors, n)) {
+    p->twiddles = malloc(n * sizeof(*p->twiddles));
+    if (!p->twiddles) {
+      spectrum_plan_free(p);
+      return false;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      double x = -2*3.141592653589793*(double) i/n;
+      p->twiddles[i] = (Spectrum_Complex) { .real = (float) cos(x), .imag = (float) sin(x) };
+    }
+
+    return true;
+  }
+
+  // Bluestein - https://en.wikipedia.org/wiki/Chirp_Z-transform#Bluestein's_algorithm
+  size_t m = 1;
+  while (m < 2*n - 1) m *= 2;
+
+  p->sub = malloc(sizeof(*p->sub));
+  p->chirp = malloc(n * sizeof(*p->chirp));
+  p->chirp_fft = malloc(m * sizeof(*p->chirp_fft));
+  p->work = malloc(m * sizeof(*p->work));
+  if (!p->sub || !p->chirp || !p->chirp_fft || !p->work) {
+    spectrum_plan_free(p);
+    return false;
+  }
+  if (!spectrum_plan_init(p->sub, m)) {
+    free(p->sub);
+    p->sub = NULL;
+    spectrum_plan_free(p);
+    return false;
+  }
+
+  for (size_t k = 0; k < n; ++k) {
+    // k*k mod 2n keeps the argument small for large n
+    size_t kk = (size_t) (((unsigned long long) k*k) % (2*n));
+    double x = -3.141592653589793*(double) kk/n;
+    p->chirp[k] = (Spectrum_Complex) { .real = (float) cos(x), .imag = (float) sin(x) };
+  }
+
+  memset(p->work, 0, m * sizeof(*p->work));
+  p->work[0] = (Spectrum_Complex) { .real = p->chirp[0].real, .imag = -p->chirp[0].imag };
+  for (size_t k = 1; k < n; ++k) {
+    Spectrum_Complex c = { .real = p->chirp[k].real, .imag = -p->chirp[k].imag };
+    p->work[k] = c;
+    p->work[m - k] = c;
+  }
+  spectrum_plan_cfft(p->sub, p->work, p->chirp_fft);
+
+  return true;
+}
+
+SPECTRUM_DEF void spectrum_plan_cfft(Spectrum_Plan *p, const Spectrum_Complex in[], Spectrum_Complex out[]) {
+  if (p->n == 1) {
+    out[0] = in[0];
+    return;
+  }
+
+  if (!p->sub) {
+    spectrum_plan_work(p, out, in, 1, p->factors);
+    return;
+  }
+
+  size_t n = p->n;
+  size_t m = p->sub->n;
+
+  for (size_t k = 0; k < n; ++k) {
+    p->scratch[k] = spectrum_complex_mul(in[k], p->chirp[k]);
+  }
+  memset(p->work, 0, m * sizeof(*p->work));
+  memcpy(p->work, p->scratch, n * sizeof(*p->work));
+
+  // Convolve with the chirp: forward, multiply, then inverse by conjugation
+  Spectrum_Complex *tmp = p->sub->scratch;
+  spectrum_plan_cfft(p->sub, p->work, tmp);
+  for (size_t k = 0; k < m; ++k) {
+    Spectrum_Complex z = spectrum_complex_mul(tmp[k], p->chirp_fft[k]);
+    p->work[k] = (Spectrum_Complex) { .real = z.real, .imag = -z.imag };
+  }
+  spectrum_plan_cfft(p->sub, p->work, tmp);
+
+  float scale = 1.0f / (float) m;
+  for (size_t k = 0; k < n; ++k) {
+    Spectrum_Complex z = { .real = tmp[k].real*scale, .imag = -tmp[k].imag*scale };
+    out[k] = spectrum_complex_mul(z, p->chirp[k]);
+  }
+}
+
+SPECTRUM_DEF void spectrum_plan_fft(Spectrum_Plan *p, float in[], size_t stride, Spectrum_Complex out[]) {
+  Spectrum_Complex *z = p->scratch;
+  if (p->sub) {
+    // Bluestein already uses the scratch, go through the output instead
+    z = out;
+  }
+  for (size_t i = 0; i < p->n; ++i) {
+    z[i] = (Spectrum_Complex) { .real = in[i*stride], .imag = 0.0f };
+  }
+
+  spectrum_plan_cfft(p, z, out);
+}
+
+SPECTRUM_DEF void spectrum_plan_icfft(Spectrum_Plan *p, const Spectrum_Complex in[], Spectrum_Complex out[]) {
+  // ifft(x) = conj(fft(conj(x))) / n
+  for (size_t k = 0; k < p->n; ++k) {
+    p->scratch[k] = (Spectrum_Complex) { .real = in[k].real, .imag = -in[k].imag };
+  }
+
+  spectrum_plan_cfft(p, p->scratch, out);
+
+  float scale = 1.0f / (float) p->n;
+  for (size_t k = 0; k < p->n; ++k) {
+    out[k].real *= scale;
+    out[k].imag *= -scale;
+  }
+}
+
+SPECTRUM_DEF void spectrum_plan_free(Spectrum_Plan *p) {
+  if (p->sub) {
+    spectrum_plan_free(p->sub);
+    free(p->sub);
+  }
+  free(p->twiddles);
+  free(p->scratch);
+  free(p->chirp);
+  free(p->chirp_fft);
+  free(p->work);
+  memset(p, 0, sizeof(*p));
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+SPECTRUM_DEF bool spectrum_convolver_init(Spectrum_Convolver *c, const float *taps, size_t taps_count, size_t block) {
+  memset(c, 0, sizeof(*c));
+  if (taps_count == 0 || block == 0) {
+    return false;
+  }
+
+  size_t bins = block + 1;
+  c->block = block;
+  c->partitions = (taps_count + block - 1) / block;
+
+  if (!spectrum_plan_init(&c->plan, 2*block)) {
+    return false;
+  }
+
+  c->filter = malloc(c->partitions * bins * sizeof(*c->filter));
+  c->fdl = calloc(c->partitions * bins, sizeof(*c->fdl));
+  c->in = calloc(2*block, sizeof(*c->in));
+  c->out = calloc(block, sizeof(*c->out));
+  c->acc = malloc(2*block * sizeof(*c->acc));
+  c->tmp = malloc(2*block * sizeof(*c->tmp));
+  if (!c->filter || !c->fdl || !c->in || !c->out || !c->acc || !c->tmp) {
+    spectrum_convolver_free(c);
+    return false;
+  }
+
+  // Each partition is zero-padded to 2*block, only the non-redundant half
+  // of the spectrum is kept since the input is real
+  for (size_t p = 0; p < c->partitions; ++p) {
+    size_t len = taps_count - p*block;
+    if (len > block) len = block;
+
+    memset(c->in, 0, 2*block * sizeof(*c->in));
+    memcpy(c->in, taps + p*block, len * sizeof(*c->in));
+    spectrum_plan_fft(&c->plan, c->in, 1, c->tmp);
+    memcpy(c->filter + p*bins, c->tmp, bins * sizeof(*c->filter));
+  }
+  memset(c->in, 0, 2*block * sizeof(*c->in));
+
+  return true;
+}
+
+SPECTRUM_DEF void spectrum_convolver_block(Spectrum_Convolver *c) {
+  size_t b = c->block;
+  size_t bins = b + 1;
+  size_t partitions = c->partitions;
+
+  spectrum_plan_fft(&c->plan, c->in, 1, c->tmp);
+  memcpy(c->fdl + c->fdl_pos*bins, c->tmp, bins * sizeof(*c->fdl));
+
+  // Partition p is paired with the input spectrum from p blocks ago
+  memset(c->acc, 0, bins * sizeof(*c->acc));
+  for (size_t p = 0; p < partitions; ++p) {
+    size_t slot = (c->fdl_pos + partitions - p) % partitions;
+    const Spectrum_Complex *x = c->fdl + slot*bins;
+    const Spectrum_Complex *h = c->filter + p*bins;
+    for (size_t k = 0; k < bins; ++k) {
+      c->acc[k].real += x[k].real*h[k].real - x[k].imag*h[k].imag;
+      c->acc[k].imag += x[k].real*h[k].imag + x[k].imag*h[k].real;
+    }
+  }
+  c->fdl_pos = (c->fdl_pos + 1) % partitions;
+
+  for (size_t k = 1; k < b; ++k) {
+    c->acc[2*b - k] = (Spectrum_Complex) { .real = c->acc[k].real, .imag = -c->acc[k].imag };
+  }
+  spectrum_plan_icfft(&c->plan, c->acc, c->tmp);
+
+  // Overlap-save: the first half is circular garbage, keep the second
+  for (size_t i = 0; i < b; ++i) {
+    c->out[i] = c->tmp[b + i].real;
+  }
+  memcpy(c->in, c->in + b, b * sizeof(*c->in));
+}
+
+SPECTRUM_DEF void spectrum_convolver_process(Spectrum_Convolver *c, const float *in, size_t in_stride, float *out, size_t out_stride, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    float x = in[i*in_stride];
+    c->in[c->block + c->pos] = x;
+    out[i*out_stride] = c->out[c->pos];
+
+    if (++c->pos == c->block) {
+      spectrum_convolver_block(c);
+      c->pos = 0;
+    }
+  }
+}
+
+SPECTRUM_DEF void spectrum_convolver_free(Spectrum_Convolver *c) {
+  spectrum_plan_free(&c->plan);
+  free(c->filter);
+  free(c->fdl);
+  free(c->in);
+  free(c->out);
+  free(c->acc);
+  free(c->tmp);
+  memset(c, 0, sizeof(*c));
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+SPECTRUM_DEF bool spectrum_welch_init(Spectrum_Welch *w, size_t n, float alpha, uint64_t bucket_frames) {
+  memset(w, 0, sizeof(*w));
+  if (n < 2 || bucket_frames == 0 || alpha <= 0.0f || alpha > 1.0f) {
+    return false;
+  }
+
+  w->n = n;
+  w->bins = n/2 + 1;
+  w->alpha = alpha;
+  w->bucket_frames = bucket_frames;
+
+  // Same window as spectrum_analyze
+  double hann_sq = 0.0;
+  for (size_t i = 0; i < n; ++i) {
+    float t = (float)i/(n - 1);
+    float hann = 0.5 - 0.5*cosf(2*PI*t);
+    hann_sq += hann*hann;
+  }
+  w->scale = (float) (1.0 / hann_sq);
+
+  w->total = calloc(w->bins, sizeof(*w->total));
+  w->total_c = calloc(w->bins, sizeof(*w->total_c));
+  w->ew = calloc(w->bins, sizeof(*w->ew));
+  w->buckets = calloc(SPECTRUM_WELCH_BUCKETS * w->bins, sizeof(*w->buckets));
+  w->buckets_c = calloc(SPECTRUM_WELCH_BUCKETS * w->bins, sizeof(*w->buckets_c));
+  if (!w->total || !w->total_c || !w->ew || !w->buckets || !w->buckets_c) {
+    spectrum_welch_free(w);
+    return false;
+  }
+
+  return true;
+}
+
+SPECTRUM_DEF void spectrum_welch_push(Spectrum_Welch *w, const Spectrum_Complex *spectrum) {
+  size_t bins = w->bins;
+
+  // Start a new bucket, dropping the oldest one out of the window
+  if (w->bucket_counts[w->bucket] == w->bucket_frames) {
+    size_t next = (w->bucket + 1) % SPECTRUM_WELCH_BUCKETS;
+    spectrum_seq_begin(&w->seq);
+    for (size_t k = 0; k < bins; ++k) {
+      spectrum_seq_setf(&w->buckets[next*bins + k], 0.0f);
+    }
+    memset(w->buckets_c + next*bins, 0, bins * sizeof(*w->buckets_c));
+    spectrum_seq_set64(&w->bucket_counts[next], 0);
+    w->bucket = next;
+    spectrum_seq_end(&w->seq);
+  }
+
+  float alpha = w->alpha;
+  float *bucket = w->buckets + w->bucket*bins;
+  float *bucket_c = w->buckets_c + w->bucket*bins;
+
+  spectrum_seq_begin(&w->seq);
+
+  for (size_t k = 0; k < bins; ++k) {
+    float re = spectrum[k].real;
+    float im = spectrum[k].imag;
+    // One-sided: fold the negative frequencies onto the positive ones
+    float p = (re*re + im*im) * w->scale;
+    if (k != 0 && k != w->n/2) p *= 2.0f;
+
+    // Only this thread writes, so plain reads are fine here
+    float total = w->total[k];
+    float sum = bucket[k];
+    spectrum_kahan_add(&total, &w->total_c[k], p);
+    spectrum_kahan_add(&sum, &bucket_c[k], p);
+    spectrum_seq_setf(&w->total[k], total);
+    spectrum_seq_setf(&bucket[k], sum);
+    spectrum_seq_setf(&w->ew[k], w->ew[k] + (p - w->ew[k])*alpha);
+  }
+  spectrum_seq_set64(&w->total_frames, w->total_frames + 1);
+  spectrum_seq_setf(&w->ew_weight, w->ew_weight + (1.0f - w->ew_weight)*alpha);
+  spectrum_seq_set64(&w->bucket_counts[w->bucket], w->bucket_counts[w->bucket] + 1);
+
+  spectrum_seq_end(&w->seq);
+}
+
+// Kahan summation - https://en.wikipedia.org/wiki/Kahan_summation_algorithm
+SPECTRUM_DEF void spectrum_kahan_add(float *sum, float *c, float x) {
+  float y = x - *c;
+  float t = *sum + y;
+  *c = (t - *sum) - y;
+  *sum = t;
+}
+
+// Returns the number of frames the snapshot covers
+SPECTRUM_DEF uint64_t spectrum_welch_snapshot(Spectrum_Welch *w, Spectrum_Welch_Kind kind, float *out) {
+  size_t bins = w->bins;
+  uint64_t frames;
+  unsigned int seq;
+
+  do {
+    seq = spectrum_seq_load(&w->seq);
+    if (seq & 1) continue;
+
+    frames = 0;
+    switch (kind) {
+    case SPECTRUM_WELCH_TOTAL: {
+      frames = spectrum_seq_get64(&w->total_frames);
+      float scale = frames ? 1.0f / (float) frames : 0.0f;
+      for (size_t k = 0; k < bins; ++k) {
+	out[k] = spectrum_seq_getf(&w->total[k])*scale;
+      }
+    } break;
+    case SPECTRUM_WELCH_EXPONENTIAL: {
+      frames = spectrum_seq_get64(&w->total_frames);
+      // Divide by the accumulated weight to remove the startup bias
+      float weight = spectrum_seq_getf(&w->ew_weight);
+      float scale = weight > 0.0f ? 1.0f / weight : 0.0f;
+      for (size_t k = 0; k < bins; ++k) {
+	out[k] = spectrum_seq_getf(&w->ew[k])*scale;
+      }
+    } break;
+    case SPECTRUM_WELCH_WINDOW: {
+      memset(out, 0, bins * sizeof(*out));
+      for (size_t b = 0; b < SPECTRUM_WELCH_BUCKETS; ++b) {
+	const float *bucket = w->buckets + b*bins;
+	for (size_t k = 0; k < bins; ++k) {
+	  out[k] += spectrum_seq_getf(&bucket[k]);
+	}
+	frames += spectrum_seq_get64(&w->bucket_counts[b]);
+      }
+      float scale = frames ? 1.0f / (float) frames : 0.0f;
+      for (size_t k = 0; k < bins; ++k) {
+	out[k] *= scale;
+      }
+    } break;
+    default: {
+      return 0;
+    }
+    }
+
+    spectrum_seq_fence();
+  } while ((seq & 1) || spectrum_seq_load(&w->seq) != seq);
+
+  return frames;
+}
+
+SPECTRUM_DEF void spectrum_welch_free(Spectrum_Welch *w) {
+  free(w->total);
+  free(w->total_c);
+  free(w->ew);
+  free(w->buckets);
+  free(w->buckets_c);
+  memset(w, 0, sizeof(*w));
+}
+
 SPECTRUM_DEF float spectrum_amp(Spectrum_Complex z) {
   float a = z.real;
   float b = z.imag;
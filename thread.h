@@ -7,12 +7,15 @@
 
 //#include <process.h>
 typedef HANDLE Thread;
-typedef HANDLE Mutex;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Cond;
 //TODO implement for gcc
 #elif __GNUC__ ////////////////////////////////////////////
 #include <pthread.h>
+#include <time.h>
 typedef pthread_t Thread;
 typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
 #endif
 
 #include <stdint.h> // for uintptr_t
@@ -22,8 +25,15 @@ void thread_join(Thread id);
 void thread_sleep(int ms);
 
 int mutex_create(Mutex* mutex);
-void mutex_lock(Mutex mutex);
-void mutex_release(Mutex mutex);
+void mutex_lock(Mutex *mutex);
+void mutex_release(Mutex *mutex);
+void mutex_free(Mutex *mutex);
+
+int cond_create(Cond *cond);
+void cond_wait(Cond *cond, Mutex *mutex);
+void cond_signal(Cond *cond);
+void cond_broadcast(Cond *cond);
+void cond_free(Cond *cond);
 
 #ifdef THREAD_IMPLEMENTATION
 
@@ -59,16 +69,41 @@ void thread_sleep(int ms) {
 }
 
 int mutex_create(Mutex* mutex) {
-    *mutex = CreateMutexW(NULL, FALSE, NULL);
-    return *mutex != NULL;
+    InitializeCriticalSection(mutex);
+    return 1;
+}
+
+void mutex_lock(Mutex *mutex) {
+    EnterCriticalSection(mutex);
+}
+
+void mutex_release(Mutex *mutex) {
+    LeaveCriticalSection(mutex);
+}
+
+void mutex_free(Mutex *mutex) {
+    DeleteCriticalSection(mutex);
 }
 
-void mutex_lock(Mutex mutex) {
-    WaitForSingleObject(mutex, INFINITE);
+int cond_create(Cond *cond) {
+    InitializeConditionVariable(cond);
+    return 1;
+}
+
+void cond_wait(Cond *cond, Mutex *mutex) {
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+}
+
+void cond_signal(Cond *cond) {
+    WakeConditionVariable(cond);
+}
+
+void cond_broadcast(Cond *cond) {
+    WakeAllConditionVariable(cond);
 }
 
-void mutex_release(Mutex mutex) {
-    ReleaseMutex(mutex);
+void cond_free(Cond *cond) {
+    (void) cond;
 }
 
 //TODO implement for gcc
@@ -105,12 +140,40 @@ int mutex_create(Mutex *mutex) {
   return 1;
 }
 
-void mutex_lock(Mutex mutex) {
-  pthread_mutex_lock(&mutex);
+void mutex_lock(Mutex *mutex) {
+  pthread_mutex_lock(mutex);
+}
+
+void mutex_release(Mutex *mutex) {
+  pthread_mutex_unlock(mutex);
+}
+
+void mutex_free(Mutex *mutex) {
+  pthread_mutex_destroy(mutex);
+}
+
+int cond_create(Cond *cond) {
+  if(pthread_cond_init(cond, NULL) != 0) {
+    return 0;
+  }
+
+  return 1;
+}
+
+void cond_wait(Cond *cond, Mutex *mutex) {
+  pthread_cond_wait(cond, mutex);
+}
+
+void cond_signal(Cond *cond) {
+  pthread_cond_signal(cond);
+}
+
+void cond_broadcast(Cond *cond) {
+  pthread_cond_broadcast(cond);
 }
 
-void mutex_release(Mutex mutex) {
-  pthread_mutex_unlock(&mutex);
+void cond_free(Cond *cond) {
+  pthread_cond_destroy(cond);
 }
 
 